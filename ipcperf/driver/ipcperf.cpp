@@ -0,0 +1,471 @@
+#include <sys/utsname.h>
+#include <string>
+#include "cellrunner.h"
+
+//
+// Single binary with every transport that builds on this host. It runs one
+// transport by name like the per transport executables do, or a matrix of
+// transports x payload sizes x same/separate process x CPU placement and
+// writes the results as text, JSON or CSV together with the host it ran on.
+//
+// Every matrix cell runs in a forked child, so a transport that exits on an
+// error or hangs past the timeout only loses its own cell. In separate
+// process cells the child forks the server and waits until it is bound.
+//
+
+const char *driverOpts = PERFTEST_OPTS "t:lMf:o:T:v";
+
+enum {
+    OptModes = 1000
+};
+
+const option driverLongOpts[] = {
+    PERFTEST_LONG_OPTS,
+    {"transport", required_argument, NULL, 't'},
+    {"list", no_argument, NULL, 'l'},
+    {"matrix", no_argument, NULL, 'M'},
+    {"modes", required_argument, NULL, OptModes},
+    {"format", required_argument, NULL, 'f'},
+    {"output", required_argument, NULL, 'o'},
+    {"timeout", required_argument, NULL, 'T'},
+    {"verbose", no_argument, NULL, 'v'},
+    {NULL, 0, NULL, 0}
+};
+
+struct HostInfo {
+    std::string hostname;
+    std::string cpuModel;
+    std::string kernel;
+    int numCpus;
+    std::string date;
+};
+
+HostInfo getHostInfo()
+{
+    HostInfo info;
+    char buf[256];
+    info.hostname = gethostname(buf, sizeof(buf)) == 0 ? buf : "unknown";
+    info.cpuModel = "unknown";
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f) {
+        char line[512];
+        while (fgets(line, sizeof(line), f)) {
+            // x86 names it model name, arm64 kernels only have Hardware
+            if (strncmp(line, "model name", 10) == 0
+                    || strncmp(line, "Hardware", 8) == 0) {
+                char *value = strchr(line, ':');
+                if (value) {
+                    value += strspn(value + 1, " \t") + 1;
+                    value[strcspn(value, "\n")] = 0;
+                    info.cpuModel = value;
+                    break;
+                }
+            }
+        }
+        fclose(f);
+    }
+    utsname uts;
+    if (uname(&uts) == 0) {
+        info.kernel = std::string(uts.sysname) + " " + uts.release + " "
+                + uts.machine;
+    }
+    info.numCpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    time_t now = time(NULL);
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    info.date = buf;
+    return info;
+}
+
+std::string jsonString(const std::string &s)
+{
+    std::string out = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"' || s[i] == '\\') {
+            out += '\\';
+        }
+        out += s[i];
+    }
+    return out + "\"";
+}
+
+// Keys of the counters in JSON and CSV
+const char *counterKeys[NumPerfCounters] = {"cycles", "instructions",
+        "cache_misses", "branch_misses", "context_switches", "migrations"};
+
+// A counter object, null when nothing was counted
+void writeJsonCounters(FILE *out, const PerfCounts &counts)
+{
+    bool isCounted = false;
+    for (int i = 0; i < NumPerfCounters; i++) {
+        isCounted = isCounted || counts.values[i] >= 0;
+    }
+    if (!isCounted) {
+        fprintf(out, "null");
+        return;
+    }
+    for (int i = 0; i < NumPerfCounters; i++) {
+        fprintf(out, i ? ", " : "{");
+        if (counts.values[i] < 0) {
+            fprintf(out, "\"%s\": null", counterKeys[i]);
+        } else {
+            fprintf(out, "\"%s\": %.3f", counterKeys[i], counts.values[i]);
+        }
+    }
+    fprintf(out, "}");
+}
+
+// p50 and p99 of each kernel stamp part, null without stamps
+void writeJsonStamps(FILE *out, const ResultRow &r)
+{
+    if (r.stampP50Usec[0] < 0) {
+        fprintf(out, "null");
+        return;
+    }
+    for (int i = 0; i < NumStampParts; i++) {
+        fprintf(out, "%s\"%s\": {\"p50\": %.2f, \"p99\": %.2f}", i ? ", " : "{",
+                StampStats::partName(i), r.stampP50Usec[i], r.stampP99Usec[i]);
+    }
+    fprintf(out, "}");
+}
+
+std::string csvString(const std::string &s)
+{
+    std::string out = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"') {
+            out += '"';
+        }
+        out += s[i];
+    }
+    return out + "\"";
+}
+
+void writeJson(FILE *out, const HostInfo &host, const std::vector<ResultRow> &rows)
+{
+    fprintf(out, "{\n  \"host\": {\"hostname\": %s, \"cpu_model\": %s, "
+            "\"kernel\": %s, \"cpus\": %d, \"date\": %s},\n  \"results\": [",
+            jsonString(host.hostname).c_str(), jsonString(host.cpuModel).c_str(),
+            jsonString(host.kernel).c_str(), host.numCpus,
+            jsonString(host.date).c_str());
+    for (size_t i = 0; i < rows.size(); i++) {
+        const ResultRow &r = rows[i];
+        fprintf(out, "%s\n    {\"transport\": \"%s\", \"mode\": \"%s\", "
+                "\"placement\": \"%s\", \"client_cpu\": %d, \"server_cpu\": %d, "
+                "\"stream\": %s, \"clients\": %d, \"payload\": \"%s\", "
+                "\"window\": %d, \"offered_rate\": %.0f, \"messages\": %d, \"bytes\": %llu, "
+                "\"elapsed_ns\": %llu, \"cpu_ns\": %llu, "
+                "\"msgs_per_sec\": %.0f, \"mb_per_sec\": %.3f, "
+                "\"cycles_per_byte\": %.3f, \"fairness\": %.4f, "
+                "\"send_calls_per_msg\": %.3f, "
+                "\"queue_delay_usec\": {\"mean\": %.2f, \"p99\": %.2f}, "
+                "\"backlog\": {\"blocked\": %llu, \"peak_bytes\": %llu}, "
+                "\"client_rate\": {\"min\": %.0f, \"mean\": %.0f, \"max\": %.0f}, "
+                "\"latency_usec\": {\"mean\": %.2f, \"p50\": %.2f, \"p90\": %.2f, "
+                "\"p99\": %.2f, \"p99.9\": %.2f, \"max\": %.2f}, ",
+                i ? "," : "", r.transport, r.mode, r.placement, r.clientCpu,
+                r.serverCpu, r.isStream ? "true" : "false",
+                r.numClients, r.payload, r.window, r.offeredRate, r.numMessages,
+                (unsigned long long) r.numBytes,
+                (unsigned long long) r.elapsedNanos,
+                (unsigned long long) r.cpuNanos, r.msgsPerSec, r.mbPerSec,
+                r.cyclesPerByte, r.fairness, r.sendCallsPerMessage,
+                r.queueDelayMeanUsec, r.queueDelayP99Usec,
+                (unsigned long long) r.numBlocked,
+                (unsigned long long) r.peakBacklogBytes, r.minClientRate,
+                r.meanClientRate, r.maxClientRate, r.meanUsec, r.p50Usec,
+                r.p90Usec, r.p99Usec, r.p999Usec, r.maxUsec);
+        fprintf(out, "\"counters_per_msg\": {\"client\": ");
+        writeJsonCounters(out, r.clientCounters);
+        fprintf(out, ", \"server\": ");
+        writeJsonCounters(out, r.serverCounters);
+        fprintf(out, "}, \"kernel_stamps_usec\": ");
+        writeJsonStamps(out, r);
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+// The host columns repeat on every row so each row stands on its own
+void writeCsv(FILE *out, const HostInfo &host, const std::vector<ResultRow> &rows)
+{
+    fprintf(out, "hostname,cpu_model,kernel,cpus,date,transport,mode,placement,"
+            "client_cpu,server_cpu,stream,"
+            "clients,payload,window,offered_rate,messages,bytes,elapsed_ns,cpu_ns,"
+            "msgs_per_sec,mb_per_sec,cycles_per_byte,fairness,send_calls_per_msg,"
+            "queue_delay_mean_usec,queue_delay_p99_usec,backlog_blocked,"
+            "backlog_peak_bytes,client_rate_min,"
+            "client_rate_mean,client_rate_max,mean_usec,p50_usec,p90_usec,"
+            "p99_usec,p99.9_usec,max_usec");
+    for (int side = 0; side < 2; side++) {
+        for (int i = 0; i < NumPerfCounters; i++) {
+            fprintf(out, ",%s_%s", side ? "server" : "client", counterKeys[i]);
+        }
+    }
+    for (int i = 0; i < NumStampParts; i++) {
+        fprintf(out, ",stamp_%s_p50_usec,stamp_%s_p99_usec",
+                StampStats::partName(i), StampStats::partName(i));
+    }
+    fprintf(out, "\n");
+    for (size_t i = 0; i < rows.size(); i++) {
+        const ResultRow &r = rows[i];
+        fprintf(out, "%s,%s,%s,%d,%s,%s,%s,%s,%d,%d,%d,%d,%s,%d,%.0f,%d,%llu,%llu,%llu,"
+                "%.0f,%.3f,%.3f,%.4f,%.3f,%.2f,%.2f,%llu,%llu,%.0f,%.0f,%.0f,%.2f,"
+                "%.2f,%.2f,%.2f,%.2f,%.2f",
+                csvString(host.hostname).c_str(), csvString(host.cpuModel).c_str(),
+                csvString(host.kernel).c_str(), host.numCpus,
+                host.date.c_str(), r.transport, r.mode, r.placement, r.clientCpu,
+                r.serverCpu, r.isStream, r.numClients,
+                r.payload, r.window, r.offeredRate, r.numMessages,
+                (unsigned long long) r.numBytes,
+                (unsigned long long) r.elapsedNanos,
+                (unsigned long long) r.cpuNanos, r.msgsPerSec, r.mbPerSec,
+                r.cyclesPerByte, r.fairness, r.sendCallsPerMessage,
+                r.queueDelayMeanUsec, r.queueDelayP99Usec,
+                (unsigned long long) r.numBlocked,
+                (unsigned long long) r.peakBacklogBytes, r.minClientRate,
+                r.meanClientRate, r.maxClientRate, r.meanUsec, r.p50Usec,
+                r.p90Usec, r.p99Usec, r.p999Usec, r.maxUsec);
+        // Empty where not counted
+        for (int side = 0; side < 2; side++) {
+            const PerfCounts &counts = side ? r.serverCounters : r.clientCounters;
+            for (int i = 0; i < NumPerfCounters; i++) {
+                if (counts.values[i] < 0) {
+                    fprintf(out, ",");
+                } else {
+                    fprintf(out, ",%.3f", counts.values[i]);
+                }
+            }
+        }
+        for (int i = 0; i < NumStampParts; i++) {
+            if (r.stampP50Usec[i] < 0) {
+                fprintf(out, ",,");
+            } else {
+                fprintf(out, ",%.2f,%.2f", r.stampP50Usec[i], r.stampP99Usec[i]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+}
+
+void writeText(FILE *out, const std::vector<ResultRow> &rows)
+{
+    fprintf(out, "%-12s %-9s %-9s %8s %12s %8s %12s %12s %12s %10s %12s %12s\n",
+            "Transport", "Mode", "Placement", "Clients", "Payload", "Window", "Offered",
+            "Msgs/sec", "MB/s", "cycles/B", "p50(usec)", "p99(usec)");
+    for (size_t i = 0; i < rows.size(); i++) {
+        const ResultRow &r = rows[i];
+        char offered[32] = "closed";
+        if (r.offeredRate) {
+            snprintf(offered, sizeof(offered), "%.0f", r.offeredRate);
+        }
+        fprintf(out, "%-12s %-9s %-9s %8d %12s %8d %12s %12.0f %12.2f %10.3f %12.2f %12.2f\n",
+                r.transport, r.mode, r.placement, r.numClients, r.payload, r.window,
+                offered, r.msgsPerSec, r.mbPerSec, r.cyclesPerByte, r.p50Usec, r.p99Usec);
+    }
+}
+
+class DriverArgs: public ArgParser {
+public:
+    std::vector<std::string> transports;
+    std::vector<std::string> modes;
+    bool isList;
+    bool isMatrix;
+    bool isVerbose;
+    const char *pFormat;
+    const char *pOutput;
+    int timeoutSecs;
+
+    DriverArgs() :
+        isList(false),
+        isMatrix(false),
+        isVerbose(false),
+        pFormat("text"),
+        pOutput(NULL),
+        timeoutSecs(120) {
+    }
+
+    static void splitList(const char *spec, std::vector<std::string> &items) {
+        std::string s(spec);
+        size_t begin = 0;
+        while (begin <= s.size()) {
+            size_t end = s.find(',', begin);
+            end = end == std::string::npos ? s.size() : end;
+            if (end > begin) {
+                items.push_back(s.substr(begin, end - begin));
+            }
+            begin = end + 1;
+        }
+    }
+
+    void usage() {
+        fprintf(stderr, "./ipcperf [-l] [-M] [-t transport,...] [--modes same,separate]"
+                " [-P placement,...]"
+                " [-f text|json|csv] [-o file] [-T timeout] [-v] " PERFTEST_USAGE "\n");
+        exit(1);
+    }
+
+    void parseDriverArgs(int argc, char **argv) {
+        int c;
+        while ((c = getopt_long(argc, argv, driverOpts, driverLongOpts, NULL)) != -1) {
+            if (parseOption(c, optarg)) {
+                continue;
+            }
+            switch (c) {
+            case 't': splitList(optarg, transports); break;
+            case 'l': isList = true; break;
+            case 'M': isMatrix = true; break;
+            case OptModes: splitList(optarg, modes); break;
+            case 'f': pFormat = optarg; break;
+            case 'o': pOutput = optarg; break;
+            case 'T': timeoutSecs = atoi(optarg); break;
+            case 'v': isVerbose = true; break;
+            default: usage();
+            }
+        }
+        checkRates();
+        if (strcmp(pFormat, "text") && strcmp(pFormat, "json")
+                && strcmp(pFormat, "csv")) {
+            fprintf(stderr, "Invalid format %s\n", pFormat);
+            exit(1);
+        }
+        if (modes.empty()) {
+            modes.push_back("same");
+            modes.push_back("separate");
+        }
+        for (size_t i = 0; i < modes.size(); i++) {
+            if (modes[i] != "same" && modes[i] != "separate") {
+                fprintf(stderr, "Invalid mode %s\n", modes[i].c_str());
+                exit(1);
+            }
+        }
+    }
+};
+
+const TransportInfo *lookupTransport(const std::string &name)
+{
+    const TransportInfo *info = findTransport(name.c_str());
+    if (!info) {
+        fprintf(stderr, "Unknown transport %s, -l lists them\n", name.c_str());
+        exit(1);
+    }
+    return info;
+}
+
+int main(int argc, char **argv) {
+    DriverArgs args;
+    args.parseDriverArgs(argc, argv);
+    std::vector<TransportInfo> &registry = transportRegistry();
+
+    if (args.isList) {
+        for (size_t i = 0; i < registry.size(); i++) {
+            printf("%-12s %s\n", registry[i].name, registry[i].description);
+        }
+        return 0;
+    }
+
+    std::vector<ResultRow> rows;
+    if (args.isMatrix) {
+        if (args.isClientOnly || args.isServerOnly) {
+            fprintf(stderr, "-c and -s do not apply to a matrix run\n");
+            exit(1);
+        }
+        std::vector<const TransportInfo*> transports;
+        for (size_t i = 0; i < args.transports.size(); i++) {
+            transports.push_back(lookupTransport(args.transports[i]));
+        }
+        if (transports.empty()) {
+            for (size_t i = 0; i < registry.size(); i++) {
+                transports.push_back(&registry[i]);
+            }
+        }
+        std::vector<std::string> placementSpecs;
+        DriverArgs::splitList(args.pPlacement, placementSpecs);
+        std::vector<CpuPlacement> placements;
+        for (size_t i = 0; i < placementSpecs.size(); i++) {
+            CpuPlacement placement;
+            if (resolvePlacement(placementSpecs[i].c_str(), &placement)) {
+                placements.push_back(placement);
+            }
+        }
+        bool isUnixPath = args.pPort[0] == '/';
+        int basePort = atoi(args.pPort);
+        int cell = 0;
+        for (size_t t = 0; t < transports.size(); t++) {
+            for (size_t m = 0; m < args.modes.size(); m++) {
+                for (size_t p = 0; p < placements.size(); p++) {
+                    const TransportInfo *info = transports[t];
+                    bool isSeparate = args.modes[m] == "separate";
+                    if (isSeparate && (info->flags & TransportSameProcessOnly)) {
+                        continue;
+                    }
+                    // Open loops send on timers of the loop
+                    if (!args.rates.empty() && !(info->flags & TransportTimers)) {
+                        continue;
+                    }
+                    // One process runs on one CPU, so it only takes
+                    // placements that do not split client and server
+                    if (!isSeparate
+                            && placements[p].clientCpu != placements[p].serverCpu) {
+                        continue;
+                    }
+                    // A fresh port per cell avoids sockets in TIME_WAIT
+                    char port[32];
+                    snprintf(port, sizeof(port), "%d", basePort + cell++);
+                    DriverArgs cellArgs = args;
+                    if (!isUnixPath) {
+                        cellArgs.pPort = port;
+                    }
+                    cellArgs.placement = placements[p];
+                    fprintf(stderr, "%s %s process, placement %s...", info->name,
+                            args.modes[m].c_str(), placements[p].name);
+                    size_t before = rows.size();
+                    CellStatus status = forkCell(info, isSeparate, cellArgs,
+                            args.isVerbose, args.timeoutSecs, rows);
+                    const char *statusNames[] = {"done", "FAILED", "timed out"};
+                    fprintf(stderr, " %s, %d phases\n", statusNames[status],
+                            (int) (rows.size() - before));
+                }
+            }
+        }
+    } else {
+        if (args.transports.size() != 1) {
+            fprintf(stderr, "Give one transport with -t, or -M for a matrix\n");
+            exit(1);
+        }
+        const TransportInfo *info = lookupTransport(args.transports[0]);
+        args.setPlacement(args.pPlacement);
+        std::vector<PhaseResult> results;
+        const char *mode;
+        if (args.isFork) {
+            runForkedPerfTest(info->factory(), info->factory(), args, &results);
+            mode = "separate";
+        } else {
+            runPerfTest(info->factory(), args, &results);
+            mode = args.isClientOnly ? "client" : "same";
+        }
+        for (size_t i = 0; i < results.size(); i++) {
+            rows.push_back(makeRow(info->name, mode, args.isStream,
+                    args.placement, results[i]));
+        }
+        if (!strcmp(args.pFormat, "text") && !args.pOutput) {
+            // The run already printed its own report
+            return 0;
+        }
+    }
+
+    FILE *out = stdout;
+    if (args.pOutput && !(out = fopen(args.pOutput, "w"))) {
+        diep(args.pOutput);
+    }
+    if (!strcmp(args.pFormat, "json")) {
+        writeJson(out, getHostInfo(), rows);
+    } else if (!strcmp(args.pFormat, "csv")) {
+        writeCsv(out, getHostInfo(), rows);
+    } else {
+        writeText(out, rows);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,201 @@
+#pragma once
+#include <signal.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include "perftest.h"
+#include "transport.h"
+
+//
+// Runs one transport in a forked child and passes its phase results back
+// as flat rows, so a transport that exits on an error or hangs past the
+// timeout only loses its own run. Shared by the ipcperf driver matrix and
+// the Google Benchmark cases in tests/ipcbench.cc.
+//
+
+// One phase of one run, flat so a cell can pass it through a pipe
+struct ResultRow {
+    char transport[32];
+    char mode[16];
+    char payload[32];
+    char placement[16];
+    int clientCpu;
+    int serverCpu;
+    int isStream;
+    int numClients;
+    int window;
+    // 0 for a closed loop
+    double offeredRate;
+    int numMessages;
+    uint64_t numBytes;
+    uint64_t elapsedNanos;
+    uint64_t cpuNanos;
+    double msgsPerSec;
+    double mbPerSec;
+    double cyclesPerByte;
+    double fairness;
+    double sendCallsPerMessage;
+    double queueDelayMeanUsec;
+    double queueDelayP99Usec;
+    uint64_t numBlocked;
+    uint64_t peakBacklogBytes;
+    double minClientRate;
+    double meanClientRate;
+    double maxClientRate;
+    double meanUsec;
+    double p50Usec;
+    double p90Usec;
+    double p99Usec;
+    double p999Usec;
+    double maxUsec;
+    // Per message, -1 where not counted
+    PerfCounts clientCounters;
+    PerfCounts serverCounters;
+    // p50 and p99 usec of the kernel stamp parts send, transit, wakeup and
+    // handler, -1 without stamps
+    double stampP50Usec[NumStampParts];
+    double stampP99Usec[NumStampParts];
+};
+
+inline ResultRow makeRow(const char *transport, const char *mode, bool isStream,
+        const CpuPlacement &placement, PhaseResult &r)
+{
+    ResultRow row;
+    memset(&row, 0, sizeof(row));
+    snprintf(row.transport, sizeof(row.transport), "%s", transport);
+    snprintf(row.mode, sizeof(row.mode), "%s", mode);
+    r.size.label(row.payload, sizeof(row.payload));
+    snprintf(row.placement, sizeof(row.placement), "%s", placement.name);
+    row.clientCpu = placement.clientCpu;
+    row.serverCpu = placement.serverCpu;
+    row.isStream = isStream;
+    row.numClients = r.numClients;
+    row.window = r.window;
+    row.offeredRate = r.offeredRate;
+    row.numMessages = r.numMessages;
+    row.numBytes = r.numBytes;
+    row.elapsedNanos = r.elapsedNanos;
+    row.cpuNanos = r.cpuNanos;
+    double secs = r.elapsedNanos ? r.elapsedNanos / 1e9 : 1e-9;
+    row.msgsPerSec = r.numMessages / secs;
+    row.mbPerSec = r.numBytes / secs / 1e6;
+    row.cyclesPerByte = EchoClientGroup::cyclesPerByte(&r);
+    row.fairness = r.fairness;
+    row.sendCallsPerMessage = r.sendCallsPerMessage;
+    row.queueDelayMeanUsec = r.queueDelayMeanUsec;
+    row.queueDelayP99Usec = r.queueDelayP99Usec;
+    row.numBlocked = r.numBlocked;
+    row.peakBacklogBytes = r.peakBacklogBytes;
+    row.minClientRate = r.minClientRate;
+    row.meanClientRate = r.meanClientRate;
+    row.maxClientRate = r.maxClientRate;
+    row.meanUsec = r.histogram.mean() / 1000.0;
+    row.p50Usec = r.histogram.valueAtPercentile(50) / 1000.0;
+    row.p90Usec = r.histogram.valueAtPercentile(90) / 1000.0;
+    row.p99Usec = r.histogram.valueAtPercentile(99) / 1000.0;
+    row.p999Usec = r.histogram.valueAtPercentile(99.9) / 1000.0;
+    row.maxUsec = r.histogram.max() / 1000.0;
+    row.clientCounters.clear();
+    row.serverCounters.clear();
+    if (r.hasCounters) {
+        row.clientCounters = r.clientCounters;
+        row.serverCounters = r.serverCounters;
+    }
+    for (int i = 0; i < NumStampParts; i++) {
+        LatencyHistogram *h = r.stamps.part(i);
+        row.stampP50Usec[i] = r.hasStamps ? h->valueAtPercentile(50) / 1000.0 : -1;
+        row.stampP99Usec[i] = r.hasStamps ? h->valueAtPercentile(99) / 1000.0 : -1;
+    }
+    return row;
+}
+
+//
+// Body of a cell child. Writes one ResultRow per phase to resultFd.
+//
+inline void runCell(const TransportInfo *info, bool isSeparate, ArgParser args,
+        int resultFd)
+{
+    std::vector<PhaseResult> results;
+    if (isSeparate) {
+        runForkedPerfTest(info->factory(), info->factory(), args, &results,
+                resultFd);
+    } else {
+        runPerfTest(info->factory(), args, &results);
+    }
+    for (size_t i = 0; i < results.size(); i++) {
+        ResultRow row = makeRow(info->name, isSeparate ? "separate" : "same",
+                args.isStream, args.placement, results[i]);
+        if (write(resultFd, &row, sizeof(row)) != sizeof(row)) {
+            diep("write");
+        }
+    }
+    fflush(stdout);
+    _exit(0);
+}
+
+enum CellStatus {
+    CellDone,
+    CellFailed,
+    CellTimedOut
+};
+
+// Forks a cell and collects its rows. The cell's stdout goes to /dev/null
+// unless isVerbose.
+inline CellStatus forkCell(const TransportInfo *info, bool isSeparate,
+        ArgParser &args, bool isVerbose, int timeoutSecs,
+        std::vector<ResultRow> &rows)
+{
+    int resultPipe[2];
+    dieif(pipe(resultPipe) == -1, "pipe");
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    dieif(pid == -1, "fork");
+    if (pid == 0) {
+        // Own process group, so a timeout also takes down a forked server
+        setpgid(0, 0);
+        close(resultPipe[0]);
+        if (!isVerbose) {
+            int devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+        runCell(info, isSeparate, args, resultPipe[1]);
+    }
+    close(resultPipe[1]);
+    uint64_t deadline = getMonotonicNanos() + timeoutSecs * 1000000000ULL;
+    ResultRow row;
+    size_t got = 0;
+    bool timedOut = false;
+    while (true) {
+        uint64_t now = getMonotonicNanos();
+        if (now >= deadline) {
+            timedOut = true;
+            break;
+        }
+        pollfd pfd = {resultPipe[0], POLLIN, 0};
+        if (poll(&pfd, 1, (int) ((deadline - now) / 1000000) + 1) <= 0) {
+            continue;
+        }
+        ssize_t n = read(resultPipe[0], (char*) &row + got, sizeof(row) - got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+        if (got == sizeof(row)) {
+            rows.push_back(row);
+            got = 0;
+        }
+    }
+    close(resultPipe[0]);
+    if (timedOut) {
+        kill(-pid, SIGKILL);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    // Reap a server left behind by a cell that died
+    kill(-pid, SIGKILL);
+    if (timedOut) {
+        return CellTimedOut;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? CellDone : CellFailed;
+}
@@ -1,68 +1,1040 @@
 #pragma once
+#include <math.h>
+#include <map>
+#include <vector>
 #include "framework.h"
+#include "histogram.h"
+#include "cputime.h"
+#include "perfcounters.h"
+#include "outqueue.h"
+#include "sockstamps.h"
+#include "framing.h"
 
-static const char client_message[] = "Hello from client!";
-static const char server_message[] = "Hello from server!";
+// Size of the original "Hello from client!" message, used when no payload
+// size is given.
+const int DefaultPayloadSize = 19;
 
-class EchoServer: public EventHandler {
+//
+// Every message is a frame (see framing.h) and a message size counts the
+// frame header. The server answers an echo request with a reply carrying
+// the same sequence number and payload. Stream data is not echoed, the
+// server only answers a frame flagged StreamAckRequest with an ack of its
+// sequence number.
+//
+enum EchoFrameType {
+    FrameEchoRequest = 1,
+    FrameEchoReply = 2,
+    FrameStreamData = 3,
+    FrameStreamAck = 4
+};
+const uint16_t StreamAckRequest = 1;
+const uint16_t StreamEnd = 2;
+
+// The client asks for an ack after this many payload bytes or messages,
+// whichever comes first. The message bound keeps small datagrams from
+// overflowing a UDP socket buffer.
+const int StreamAckBytes = 32 * 1024;
+const int StreamAckMessages = 32;
+
+// Acks in flight when no window is given in stream mode
+const int DefaultStreamWindow = 2;
+
+// Every payload byte of a stream frame. The client writes it into the
+// leased send buffer and the server compares the payload against it, so
+// both ends touch every byte as a real producer and consumer would.
+const char StreamFill = 's';
+
+// MaxMessageSize bytes of StreamFill for the server to compare against
+inline const char *streamPattern()
+{
+    static std::vector<char> pattern(MaxMessageSize, StreamFill);
+    return &pattern[0];
+}
+
+// Requests in flight per client when no window is given at a fixed rate
+const int DefaultOpenLoopWindow = 64;
+
+//
+// One entry of the payload size list. A fixed size has minSize == maxSize,
+// a range draws every message size log-uniformly between the bounds so each
+// power of two gets the same share of messages.
+//
+struct PayloadSize {
+    int minSize;
+    int maxSize;
+
+    bool isFixed() const {
+        return minSize == maxSize;
+    }
+
+    // Message size for the next send, rnd is a random 64 bit value
+    int next(uint64_t rnd) const {
+        if (isFixed()) {
+            return minSize;
+        }
+        int lowBits = 31 - __builtin_clz(minSize);
+        int highBits = 31 - __builtin_clz(maxSize);
+        int bits = lowBits + (int) (rnd % (highBits - lowBits + 1));
+        int size = (1 << bits) + (int) ((rnd >> 16) % (1U << bits));
+        if (size < minSize) {
+            return minSize;
+        }
+        return size > maxSize ? maxSize : size;
+    }
+
+    void label(char *buf, size_t len) const {
+        if (isFixed()) {
+            snprintf(buf, len, "%d", minSize);
+        } else {
+            snprintf(buf, len, "%d-%d", minSize, maxSize);
+        }
+    }
+
+    // Parses 4096, 4K or 1M
+    static int parseSize(const char *str, char **end) {
+        long size = strtol(str, end, 10);
+        if (**end == 'k' || **end == 'K') {
+            size *= 1024;
+            (*end)++;
+        } else if (**end == 'm' || **end == 'M') {
+            size *= 1024 * 1024;
+            (*end)++;
+        }
+        return (int) size;
+    }
+
+    // Parses a comma separated list like "16,1K,64K,1M,16-4K". Returns false
+    // on a malformed entry or a size outside FrameHeaderSize..MaxMessageSize.
+    static bool parseList(const char *spec, std::vector<PayloadSize> &sizes) {
+        const char *p = spec;
+        while (*p) {
+            char *end;
+            PayloadSize size;
+            size.minSize = size.maxSize = parseSize(p, &end);
+            if (*end == '-') {
+                size.maxSize = parseSize(end + 1, &end);
+            }
+            if (end == p || (*end && *end != ',') || size.minSize < FrameHeaderSize
+                    || size.maxSize < size.minSize
+                    || size.maxSize > MaxMessageSize) {
+                return false;
+            }
+            sizes.push_back(size);
+            p = *end ? end + 1 : end;
+        }
+        return !sizes.empty();
+    }
+};
+
+// Parses a comma separated list of positive rates like "1000,50K,1M"
+inline bool parseRateList(const char *spec, std::vector<double> &rates)
+{
+    const char *p = spec;
+    while (*p) {
+        char *end;
+        double rate = strtod(p, &end);
+        if (*end == 'k' || *end == 'K') {
+            rate *= 1e3;
+            end++;
+        } else if (*end == 'm' || *end == 'M') {
+            rate *= 1e6;
+            end++;
+        }
+        if (end == p || (*end && *end != ',') || !(rate > 0)) {
+            return false;
+        }
+        rates.push_back(rate);
+        p = *end ? end + 1 : end;
+    }
+    return !rates.empty();
+}
+
+// Parses a comma separated list of positive counts like "1,4,16"
+inline bool parseCountList(const char *spec, std::vector<int> &counts)
+{
+    const char *p = spec;
+    while (*p) {
+        char *end;
+        long count = strtol(p, &end, 10);
+        if (end == p || (*end && *end != ',') || count < 1) {
+            return false;
+        }
+        counts.push_back((int) count);
+        p = *end ? end + 1 : end;
+    }
+    return !counts.empty();
+}
+
+// Results of one client count, payload size, window and rate of a sweep
+struct PhaseResult {
+    PayloadSize size;
+    int window;
+    int numClients;
+    // Messages per second the clients were asked to send, 0 in a closed loop
+    double offeredRate;
+    int numMessages;
+    uint64_t numBytes;
+    uint64_t elapsedNanos;
+    // Process CPU time and bytes sent over the whole phase, warmup included
+    uint64_t cpuNanos;
+    uint64_t totalBytes;
+    // Messages per second of the slowest, average and fastest client
+    double minClientRate;
+    double meanClientRate;
+    double maxClientRate;
+    // Jain's fairness index of the client rates, 1 when all are equal
+    double fairness;
+    // Send calls per message and queueing delay of the output batching in
+    // this process, both 0 on transports without it
+    double sendCallsPerMessage;
+    double queueDelayMeanUsec;
+    double queueDelayP99Usec;
+    // Times a socket of this process filled up and the most bytes its
+    // loop held back for full sockets, see OutputBatcher
+    uint64_t numBlocked;
+    uint64_t peakBacklogBytes;
+    // perf_event counts per message, warmup included, when counting. The
+    // server counts are -1 unless the server is a child of this process;
+    // in one process the client counts cover the server as well.
+    bool hasCounters;
+    PerfCounts clientCounters;
+    PerfCounts serverCounters;
+    // Kernel timestamp breakdown of this process, see sockstamps.h
+    bool hasStamps;
+    StampStats stamps;
+    LatencyHistogram histogram;
+};
+
+// A request the client is waiting for
+struct InFlight {
+    uint32_t seq;
+    int size;
+    uint64_t sendNanos;
+};
+
+// Answers every echo request with a reply of the same payload. The reply
+// is the request frame with its type rewritten, sent from where it lies.
+class EchoServer: public FrameHandler {
 public:
-    EchoServer() {
+    // Slow consumer, see setDelay()
+    uint64_t delayNanos;
+
+    EchoServer() : delayNanos(0) {
         description = "echo server";
     }
-    virtual void process(char *data, int len, bool iseof) {
-        if (strcmp(data, client_message) != 0) {
-            ERROR_OUT("Invalid message from client:%s\n", data);
+
+    // Sleeps this long before each frame, which lets the socket buffers of
+    // the clients fill up
+    void setDelay(uint64_t delayNanos) {
+        this->delayNanos = delayNanos;
+    }
+
+    virtual void processFrame(const FrameHeader &header, char *frame) {
+        sleepNanos(delayNanos);
+        switch (header.type) {
+        case FrameEchoRequest: {
+            INFO_OUT("Server sending response\n");
+            FrameHeader reply = header;
+            reply.type = FrameEchoReply;
+            memcpy(frame, &reply, FrameHeaderSize);
+            send(frame, FrameHeaderSize + header.length, true);
+            break;
+        }
+        default:
+            invalidFrame(header);
+        }
+    }
+};
+
+//
+// Receiving end of stream mode. It checks the payload of every frame and
+// acks the frames that ask for it; frames split across reads are assembled
+// like any other. When reportCpu is set it prints the CPU time it spent
+// per byte each time all streams have ended, which is the server half of
+// the cost when it runs in its own process.
+//
+class StreamServer: public FrameHandler {
+public:
+    // Connections with a stream under way
+    std::map<Context*, bool> streams;
+    int numActive;
+    bool reportCpu;
+    uint64_t numBytes;
+    uint64_t beginCpuNanos;
+    // Slow consumer, as for EchoServer
+    uint64_t delayNanos;
+
+    StreamServer() {
+        numActive = 0;
+        reportCpu = false;
+        numBytes = beginCpuNanos = delayNanos = 0;
+        description = "stream server";
+    }
+
+    void setReportCpu(bool reportCpu) {
+        this->reportCpu = reportCpu;
+    }
+
+    void setDelay(uint64_t delayNanos) {
+        this->delayNanos = delayNanos;
+    }
+
+    // A connection closed in the middle of its stream ends the stream
+    void closed() {
+        std::map<Context*, bool>::iterator it = streams.find(getContext());
+        if (it != streams.end()) {
+            bool isActive = it->second;
+            streams.erase(it);
+            if (isActive) {
+                endStream();
+            }
+        }
+        FrameHandler::closed();
+    }
+
+    void endStream() {
+        if (--numActive || !reportCpu) {
+            return;
+        }
+        uint64_t cpuNanos = getProcessCpuNanos() - beginCpuNanos;
+        printf("Server received %llu bytes, cpu usec %llu, cycles/byte %.3f\n",
+                (unsigned long long) numBytes,
+                (unsigned long long) (cpuNanos / 1000),
+                cpuNanos * getCyclesPerNano() / (numBytes ? numBytes : 1));
+        fflush(stdout);
+    }
+
+    virtual void processFrame(const FrameHeader &header, char *frame) {
+        if (header.type != FrameStreamData) {
+            invalidFrame(header);
+        }
+        if (memcmp(frame + FrameHeaderSize, streamPattern(), header.length)) {
+            ERROR_OUT("Stream frame %u has a corrupt payload\n", header.seq);
             exit(1);
         }
-        INFO_OUT("Server sending response\n");
-        send(server_message, sizeof(server_message), 1);
+        sleepNanos(delayNanos);
+        bool &active = streams[getContext()];
+        if (!active) {
+            active = true;
+            if (!numActive++) {
+                numBytes = 0;
+                beginCpuNanos = getProcessCpuNanos();
+            }
+        }
+        numBytes += FrameHeaderSize + header.length;
+        if (header.flags & StreamAckRequest) {
+            sendFrame(FrameStreamAck, 0, header.seq, NULL, 0);
+        }
+        if (header.flags & StreamEnd) {
+            active = false;
+            endStream();
+        }
     }
 };
 
-class EchoClient: public EventHandler {
+class EchoClientGroup;
+
+//
+// One echo connection. For a phase it sends nWarmup + nReq messages keeping
+// up to window of them in flight; window 1 is the classic closed loop
+// ping-pong. The first nWarmup round trips are excluded from the throughput
+// and the latency histogram.
+//
+// Each message is a frame whose sequence number matches a reply to its
+// request. The echoed payload is checked against what was sent.
+//
+// At a fixed rate (open loop) the client sends on a timer of the loop,
+// every intervalNanos or with exponential gaps of that mean, whether or not
+// the replies keep up. A round trip is timed from when its request was due,
+// not from when it went out, so the time a request waited behind a slow
+// reply or a full window counts against the latency instead of being
+// omitted (coordinated omission). The window only bounds the requests in
+// flight; when it is full the due requests go out as replies free it.
+//
+// In stream mode the messages are not echoed. The client asks for an ack
+// every ackEvery messages, keeps up to window acks outstanding and times
+// the ack round trips; the phase ends with the ack of the last message.
+//
+class EchoClient: public FrameHandler, public TimerHandler {
 public:
     int numGot;
     int numSent;
     int maxSend;
-    timeval beginTime;
+    int numWarmup;
+    uint64_t beginNanos;
+    uint64_t endNanos;
+    uint64_t numBytes;
+    uint64_t totalBytes;
+    uint64_t rndState;
+    // Payload pattern shared by the connections of a group. The frame
+    // header is written just before each send copies the message.
+    char *payload;
+    PayloadSize size;
+    std::vector<InFlight> inflight;
+    int window;
+    LatencyHistogram histogram;
+    EchoClientGroup *pGroup;
+    bool isStream;
+    int ackEvery;
+    int numAcks;
+    // Mean gap between requests in an open loop, 0 in a closed loop
+    uint64_t intervalNanos;
+    bool isPoisson;
+    // Time the next request is due
+    uint64_t nextSendNanos;
+    // Pending send timer, -1 when there is none
+    int timerId;
 
-    EchoClient(int nReq) :
-        maxSend(nReq) {
+    EchoClient(EchoClientGroup *pGroup, int nReq, int nWarmup, int id) :
+        maxSend(nReq), numWarmup(nWarmup), pGroup(pGroup) {
         numSent = numGot = 0;
+        beginNanos = endNanos = numBytes = totalBytes = 0;
+        isStream = false;
+        ackEvery = 1;
+        numAcks = 0;
+        rndState = 0x9E3779B97F4A7C15ULL * (id + 1);
+        payload = NULL;
+        window = 1;
+        intervalNanos = 0;
+        isPoisson = false;
+        nextSendNanos = 0;
+        timerId = -1;
         description = "echo client";
     }
-    void sendData() {
+
+    uint64_t nextRandom() {
+        rndState ^= rndState << 13;
+        rndState ^= rndState >> 7;
+        rndState ^= rndState << 17;
+        return rndState;
+    }
+
+    // Gap to the next request of an open loop. Exponential gaps make the
+    // arrivals a Poisson process.
+    uint64_t nextInterval() {
+        if (!isPoisson) {
+            return intervalNanos;
+        }
+        // Uniform in (0, 1]
+        double u = ((nextRandom() >> 11) + 1) * (1.0 / 9007199254740992.0);
+        return (uint64_t) (-log(u) * intervalNanos);
+    }
+
+    // dueNanos is when the request was due in an open loop, 0 times it from
+    // the send
+    void sendData(uint64_t dueNanos = 0) {
         INFO_OUT("Sending data %d\n", numSent);
-        send(client_message, sizeof(client_message), true);
+        if (numSent == numWarmup) {
+            beginNanos = getMonotonicNanos();
+        }
+        InFlight &slot = inflight[numSent % window];
+        slot.seq = numSent;
+        slot.size = size.next(nextRandom());
+        FrameHeader header = {FrameEchoRequest, 0,
+                (uint32_t) (slot.size - FrameHeaderSize), slot.seq};
+        memcpy(payload, &header, FrameHeaderSize);
+        slot.sendNanos = dueNanos ? dueNanos : getMonotonicNanos();
+        send(payload, slot.size, true);
+        totalBytes += slot.size;
         numSent++;
     }
-    virtual void process(char *data, int len, bool iseof) {
-        if (strcmp(data, server_message) != 0) {
-            ERROR_OUT("Invalid message from server:%s\n", data);
-            exit(1);
+
+    // Streams the next message, the last one of every ackEvery asks for an
+    // ack and takes a window slot until it arrives.
+    void sendStream() {
+        int total = numWarmup + maxSend;
+        if (numSent == numWarmup) {
+            beginNanos = getMonotonicNanos();
         }
-        numGot++;
-        INFO_OUT("Client process response %d\n", numGot);
-        if (numGot == 1) {
-            printCurrentTime();
-            gettimeofday(&beginTime, NULL);
-        }
-        if (numGot == maxSend) {
-            timeval endTime;
-            gettimeofday(&endTime, NULL);
-            printCurrentTime();
-            unsigned long timediff = getTimeDiff(&endTime, &beginTime);
-            printf("Number of message %d, usec %ld, Number of message per sec %ld\n", maxSend,
-                    timediff, maxSend*1000000UL / (timediff ? timediff : 1));
-
-            getParent()->cancelLoop();
-            return;
+        int frameSize = size.next(nextRandom());
+        FrameHeader header = {FrameStreamData, 0,
+                (uint32_t) (frameSize - FrameHeaderSize), (uint32_t) numSent};
+        if ((numSent + 1) % ackEvery == 0 || numSent + 1 == total) {
+            InFlight &slot = inflight[(numSent / ackEvery) % window];
+            slot.seq = numSent;
+            slot.size = frameSize;
+            slot.sendNanos = getMonotonicNanos();
+            header.flags = StreamAckRequest;
+        }
+        if (numSent + 1 == total) {
+            header.flags |= StreamEnd;
+        }
+        // The frame is written in place, on the ring transports straight
+        // into the ring slot
+        char *buf = acquireSend(frameSize);
+        memcpy(buf, &header, FrameHeaderSize);
+        memset(buf + FrameHeaderSize, StreamFill, frameSize - FrameHeaderSize);
+        commitSend(buf, frameSize, true);
+        if (numSent >= numWarmup) {
+            numBytes += frameSize;
+        }
+        totalBytes += frameSize;
+        numSent++;
+    }
+
+    void fillStream() {
+        int total = numWarmup + maxSend;
+        while (numSent < total && numSent / ackEvery - numAcks < window) {
+            sendStream();
+        }
+    }
+
+    // Tops up the requests in flight to the window
+    void fillWindow() {
+        int total = numWarmup + maxSend;
+        while (numSent < total && numSent - numGot < window
+                && !inflight[numSent % window].size) {
+            sendData();
+        }
+    }
+
+    // Sends the requests of an open loop that are due and have a window
+    // slot, then sets a timer for the next one unless one is pending
+    void sendDue() {
+        int total = numWarmup + maxSend;
+        uint64_t now = getMonotonicNanos();
+        while (numSent < total && nextSendNanos <= now
+                && numSent - numGot < window && !inflight[numSent % window].size) {
+            sendData(nextSendNanos);
+            nextSendNanos += nextInterval();
+        }
+        if (numSent < total && timerId == -1 && nextSendNanos > now) {
+            timerId = getParent()->addTimer(nextSendNanos - now, this);
+            if (timerId == -1) {
+                ERROR_OUT("Transport has no timers for a fixed rate\n");
+                exit(1);
+            }
+        }
+    }
+
+    virtual void onTimer(int id) {
+        timerId = -1;
+        sendDue();
+    }
+
+    // intervalNanos is the mean gap between requests, 0 for a closed loop
+    void startPhase(const PayloadSize &size, int window, char *payload,
+            bool isStream, uint64_t intervalNanos = 0, bool isPoisson = false) {
+        this->size = size;
+        this->window = window;
+        this->payload = payload;
+        this->isStream = isStream;
+        this->intervalNanos = intervalNanos;
+        this->isPoisson = isPoisson;
+        numSent = numGot = numAcks = 0;
+        numBytes = totalBytes = 0;
+        histogram.reset();
+        inflight.assign(window, InFlight());
+        if (isStream) {
+            ackEvery = StreamAckBytes / size.maxSize;
+            ackEvery = ackEvery > 0 ? ackEvery : 1;
+            ackEvery = ackEvery < StreamAckMessages ? ackEvery : StreamAckMessages;
+            fillStream();
+        } else if (intervalNanos) {
+            nextSendNanos = getMonotonicNanos();
+            sendDue();
+        } else {
+            fillWindow();
+        }
+    }
+
+    // Messages per second of the last phase
+    double rate() {
+        uint64_t elapsed = endNanos - beginNanos;
+        return elapsed ? maxSend * 1e9 / elapsed : 0;
+    }
+
+    void invalidReply(const FrameHeader &header) {
+        ERROR_OUT("Invalid reply from server, seq %u, %u bytes\n", header.seq,
+                header.length);
+        exit(1);
+    }
+
+    // Accounts a complete reply
+    void completeReply(InFlight *pReply);
+
+    // Accounts an ack, returns true when the phase is done
+    bool completeAck(uint32_t seq);
+
+    virtual void processFrame(const FrameHeader &header, char *frame) {
+        switch (header.type) {
+        case FrameEchoReply: {
+            InFlight *pReply = &inflight[header.seq % window];
+            if (pReply->seq != header.seq || !pReply->size
+                    || FrameHeaderSize + header.length != (uint32_t) pReply->size
+                    || memcmp(frame + FrameHeaderSize, payload + FrameHeaderSize,
+                            header.length) != 0) {
+                invalidReply(header);
+            }
+            completeReply(pReply);
+            break;
+        }
+        case FrameStreamAck:
+            if (!completeAck(header.seq)) {
+                fillStream();
+            }
+            break;
+        default:
+            invalidFrame(header);
+        }
+    }
+
+    virtual void enable();
+};
+
+//
+// Drives a set of echo connections to one server through a sweep of client
+// counts, payload sizes, windows and offered rates, the rates varying
+// fastest. A phase with M clients runs the first
+// M connections concurrently, waits until all of them are done and reports
+// the aggregate throughput, the spread of the per client rates and the
+// merged latency percentiles. The sweep starts once every connection is up.
+//
+class EchoClientGroup {
+public:
+    int maxSend;
+    int numWarmup;
+    std::vector<EchoClient*> clients;
+    std::vector<int> clientCounts;
+    std::vector<PayloadSize> sizes;
+    std::vector<int> windows;
+    // Offered messages per second of all clients of a phase, a single 0
+    // runs closed loops
+    std::vector<double> rates;
+    bool isPoisson;
+    char *payload;
+    int numReady;
+    int numActive;
+    int numDone;
+    size_t curPhase;
+    PhaseResult *pResult;
+    std::vector<PhaseResult*> results;
+    bool isStream;
+    uint64_t beginCpuNanos;
+    bool isCounting;
+    // Set when the server runs in this process
+    bool isServerHere;
+    PerfCounters clientCounters;
+    PerfCounters serverCounters;
+
+    EchoClientGroup(int nReq, int nWarmup = 0) :
+        maxSend(nReq), numWarmup(nWarmup) {
+        isStream = false;
+        isPoisson = false;
+        beginCpuNanos = 0;
+        isCounting = isServerHere = false;
+        payload = NULL;
+        numReady = numActive = numDone = 0;
+        curPhase = 0;
+        pResult = NULL;
+    }
+
+    ~EchoClientGroup() {
+        for (size_t i = 0; i < clients.size(); i++) {
+            delete clients[i];
+        }
+        for (size_t i = 0; i < results.size(); i++) {
+            delete results[i];
+        }
+        delete[] payload;
+    }
+
+    void setPayloadSizes(const std::vector<PayloadSize> &sizes) {
+        this->sizes = sizes;
+    }
+
+    void setWindows(const std::vector<int> &windows) {
+        this->windows = windows;
+    }
+
+    void setClientCounts(const std::vector<int> &clientCounts) {
+        this->clientCounts = clientCounts;
+    }
+
+    // Open loop rates, spread evenly over the clients of a phase
+    void setRates(const std::vector<double> &rates, bool isPoisson) {
+        this->rates = rates;
+        this->isPoisson = isPoisson;
+    }
+
+    // Reads perf_event counters around every phase, for this process and
+    // for serverPid when it is not 0
+    void setCounters(pid_t serverPid, bool isServerHere) {
+        this->isServerHere = isServerHere;
+        isCounting = clientCounters.open(0);
+        if (!isCounting) {
+            ERROR_OUT("No perf_event counters, see perf_event_paranoid\n");
+        }
+        if (serverPid && !serverCounters.open(serverPid)) {
+            ERROR_OUT("No perf_event counters for server %d\n", (int) serverPid);
+        }
+    }
+
+    // One way streaming with periodic acks instead of echo round trips
+    void setStream(bool isStream) {
+        this->isStream = isStream;
+    }
+
+    // Creates one connection per client of the largest count
+    void initialize() {
+        if (sizes.empty()) {
+            PayloadSize size = {DefaultPayloadSize, DefaultPayloadSize};
+            sizes.push_back(size);
+        }
+        if (windows.empty()) {
+            windows.push_back(isStream ? DefaultStreamWindow
+                    : rates.empty() ? 1 : DefaultOpenLoopWindow);
+        }
+        if (rates.empty()) {
+            rates.push_back(0);
+        }
+        if (clientCounts.empty()) {
+            clientCounts.push_back(1);
+        }
+        int maxSize = FrameHeaderSize;
+        for (size_t i = 0; i < sizes.size(); i++) {
+            if (sizes[i].maxSize > maxSize) {
+                maxSize = sizes[i].maxSize;
+            }
+        }
+        payload = new char[maxSize];
+        for (int i = 0; i < maxSize; i++) {
+            payload[i] = 'a' + i % 26;
+        }
+        int maxClients = 0;
+        for (size_t i = 0; i < clientCounts.size(); i++) {
+            if (clientCounts[i] > maxClients) {
+                maxClients = clientCounts[i];
+            }
+        }
+        for (int i = 0; i < maxClients; i++) {
+            EchoClient *pClient = new EchoClient(this, maxSend, numWarmup, i);
+            pClient->initialize();
+            clients.push_back(pClient);
+        }
+    }
+
+    int numClients() {
+        return (int) clients.size();
+    }
+
+    EchoClient *client(int i) {
+        return clients[i];
+    }
+
+    EventMain *getParent() {
+        return clients[0]->getParent();
+    }
+
+    const PayloadSize &phaseSize() {
+        return sizes[(curPhase / (rates.size() * windows.size())) % sizes.size()];
+    }
+
+    // Starts the next phase on its clients, skipping sizes the transport
+    // cannot carry. Returns false when the sweep is done.
+    bool startPhase() {
+        size_t perClientCount = sizes.size() * windows.size() * rates.size();
+        size_t numPhases = clientCounts.size() * perClientCount;
+        while (curPhase < numPhases) {
+            char label[32];
+            phaseSize().label(label, sizeof(label));
+            if (phaseSize().maxSize <= getParent()->maxMessageSize()) {
+                double rate = rates[curPhase % rates.size()];
+                int window = windows[(curPhase / rates.size()) % windows.size()];
+                numActive = clientCounts[curPhase / perClientCount];
+                uint64_t intervalNanos = rate ? (uint64_t) (numActive * 1e9 / rate) : 0;
+                intervalNanos = rate && !intervalNanos ? 1 : intervalNanos;
+                numDone = 0;
+                pResult = new PhaseResult();
+                pResult->size = phaseSize();
+                pResult->window = window;
+                pResult->numClients = numActive;
+                pResult->offeredRate = rate;
+                printf("Payload size %s, window %d, clients %d%s", label, window,
+                        numActive, isStream ? ", stream" : "");
+                if (rate) {
+                    printf(", offered %.0f msgs/sec%s", rate,
+                            isPoisson ? " poisson" : "");
+                }
+                printf("\n");
+                printCurrentTime();
+                beginCpuNanos = getProcessCpuNanos();
+                if (getParent()->outputStats()) {
+                    getParent()->outputStats()->reset();
+                }
+                if (getParent()->stampStats()) {
+                    getParent()->stampStats()->reset();
+                }
+                if (isCounting) {
+                    serverCounters.start();
+                    clientCounters.start();
+                }
+                for (int i = 0; i < numActive; i++) {
+                    clients[i]->startPhase(phaseSize(), window, payload, isStream,
+                            intervalNanos, isPoisson);
+                }
+                return true;
+            }
+            printf("Payload size %s skipped, transport limit %d bytes\n", label,
+                    getParent()->maxMessageSize());
+            curPhase++;
+        }
+        return false;
+    }
+
+    void endPhase() {
+        PerfCounts clientPerf = clientCounters.stop();
+        PerfCounts serverCounts = serverCounters.stop();
+        printCurrentTime();
+        uint64_t begin = clients[0]->beginNanos;
+        uint64_t end = clients[0]->endNanos;
+        double sumRate = 0;
+        double sumSquares = 0;
+        pResult->cpuNanos = getProcessCpuNanos() - beginCpuNanos;
+        pResult->numMessages = 0;
+        pResult->numBytes = 0;
+        pResult->totalBytes = 0;
+        pResult->minClientRate = pResult->maxClientRate = clients[0]->rate();
+        for (int i = 0; i < numActive; i++) {
+            EchoClient *pClient = clients[i];
+            if (pClient->beginNanos < begin) {
+                begin = pClient->beginNanos;
+            }
+            if (pClient->endNanos > end) {
+                end = pClient->endNanos;
+            }
+            pResult->numMessages += pClient->maxSend;
+            pResult->numBytes += pClient->numBytes;
+            pResult->totalBytes += pClient->totalBytes;
+            pResult->histogram.merge(pClient->histogram);
+            double rate = pClient->rate();
+            sumRate += rate;
+            sumSquares += rate * rate;
+            if (rate < pResult->minClientRate) {
+                pResult->minClientRate = rate;
+            }
+            if (rate > pResult->maxClientRate) {
+                pResult->maxClientRate = rate;
+            }
+        }
+        pResult->elapsedNanos = end - begin;
+        pResult->meanClientRate = sumRate / numActive;
+        pResult->fairness = sumSquares ? sumRate * sumRate / (numActive * sumSquares) : 1;
+        unsigned long timediff = pResult->elapsedNanos / 1000;
+        int numMessages = pResult->numMessages;
+        printf("Number of message %d, usec %ld, Number of message per sec %ld, MB/s %.2f\n",
+                numMessages, timediff, numMessages*1000000UL / (timediff ? timediff : 1),
+                pResult->numBytes / (timediff ? (double) timediff : 1.0));
+        pResult->hasCounters = isCounting;
+        if (isCounting) {
+            uint64_t numSent = (uint64_t) numActive * (numWarmup + maxSend);
+            pResult->clientCounters = clientPerf.perMessage(numSent);
+            pResult->serverCounters = serverCounts.perMessage(numSent);
+            printCounters(pResult);
+        }
+        if (numActive > 1) {
+            printf("Per client message per sec min %.0f, mean %.0f, max %.0f, fairness %.3f\n",
+                    pResult->minClientRate, pResult->meanClientRate,
+                    pResult->maxClientRate, pResult->fairness);
+        }
+        if (isStream) {
+            printf("Stream GB/s %.3f, cpu usec %llu, cycles/byte %.3f\n",
+                    pResult->numBytes / (timediff ? timediff * 1000.0 : 1.0),
+                    (unsigned long long) (pResult->cpuNanos / 1000),
+                    cyclesPerByte(pResult));
+        }
+        OutputStats *pStats = getParent()->outputStats();
+        if (pStats) {
+            pResult->sendCallsPerMessage = pStats->syscallsPerMessage();
+            pResult->queueDelayMeanUsec = pStats->queueDelay.mean() / 1000.0;
+            pResult->queueDelayP99Usec =
+                    pStats->queueDelay.valueAtPercentile(99) / 1000.0;
+            printf("Send calls per message %.3f, queue delay usec mean %.2f, p99 %.2f\n",
+                    pResult->sendCallsPerMessage, pResult->queueDelayMeanUsec,
+                    pResult->queueDelayP99Usec);
+            pResult->numBlocked = pStats->numBlocked;
+            pResult->peakBacklogBytes = pStats->peakBacklogBytes;
+            if (pStats->numBlocked || pStats->peakBacklogBytes) {
+                printf("Socket buffer full %llu times, output backlog peak bytes %llu\n",
+                        (unsigned long long) pStats->numBlocked,
+                        (unsigned long long) pStats->peakBacklogBytes);
+            }
+        }
+        StampStats *pStamps = getParent()->stampStats();
+        pResult->hasStamps = pStamps != NULL;
+        if (pStamps) {
+            pResult->stamps = *pStamps;
+            printStamps(pStamps);
+        }
+        pResult->histogram.printSummary(stdout, isStream ? "Ack" : "Round trip");
+        pResult->histogram.printDistribution(stdout);
+        results.push_back(pResult);
+        pResult = NULL;
+        curPhase++;
+    }
+
+    static void printCount(const char *name, double value) {
+        if (value < 0) {
+            printf(" %s n/a", name);
+        } else {
+            printf(" %s %.2f", name, value);
+        }
+    }
+
+    // Counts per message, those of a server process on a line of their own
+    void printCounters(PhaseResult *r) {
+        printf("Per message %s:", isServerHere ? "client and server" : "client");
+        for (int i = 0; i < NumPerfCounters; i++) {
+            printCount(perfCounterName(i), r->clientCounters.values[i]);
+        }
+        printf("\n");
+        if (r->serverCounters.values[PerfContextSwitches] >= 0
+                || r->serverCounters.values[PerfCycles] >= 0) {
+            printf("Per message server:");
+            for (int i = 0; i < NumPerfCounters; i++) {
+                printCount(perfCounterName(i), r->serverCounters.values[i]);
+            }
+            printf("\n");
+        }
+    }
+
+    // Round trip split at the kernel boundaries
+    void printStamps(StampStats *s) {
+        printf("Kernel stamps usec p50/p99:");
+        for (int i = 0; i < NumStampParts; i++) {
+            printf(" %s %.2f/%.2f", StampStats::partName(i),
+                    s->part(i)->valueAtPercentile(50) / 1000.0,
+                    s->part(i)->valueAtPercentile(99) / 1000.0);
+        }
+        printf("\n");
+    }
+
+    // Cycle counter ticks of process CPU time per byte sent
+    static double cyclesPerByte(PhaseResult *r) {
+        return r->cpuNanos * getCyclesPerNano()
+                / (r->totalBytes ? r->totalBytes : 1);
+    }
+
+    void printStreamSweep() {
+        printf("%8s %12s %8s %12s %10s %12s %12s %12s\n", "Clients", "Payload",
+                "Window", "Msgs/sec", "GB/s", "cycles/B", "p50 ack(us)",
+                "p99 ack(us)");
+        for (size_t i = 0; i < results.size(); i++) {
+            PhaseResult *r = results[i];
+            char label[32];
+            r->size.label(label, sizeof(label));
+            double secs = r->elapsedNanos / 1e9;
+            printf("%8d %12s %8d %12.0f %10.3f %12.3f %12.2f %12.2f\n",
+                    r->numClients, label, r->window, r->numMessages / secs,
+                    r->numBytes / secs / 1e9, cyclesPerByte(r),
+                    r->histogram.valueAtPercentile(50) / 1000.0,
+                    r->histogram.valueAtPercentile(99) / 1000.0);
+        }
+    }
+
+    void printSweep() {
+        printf("%8s %12s %8s %12s %12s %12s %10s %12s %12s %12s %12s\n", "Clients",
+                "Payload", "Window", "Offered", "Msgs/sec", "MB/s", "Fairness",
+                "p50(usec)", "p99(usec)", "p99.9(usec)", "max(usec)");
+        for (size_t i = 0; i < results.size(); i++) {
+            PhaseResult *r = results[i];
+            char label[32];
+            r->size.label(label, sizeof(label));
+            double secs = r->elapsedNanos / 1e9;
+            char offered[32] = "closed";
+            if (r->offeredRate) {
+                snprintf(offered, sizeof(offered), "%.0f", r->offeredRate);
+            }
+            printf("%8d %12s %8d %12s %12.0f %12.2f %10.3f %12.2f %12.2f %12.2f %12.2f\n",
+                    r->numClients, label, r->window, offered, r->numMessages / secs,
+                    r->numBytes / secs / 1e6, r->fairness,
+                    r->histogram.valueAtPercentile(50) / 1000.0,
+                    r->histogram.valueAtPercentile(99) / 1000.0,
+                    r->histogram.valueAtPercentile(99.9) / 1000.0,
+                    r->histogram.max() / 1000.0);
+        }
+    }
+
+    void finish() {
+        if (results.size() > 1) {
+            if (isStream) {
+                printStreamSweep();
+            } else {
+                printSweep();
+            }
+        }
+        getParent()->cancelLoop();
+    }
+
+    // Called by each connection once it is up
+    void clientReady() {
+        if (++numReady == numClients() && !startPhase()) {
+            finish();
         }
-        sendData();
     }
 
-    virtual void enable() {
-        INFO_OUT("Echo client enabled\n");
-        sendData();
+    // Returns true when the phase of the client was the last one to finish
+    bool clientDone() {
+        if (++numDone < numActive) {
+            return false;
+        }
+        endPhase();
+        if (!startPhase()) {
+            finish();
+        }
+        return true;
     }
 };
+
+inline void EchoClient::completeReply(InFlight *pReply) {
+    uint64_t now = getMonotonicNanos();
+    numGot++;
+    INFO_OUT("Client process response %d\n", numGot);
+    if (pReply->seq >= (uint32_t) numWarmup) {
+        histogram.record(now - pReply->sendNanos);
+        LIVE_STAT(liveLatency(pLive, now - pReply->sendNanos));
+        numBytes += pReply->size;
+    }
+    pReply->size = 0;
+    if (numGot == numWarmup + maxSend) {
+        endNanos = now;
+        if (timerId != -1) {
+            getParent()->cancelTimer(timerId);
+            timerId = -1;
+        }
+        pGroup->clientDone();
+        return;
+    }
+    if (intervalNanos) {
+        sendDue();
+    } else {
+        fillWindow();
+    }
+}
+
+inline bool EchoClient::completeAck(uint32_t seq) {
+    uint64_t now = getMonotonicNanos();
+    InFlight &slot = inflight[numAcks % window];
+    if (slot.seq != seq || !slot.size) {
+        ERROR_OUT("Unexpected ack %u, waiting for %u\n", seq, slot.seq);
+        exit(1);
+    }
+    if (seq >= (uint32_t) numWarmup) {
+        histogram.record(now - slot.sendNanos);
+        LIVE_STAT(liveLatency(pLive, now - slot.sendNanos));
+    }
+    slot.size = 0;
+    numAcks++;
+    numGot = seq + 1;
+    if (numGot == numWarmup + maxSend) {
+        endNanos = now;
+        pGroup->clientDone();
+        return true;
+    }
+    return false;
+}
+
+inline void EchoClient::enable() {
+    INFO_OUT("Echo client enabled\n");
+    pGroup->clientReady();
+}
@@ -0,0 +1,333 @@
+#pragma once
+#include <getopt.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "echotestlib.h"
+#include "cpuplace.h"
+
+//
+// Options and run logic shared by the per transport executables and the
+// ipcperf driver. The driver appends its own options to these.
+//
+
+#define PERFTEST_OPTS "csp:a:n:w:z:W:m:SFP:b:r:A:CX:KLD:"
+
+#define PERFTEST_LONG_OPTS \
+    {"client", no_argument, NULL, 'c'}, \
+    {"server", no_argument, NULL, 's'}, \
+    {"port", required_argument, NULL, 'p'}, \
+    {"address", required_argument, NULL, 'a'}, \
+    {"messages", required_argument, NULL, 'n'}, \
+    {"warmup", required_argument, NULL, 'w'}, \
+    {"size", required_argument, NULL, 'z'}, \
+    {"window", required_argument, NULL, 'W'}, \
+    {"clients", required_argument, NULL, 'm'}, \
+    {"stream", no_argument, NULL, 'S'}, \
+    {"fork", no_argument, NULL, 'F'}, \
+    {"placement", required_argument, NULL, 'P'}, \
+    {"batch", required_argument, NULL, 'b'}, \
+    {"rate", required_argument, NULL, 'r'}, \
+    {"arrival", required_argument, NULL, 'A'}, \
+    {"counters", no_argument, NULL, 'C'}, \
+    {"trace", required_argument, NULL, 'X'}, \
+    {"kernel-stamps", no_argument, NULL, 'K'}, \
+    {"live-stats", no_argument, NULL, 'L'}, \
+    {"consumer-delay", required_argument, NULL, 'D'}
+
+#define PERFTEST_USAGE "[-csSFCKL] [-p port] [-a address] [-n messages] [-w warmup]" \
+    " [-z size[-maxsize],...] [-W window,...] [-m clients,...]" \
+    " [-P none|core|smt|l3|socket|cpu:cpu] [-b bytes[:usec]]" \
+    " [-r rate,...] [-A fixed|poisson] [-X tracefile] [-D usec]"
+
+class ArgParser {
+public:
+    bool isClientOnly;
+    bool isServerOnly;
+    bool isStream;
+    // Fork the server instead of running it in this process
+    bool isFork;
+    const char *pAddress;
+    const char *pPort;
+    int numMessages;
+    int numWarmup;
+    std::vector<PayloadSize> payloadSizes;
+    std::vector<int> windows;
+    std::vector<int> clientCounts;
+    // As given with -P, the driver takes a comma separated list
+    const char *pPlacement;
+    CpuPlacement placement;
+    // Output batching budget of the socket transports, 0 bytes sends every
+    // message right away
+    int batchBytes;
+    uint64_t batchDelayNanos;
+    // Offered messages per second of an open loop sweep, empty for closed
+    // loops, and whether the gaps between requests are exponential
+    std::vector<double> rates;
+    bool isPoisson;
+    // Read perf_event counters around each phase
+    bool isCounting;
+    // Kernel send and receive timestamps on the socket transports
+    bool isStamping;
+    // Publish live counters for ipcstat, see livestats.h
+    bool isLive;
+    // Server sleep per frame, a slow consumer that backs up the senders
+    uint64_t consumerDelayNanos;
+    // Event trace path, see trace.h, NULL for no tracing
+    const char *pTracePath;
+    // Server forked by runForkedPerfTest, its counters are read as well
+    pid_t serverPid;
+    // Written to once the server is bound, for a parent waiting to connect
+    int readyFd;
+    ArgParser() :
+        isClientOnly(false),
+        isServerOnly(false),
+        isStream(false),
+        isFork(false),
+        pAddress("127.0.0.1"),
+        pPort("8000"),
+        numMessages(1000),
+        numWarmup(0),
+        pPlacement("none"),
+        batchBytes(0),
+        batchDelayNanos(UINT64_MAX),
+        isPoisson(false),
+        isCounting(false),
+        isStamping(false),
+        isLive(false),
+        consumerDelayNanos(0),
+        pTracePath(NULL),
+        serverPid(0),
+        readyFd(-1) {
+        resolvePlacement("none", &placement);
+    }
+
+    // Returns false for an option that is not one of PERFTEST_OPTS
+    bool parseOption(int c, const char *arg) {
+        switch (c) {
+        case 'c': isClientOnly = true; break;
+        case 's': isServerOnly = true; break;
+        case 'S': isStream = true; break;
+        case 'F': isFork = true; break;
+        case 'C': isCounting = true; break;
+        case 'X': pTracePath = arg; break;
+        case 'K': isStamping = true; break;
+        case 'L': isLive = true; break;
+        case 'P': pPlacement = arg; break;
+        case 'D':
+            if (atol(arg) < 0) {
+                fprintf(stderr, "Invalid consumer delay %s\n", arg);
+                exit(1);
+            }
+            consumerDelayNanos = atol(arg) * 1000ULL;
+            break;
+        case 'b':
+            if (!parseBatch(arg)) {
+                fprintf(stderr, "Invalid batch budget %s\n", arg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            if (!parseRateList(arg, rates)) {
+                fprintf(stderr, "Invalid rate list %s\n", arg);
+                exit(1);
+            }
+            break;
+        case 'A':
+            if (strcmp(arg, "fixed") && strcmp(arg, "poisson")) {
+                fprintf(stderr, "Invalid arrival %s\n", arg);
+                exit(1);
+            }
+            isPoisson = !strcmp(arg, "poisson");
+            break;
+        case 'p': pPort = arg; break;
+        case 'a': pAddress = arg; break;
+        case 'n': numMessages = atoi(arg); break;
+        case 'w': numWarmup = atoi(arg); break;
+        case 'z':
+            if (!PayloadSize::parseList(arg, payloadSizes)) {
+                fprintf(stderr, "Invalid payload size list %s\n", arg);
+                exit(1);
+            }
+            break;
+        case 'W':
+            if (!parseCountList(arg, windows)) {
+                fprintf(stderr, "Invalid window list %s\n", arg);
+                exit(1);
+            }
+            break;
+        case 'm':
+            if (!parseCountList(arg, clientCounts)) {
+                fprintf(stderr, "Invalid client count list %s\n", arg);
+                exit(1);
+            }
+            break;
+        default:
+            return false;
+        }
+        return true;
+    }
+
+    // Parses 64K or 64K:100, bytes and optionally microseconds
+    bool parseBatch(const char *arg) {
+        char *end;
+        batchBytes = PayloadSize::parseSize(arg, &end);
+        batchDelayNanos = UINT64_MAX;
+        if (*end == ':') {
+            long usec = strtol(end + 1, &end, 10);
+            if (usec <= 0) {
+                return false;
+            }
+            batchDelayNanos = usec * 1000ULL;
+        }
+        return *end == 0 && batchBytes >= 0;
+    }
+
+    void parseArgs(int argc, char **argv) {
+        static const option longOpts[] = {
+            PERFTEST_LONG_OPTS,
+            {NULL, 0, NULL, 0}
+        };
+        int c;
+        while ((c = getopt_long(argc, argv, PERFTEST_OPTS, longOpts, NULL)) != -1) {
+            if (!parseOption(c, optarg)) {
+                fprintf(stderr, "./eventserver " PERFTEST_USAGE "\n");
+                exit(1);
+            }
+        }
+        setPlacement(pPlacement);
+        checkRates();
+    }
+
+    // Stream mode has no round trips to pace
+    void checkRates() {
+        if (isStream && !rates.empty()) {
+            fprintf(stderr, "-r does not apply to stream mode\n");
+            exit(1);
+        }
+    }
+
+    void setPlacement(const char *spec) {
+        if (!resolvePlacement(spec, &placement)) {
+            exit(1);
+        }
+    }
+
+};
+
+//
+// Runs the server and/or the clients of one transport until the sweep is
+// done. A server only run never returns. The phase results are copied to
+// pResults when given.
+//
+inline void runPerfTest(EventMain *pMain, ArgParser &argParser,
+        std::vector<PhaseResult> *pResults = NULL)
+{
+    EchoServer echoServer;
+    StreamServer streamServer;
+    // Separate server processes report their own half of the stream cost
+    streamServer.setReportCpu(argParser.isServerOnly);
+    echoServer.setDelay(argParser.consumerDelayNanos);
+    streamServer.setDelay(argParser.consumerDelayNanos);
+    EventHandler *pServer = argParser.isStream ? (EventHandler*) &streamServer
+            : (EventHandler*) &echoServer;
+    EchoClientGroup clients(argParser.numMessages, argParser.numWarmup);
+    clients.setPayloadSizes(argParser.payloadSizes);
+    clients.setWindows(argParser.windows);
+    clients.setClientCounts(argParser.clientCounts);
+    clients.setStream(argParser.isStream);
+    clients.setRates(argParser.rates, argParser.isPoisson);
+    if (argParser.isCounting && !argParser.isServerOnly) {
+        clients.setCounters(argParser.serverPid, !argParser.isClientOnly);
+    }
+    int cpu = argParser.isServerOnly ? argParser.placement.serverCpu
+            : argParser.placement.clientCpu;
+    if (argParser.placement.isPinned()) {
+        printf("CPU placement %s, %s on cpu %d\n", argParser.placement.name,
+                argParser.isServerOnly ? "server" : argParser.isClientOnly
+                ? "client" : "client and server", cpu);
+        fflush(stdout);
+    }
+    pinToCpu(cpu);
+    if (argParser.pTracePath) {
+        traceEnable(argParser.pTracePath);
+    }
+    if (argParser.isLive) {
+        const char *role = argParser.isServerOnly ? "server"
+                : argParser.isClientOnly ? "client" : "client+server";
+        if (liveStatsEnable(role)) {
+            printf("Live stats of %s pid %d\n", role, (int) getpid());
+            fflush(stdout);
+        }
+    }
+    pMain->initialize();
+    pMain->setBatching(argParser.batchBytes, argParser.batchDelayNanos);
+    if (argParser.isStamping && !pMain->setTimestamping(true)) {
+        printf("Transport has no kernel timestamps\n");
+    }
+    pServer->initialize();
+    clients.initialize();
+    if (!argParser.isClientOnly) {
+        pMain->bindServer(argParser.pPort, pServer);
+        if (argParser.readyFd != -1) {
+            char ready = 1;
+            if (write(argParser.readyFd, &ready, 1) != 1) {
+                perror("write");
+            }
+            close(argParser.readyFd);
+            argParser.readyFd = -1;
+        }
+    }
+    if (!argParser.isServerOnly) {
+        for (int i = 0; i < clients.numClients(); i++) {
+            pMain->connectToServer(argParser.pAddress, argParser.pPort,
+                    clients.client(i));
+        }
+    }
+    pMain->process();
+    traceDump();
+    liveStatsClose();
+    if (pResults) {
+        for (size_t i = 0; i < clients.results.size(); i++) {
+            pResults->push_back(*clients.results[i]);
+        }
+    }
+}
+
+//
+// Runs the server in a forked child and the clients in this process, each
+// pinned as the placement says. pServerMain is only used in the child.
+// closeFd is closed in the child, so the server holds no pipe of the caller.
+//
+inline void runForkedPerfTest(EventMain *pServerMain, EventMain *pClientMain,
+        ArgParser args, std::vector<PhaseResult> *pResults = NULL,
+        int closeFd = -1)
+{
+    int readyPipe[2];
+    dieif(pipe(readyPipe) == -1, "pipe");
+    fflush(stdout);
+    fflush(stderr);
+    pid_t serverPid = fork();
+    dieif(serverPid == -1, "fork");
+    if (serverPid == 0) {
+        close(readyPipe[0]);
+        if (closeFd != -1) {
+            close(closeFd);
+        }
+        args.isServerOnly = true;
+        args.readyFd = readyPipe[1];
+        runPerfTest(pServerMain, args);
+        _exit(0);
+    }
+    close(readyPipe[1]);
+    char ready;
+    if (read(readyPipe[0], &ready, 1) != 1) {
+        ERROR_OUT("Server did not start\n");
+        exit(1);
+    }
+    close(readyPipe[0]);
+    args.isClientOnly = true;
+    args.serverPid = serverPid;
+    runPerfTest(pClientMain, args, pResults);
+    kill(serverPid, SIGTERM);
+    waitpid(serverPid, NULL, 0);
+}
@@ -11,139 +11,271 @@
 #include <sys/epoll.h>
 #include <assert.h>
 #include "framework.h"
+#include "transport.h"
+#include "outqueue.h"
+#include "conntable.h"
+#include "timers.h"
+#include "sockstamps.h"
 
 // Main event loop
-class EpollMain: public EventMain {
+class EpollMain: public EventMain, public WritableWatcher {
 protected:
 
+    int efd;
     int listener;
-    int dest;
     EventHandler *server;
-    EventHandler *client;
     bool loopEnd;
+    int acceptOptions;
+    OutputBatcher batcher;
+
+    struct Connection {
+        int fd;
+        EventHandler *pHandler;
+        // Receive buffer the handler holds, see holdReceive()
+        char *heldBuffer;
+    };
+    ConnTable<Connection> connections;
+    RecvBuffers buffers;
+    TimerFd timers;
+    SocketStamps stamps;
 
 public:
 
+    EpollMain() : efd(-1), listener(-1), acceptOptions(0) {
+    }
+
     void initialize() {
         loopEnd = false;
-        dest = listener = -1;
+        listener = -1;
+        server = NULL;
+        batcher.setWatcher(this);
+        efd = epoll_create1(0);
+        if (efd == -1) {
+            perror("epoll_create");
+            exit(1);
+        }
+        addFd(timers.create(), NULL);
 
     }
 
-    struct MyEventData {
-        int fd;
-        EventHandler *pHandler;
-    };
+    ~EpollMain() {
+        // Connections still open, the listener and timer have no handler
+        for (int fd = 0; fd < connections.limit(); fd++) {
+            Connection *c = connections.find(fd);
+            if (c && c->pHandler) {
+                close(fd);
+            }
+        }
+        if (listener != -1) {
+            close(listener);
+        }
+        if (efd != -1) {
+            close(efd);
+        }
+    }
+
 #define MAXEVENTS 64
 
-    void process() {
-        int efd;
+    // Sockets are registered as soon as they exist, so any number of
+    // clients and accepted connections share the loop.
+    void addFd(int fd, EventHandler *pHandler) {
         epoll_event event = {0};
-        epoll_event events[MAXEVENTS];
-
-        efd = epoll_create1(0);
-
-        if (efd == -1) {
-            perror("epoll_create");
+        Connection *c = connections.get(fd);
+        c->fd = fd;
+        c->pHandler = pHandler;
+        event.data.ptr = c;
+        event.events = EPOLLIN;
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("epoll_ctl");
             exit(1);
         }
-        if (this->listener != -1) {
-            MyEventData data = {listener, NULL};
-            event.data.ptr = new MyEventData(data);
-            event.events = EPOLLIN;
-            if (epoll_ctl(efd, EPOLL_CTL_ADD, listener, &event) == -1) {
-                perror("epoll_ctl");
-                exit(1);
-            }
+    }
+
+    // EPOLLOUT is armed only while the socket has a backlog, a writable
+    // socket would wake the loop all the time
+    void watchWritable(int fd, bool isWatching) {
+        epoll_event event = {0};
+        event.data.ptr = connections.find(fd);
+        event.events = isWatching ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        if (epoll_ctl(efd, EPOLL_CTL_MOD, fd, &event) == -1) {
+            perror("epoll_ctl");
         }
-        if (this->dest != -1) {
-            MyEventData data = {dest, client};
-            event.data.ptr = new MyEventData(data);
-            event.events = EPOLLIN;
-            if (epoll_ctl(efd, EPOLL_CTL_ADD, dest, &event) == -1) {
-                perror("epoll_ctl");
-                exit(1);
+    }
+
+    void closeFd(Connection *c) {
+        batcher.forget(c->fd);
+        buffers.release(&c->heldBuffer);
+        EventHandler *pHandler = c->pHandler;
+        c->pHandler = NULL;
+        close(c->fd);
+        notifyClosed(pHandler, (Context*) (long) c->fd);
+    }
+
+    void acceptClients() {
+        while (true) {
+            struct sockaddr_storage ss;
+            socklen_t slen = sizeof(ss);
+            int acceptfd = (acceptOptions & AcceptNonBlock)
+                    ? accept4(listener, (struct sockaddr*) &ss, &slen, SOCK_NONBLOCK)
+                    : accept(listener,  (struct sockaddr*) &ss, &slen);
+            if (acceptfd == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("accept");
+                }
+                return;
+            }
+            if (!(acceptOptions & AcceptNonBlock)) {
+                fcntl(acceptfd, F_SETFL, O_NONBLOCK);
             }
+            setNoDelay(acceptfd);
+            stamps.addSocket(acceptfd, false);
+            addFd(acceptfd, server);
         }
+    }
+
+    void process() {
+        epoll_event events[MAXEVENTS];
 
         while (!loopEnd) {
+            // Full sockets get a backlog and EPOLLOUT instead of a wait
+            batcher.flushAll(false);
             int nevents = epoll_wait(efd, events, MAXEVENTS, -1);
+            if (nevents == -1 && errno != EINTR) {
+                perror("epoll_wait");
+                exit(1);
+            }
+            TRACE_EVENT(TraceWakeup, nevents > 0 ? nevents : 0);
+            LIVE_STAT(liveLoop(pLive, nevents > 0 ? nevents : 0));
             for (int i=0; i < nevents; i++) {
                 epoll_event *pev = &events[i];
-                MyEventData *data = (MyEventData*)pev->data.ptr;
-                if ((pev->events & EPOLLERR) ||
-                       (pev->events & EPOLLHUP) ||
-                       !(pev->events & EPOLLIN)) {
+                Connection *data = (Connection*) pev->data.ptr;
+                uint32_t flags = pev->events;
+                // Queued send stamps raise EPOLLERR too
+                if ((flags & EPOLLERR) && stamps.drainErrors(data->fd)) {
+                    flags &= ~EPOLLERR;
+                    if (!(flags & (EPOLLIN | EPOLLOUT | EPOLLHUP))) {
+                        continue;
+                    }
+                }
+                if ((flags & EPOLLERR) ||
+                       (flags & EPOLLHUP) ||
+                       !(flags & (EPOLLIN | EPOLLOUT))) {
                     fprintf(stderr, "epoll error\n");
-                    close(data->fd);
-                    delete data;
+                    closeFd(data);
+                    continue;
+                }
+                if ((flags & EPOLLOUT) && !batcher.drain(data->fd)) {
+                    closeFd(data);
+                    continue;
+                }
+                if (!(flags & EPOLLIN)) {
                     continue;
                 }
                 if (listener == data->fd) {
-                    struct sockaddr_storage ss;
-                    socklen_t slen = sizeof(ss);
-                    int acceptfd = accept(listener,  (struct sockaddr*) &ss, &slen);
-                    if (acceptfd == -1) {
-                        perror("accept");
-                        continue;
-                    }
-                    fcntl(acceptfd, F_SETFL, O_NONBLOCK);
-                    MyEventData adata = {acceptfd, server};
-                    event.data.ptr = new MyEventData(adata);
-                    event.events = EPOLLIN;
-                    epoll_ctl(efd, EPOLL_CTL_ADD, acceptfd, &event);
+                    acceptClients();
+                    continue;
+                }
+                if (timers.getFd() == data->fd) {
+                    timers.run();
                     continue;
                 }
                 INFO_OUT("Reading socket %d", i);
-                char buf[1024];
-                bool isDone = false;
-                ssize_t  result = recv(data->fd, buf, sizeof(buf), 0);
+                ssize_t  result = stamps.recv(data->fd, buffers.current, RecvBufferSize);
                 if (result < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        continue;
+                    }
                     perror("recv");
-                    close(data->fd);
-                    delete data;
+                    closeFd(data);
                     continue;
                 } else if (result == 0) {
-                    close(data->fd);
-                    delete data;
-                    break;
+                    closeFd(data);
+                    continue;
                 }
+                TRACE_EVENT(TraceRecv, result);
                 if (data->pHandler) {
                     data->pHandler->setContext((Context*) (long) data->fd);
-                    data->pHandler->process(buf, result, true);
+                    data->pHandler->process(buffers.current, result, true);
+                    stamps.handled();
                 }
 
             }
         }
-        close(listener);
+    }
+
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
     }
 
     void cancelLoop() {
         loopEnd = true;
     }
 
-    void bindServer(const char *port, EventHandler *pProcessor) {
-        struct sockaddr_in sin = { 0 };
+    bool setAcceptOptions(int options) {
+        acceptOptions = options;
+        return true;
+    }
 
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = 0;
-        sin.sin_port = htons(atoi(port));
+    void setBatching(int maxBytes, uint64_t maxDelayNanos) {
+        batcher.setPolicy(maxBytes, maxDelayNanos);
+    }
 
-        listener = socket(AF_INET, SOCK_STREAM, 0);
+    OutputStats *outputStats() {
+        return &batcher.stats;
+    }
+
+    bool setTimestamping(bool isEnabled) {
+        return stamps.setEnabled(isEnabled);
+    }
+
+    StampStats *stampStats() {
+        return stamps.enabled() ? &stamps.stats : NULL;
+    }
+
+    bool holdReceive(EventHandler *p) {
+        Connection *c = connections.find((int) (long) p->getContext());
+        return c && buffers.hold(&c->heldBuffer);
+    }
+
+    void releaseReceive(EventHandler *p) {
+        Connection *c = connections.find((int) (long) p->getContext());
+        if (c) {
+            buffers.release(&c->heldBuffer);
+        }
+    }
+
+    void bindServer(const char *port, EventHandler *pProcessor) {
+        sockaddr_storage ss;
+        socklen_t slen = makeAddress(NULL, port, &ss);
+
+        if (ss.ss_family == AF_UNIX) {
+            unlink(port);
+        }
+        listener = socket(ss.ss_family, SOCK_STREAM, 0);
         this->server = pProcessor;
         setParent(pProcessor);
         fcntl(listener, F_SETFL, O_NONBLOCK);
         int oneval = 1;
         setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &oneval, sizeof(oneval));
-        if (bind(listener, (struct sockaddr*) &sin, sizeof(sin)) < 0) {
+        if ((acceptOptions & AcceptReusePort) && setsockopt(listener,
+                SOL_SOCKET, SO_REUSEPORT, &oneval, sizeof(oneval)) == -1) {
+            perror("SO_REUSEPORT");
+        }
+        if (bind(listener, (struct sockaddr*) &ss, slen) < 0) {
             perror("bind");
             return;
         }
         INFO_OUT("Bound to port %s", port);
-        if (listen(listener, 16) < 0) {
+        // Fan-in runs connect hundreds of clients before the loop accepts
+        if (listen(listener, SOMAXCONN) < 0) {
             perror("listen");
             return;
         }
+        addFd(listener, NULL);
         INFO_OUT("Listenning to port %s", port);
     }
 
@@ -152,23 +284,28 @@ public:
             INFO_OUT("Invalid context");
             return;
         }
-        if (::send((int) (long) p->getContext(), data, len, 0) == -1) {
-            perror("send");
-        }
+        int fd = (int) (long) p->getContext();
+        stamps.beforeSend(fd);
+        batcher.send(fd, data, len, NULL, 0, false);
+        stamps.afterSend(fd);
         INFO_OUT("Done sending");
 
     }
 
+    void disconnect(EventHandler *p) {
+        Connection *c = connections.find((int) (long) p->getContext());
+        if (c && c->pHandler) {
+            closeFd(c);
+        }
+    }
+
     void connectToServer(const char *address, const char *port,
             EventHandler *pProcessor) {
-        sockaddr_in sin = { 0 };
-
-        sin.sin_family = AF_INET;
-        sin.sin_port = htons(atoi(port));
-        inet_pton(AF_INET, address, &(sin.sin_addr));
-        dest = socket(AF_INET, SOCK_STREAM, 0);
-        this->client = pProcessor;
-        if (connect(dest, (sockaddr*) &sin, sizeof(sin)) < 0) {
+        sockaddr_storage ss;
+        socklen_t slen = makeAddress(address, port, &ss);
+
+        int dest = socket(ss.ss_family, SOCK_STREAM, 0);
+        if (connect(dest, (sockaddr*) &ss, slen) < 0) {
             perror("connect");
             exit(1);
             return;
@@ -176,6 +313,9 @@ public:
         setParent(pProcessor);
         pProcessor->setContext((Context*) (long) dest);
         fcntl(dest, F_SETFL, O_NONBLOCK);
+        setNoDelay(dest);
+        stamps.addSocket(dest, true);
+        addFd(dest, pProcessor);
         pProcessor->enable();
 
         // Investigate: should set reuse address ?
@@ -185,6 +325,8 @@ public:
 };
 
 
+REGISTER_TRANSPORT("epoll", EpollMain, "TCP with epoll (Linux)", TransportTimers)
+
 #ifdef BUILDTEST
 EpollMain EpollMain;
 EventMain *g_pmainProcessor = &EpollMain;
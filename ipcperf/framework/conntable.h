@@ -0,0 +1,118 @@
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "framework.h"
+
+const int CacheLineSize = 64;
+
+inline char *allocAligned(size_t size)
+{
+    void *p = NULL;
+    if (posix_memalign(&p, CacheLineSize, size) != 0) {
+        ERROR_OUT("Cannot allocate %lu aligned bytes\n", (unsigned long) size);
+        exit(1);
+    }
+    return (char*) p;
+}
+
+//
+// Per connection state of the socket loops, indexed by fd. Entries live in
+// cache line aligned slabs of SlabSize that are allocated on first use and
+// kept until the loop goes away, so connections that come and go reuse
+// their entries without touching the allocator, and an entry does not move
+// while the table grows, which lets epoll keep a pointer to it. T is plain
+// data, a fresh slab is zeroed.
+//
+template <class T>
+class ConnTable {
+public:
+    enum {SlabSize = 256};
+
+    ~ConnTable() {
+        for (size_t i = 0; i < slabs.size(); i++) {
+            free(slabs[i]);
+        }
+    }
+
+    // Entry of fd, allocating its slab if needed
+    T *get(int fd) {
+        size_t slab = fd / SlabSize;
+        if (slab >= slabs.size()) {
+            slabs.resize(slab + 1, NULL);
+        }
+        if (!slabs[slab]) {
+            slabs[slab] = (T*) allocAligned(SlabSize * sizeof(T));
+            memset(slabs[slab], 0, SlabSize * sizeof(T));
+        }
+        return &slabs[slab][fd % SlabSize];
+    }
+
+    // Fds below this may have an entry
+    int limit() {
+        return (int) (slabs.size() * SlabSize);
+    }
+
+    // Entry of fd, NULL when its slab was never used
+    T *find(int fd) {
+        size_t slab = fd / SlabSize;
+        if (fd < 0 || slab >= slabs.size() || !slabs[slab]) {
+            return NULL;
+        }
+        return &slabs[slab][fd % SlabSize];
+    }
+
+private:
+    std::vector<T*> slabs;
+};
+
+//
+// Receive buffers of a socket loop. The loop reads into current. A handler
+// that holds the data it was given takes current over, see holdReceive(),
+// and the loop carries on with a buffer from the pool. Released buffers go
+// back to the pool, so the steady state allocates nothing.
+//
+class RecvBuffers {
+public:
+    char *current;
+
+    RecvBuffers() {
+        current = get();
+    }
+
+    ~RecvBuffers() {
+        free(current);
+        for (size_t i = 0; i < pool.size(); i++) {
+            free(pool[i]);
+        }
+    }
+
+    // Hands current over to *pHeld. A connection holds one buffer at a time.
+    bool hold(char **pHeld) {
+        if (*pHeld) {
+            return false;
+        }
+        *pHeld = current;
+        current = get();
+        return true;
+    }
+
+    void release(char **pHeld) {
+        if (*pHeld) {
+            pool.push_back(*pHeld);
+            *pHeld = NULL;
+        }
+    }
+
+private:
+    std::vector<char*> pool;
+
+    char *get() {
+        if (pool.empty()) {
+            return allocAligned(RecvBufferSize);
+        }
+        char *buf = pool.back();
+        pool.pop_back();
+        return buf;
+    }
+};
@@ -0,0 +1,355 @@
+#pragma once
+#if __cplusplus < 202002L
+#error "coro.h needs C++20 coroutines, build with -std=c++20"
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <coroutine>
+#include <deque>
+#include <map>
+#include <string>
+#include "framework.h"
+
+//
+// Coroutine handlers on top of any EventMain. A CoHandler runs its run()
+// coroutine once per connection and the coroutine is written straight
+// through, with the connection's state in locals:
+//
+//     CoTask run(CoConnection &conn) {
+//         while (true) {
+//             CoMessage msg = co_await conn.recv();
+//             co_await conn.send(msg.data, msg.len);
+//         }
+//     }
+//
+// The loop still calls process(), which resumes the coroutine waiting on
+// that connection inline, so a message costs one resume and one suspend
+// over the callback and no queue or extra wakeup. A client's coroutine is
+// started by enable() when it connects, a server's when the first data of
+// a connection arrives. The data of a recv() is valid until the next
+// co_await, like that of process(). send() hands the bytes to the loop at
+// once, as EventHandler::send() does, and never suspends. Coroutine frames
+// come from CoFramePool instead of the allocator.
+//
+
+//
+// Free lists of coroutine frames by size class, one set per thread since a
+// loop and its coroutines stay on one thread. Frames larger than the
+// largest class go to malloc.
+//
+class CoFramePool {
+public:
+    static const size_t ClassSize = 64;
+    static const int NumClasses = 32;
+
+    static void *allocate(size_t size) {
+        int sizeClass = classOf(size);
+        if (sizeClass >= NumClasses) {
+            return mallocFrame(size);
+        }
+        FreeFrame *&head = freeLists()[sizeClass];
+        if (!head) {
+            return mallocFrame((sizeClass + 1) * ClassSize);
+        }
+        FreeFrame *frame = head;
+        head = frame->next;
+        return frame;
+    }
+
+    static void release(void *p, size_t size) {
+        int sizeClass = classOf(size);
+        if (sizeClass >= NumClasses) {
+            free(p);
+            return;
+        }
+        FreeFrame *frame = (FreeFrame*) p;
+        frame->next = freeLists()[sizeClass];
+        freeLists()[sizeClass] = frame;
+    }
+
+private:
+    struct FreeFrame {
+        FreeFrame *next;
+    };
+
+    static FreeFrame **freeLists() {
+        static __thread FreeFrame *lists[NumClasses];
+        return lists;
+    }
+
+    static int classOf(size_t size) {
+        return (int) ((size + ClassSize - 1) / ClassSize) - 1;
+    }
+
+    static void *mallocFrame(size_t size) {
+        void *p = malloc(size);
+        dieif(!p, "malloc");
+        return p;
+    }
+};
+
+//
+// Return type of a connection coroutine. It starts suspended and stays
+// suspended at its end, its CoHandler resumes and destroys it.
+//
+class CoTask {
+public:
+    struct promise_type {
+        CoTask get_return_object() {
+            return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {
+        }
+
+        // Handlers do not throw, the rest of the framework has no
+        // exceptions to pass one on to
+        void unhandled_exception() {
+            ERROR_OUT("Exception in a coroutine handler\n");
+            abort();
+        }
+
+        static void *operator new(size_t size) {
+            return CoFramePool::allocate(size);
+        }
+
+        static void operator delete(void *p, size_t size) {
+            CoFramePool::release(p, size);
+        }
+    };
+
+    CoTask() {
+    }
+
+    explicit CoTask(std::coroutine_handle<promise_type> handle) :
+            handle(handle) {
+    }
+
+    CoTask(CoTask &&other) : handle(other.handle) {
+        other.handle = nullptr;
+    }
+
+    CoTask &operator=(CoTask &&other) {
+        if (this != &other) {
+            destroy();
+            handle = other.handle;
+            other.handle = nullptr;
+        }
+        return *this;
+    }
+
+    ~CoTask() {
+        destroy();
+    }
+
+    bool done() {
+        return !handle || handle.done();
+    }
+
+    void resume() {
+        handle.resume();
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    void destroy() {
+        if (handle) {
+            handle.destroy();
+            handle = nullptr;
+        }
+    }
+};
+
+// What co_await CoConnection::recv() returns
+struct CoMessage {
+    char *data;
+    int len;
+};
+
+class CoHandler;
+
+class CoConnection {
+public:
+    struct RecvAwaiter {
+        CoConnection *pConn;
+
+        bool await_ready() {
+            return pConn->takePending();
+        }
+
+        void await_suspend(std::coroutine_handle<> waiter) {
+            pConn->waiter = waiter;
+        }
+
+        CoMessage await_resume() {
+            return pConn->message;
+        }
+    };
+
+    // The send is done by the time it is awaited
+    struct SendAwaiter {
+        bool await_ready() {
+            return true;
+        }
+
+        void await_suspend(std::coroutine_handle<>) {
+        }
+
+        void await_resume() {
+        }
+    };
+
+    CoConnection(CoHandler *pHandler, Context *pContext) :
+            pHandler(pHandler), pContext(pContext) {
+        message.data = NULL;
+        message.len = 0;
+    }
+
+    RecvAwaiter recv() {
+        return RecvAwaiter{this};
+    }
+
+    SendAwaiter send(const char *data, int len);
+
+    Context *getContext() {
+        return pContext;
+    }
+
+private:
+    friend class CoHandler;
+
+    CoHandler *pHandler;
+    Context *pContext;
+    CoTask task;
+    // Set while the coroutine waits in recv()
+    std::coroutine_handle<> waiter;
+    CoMessage message;
+    // Data that arrived while the coroutine was not in recv(), copied since
+    // process() only lends it, and the copy the last recv() returned
+    std::deque<std::string> pending;
+    std::string current;
+
+    bool takePending() {
+        if (pending.empty()) {
+            return false;
+        }
+        current.swap(pending.front());
+        pending.pop_front();
+        message.data = &current[0];
+        message.len = (int) current.size();
+        return true;
+    }
+
+    // Returns false once the coroutine has ended
+    bool deliver(char *data, int len) {
+        if (!waiter) {
+            pending.push_back(std::string(data, len));
+            return !task.done();
+        }
+        message.data = data;
+        message.len = len;
+        std::coroutine_handle<> h = waiter;
+        waiter = nullptr;
+        h.resume();
+        return !task.done();
+    }
+};
+
+class CoHandler: public EventHandler {
+public:
+    CoHandler() : pLast(NULL) {
+        description = "coroutine handler";
+    }
+
+    ~CoHandler() {
+        for (std::map<Context*, CoConnection*>::iterator it = connections.begin();
+                it != connections.end(); ++it) {
+            delete it->second;
+        }
+    }
+
+    // Body of every connection, see the top of the file
+    virtual CoTask run(CoConnection &conn) = 0;
+
+    // A client has connected, its coroutine starts right away
+    void enable() {
+        start(getContext());
+    }
+
+    void process(char *data, int len, bool iseof) {
+        Context *pContext = getContext();
+        CoConnection *pConn = pLast;
+        if (!pConn || pConn->pContext != pContext) {
+            std::map<Context*, CoConnection*>::iterator it = connections.find(
+                    pContext);
+            pConn = it != connections.end() ? it->second : start(pContext);
+            pLast = pConn;
+        }
+        if (pConn && !pConn->deliver(data, len)) {
+            end(pContext);
+        }
+    }
+
+    // The coroutine of a closed connection is destroyed where it waits
+    void closed() {
+        end(getContext());
+    }
+
+    int numConnections() {
+        return (int) connections.size();
+    }
+
+private:
+    friend class CoConnection;
+
+    std::map<Context*, CoConnection*> connections;
+    // Connection of the last process() call, which saves the map lookup
+    // while one connection is busy
+    CoConnection *pLast;
+
+    // Runs the coroutine of a new connection up to its first co_await,
+    // returns NULL when it ended before
+    CoConnection *start(Context *pContext) {
+        CoConnection *pConn = new CoConnection(this, pContext);
+        connections[pContext] = pConn;
+        pConn->task = run(*pConn);
+        pConn->task.resume();
+        if (pConn->task.done()) {
+            end(pContext);
+            return NULL;
+        }
+        return pConn;
+    }
+
+    void end(Context *pContext) {
+        std::map<Context*, CoConnection*>::iterator it = connections.find(
+                pContext);
+        if (it != connections.end()) {
+            if (pLast == it->second) {
+                pLast = NULL;
+            }
+            delete it->second;
+            connections.erase(it);
+        }
+    }
+};
+
+inline CoConnection::SendAwaiter CoConnection::send(const char *data, int len)
+{
+    // The loop sends on the handler's current context, a server coroutine
+    // may send while another connection's data is being processed
+    Context *pSaved = pHandler->getContext();
+    pHandler->setContext(pContext);
+    pHandler->send(data, len, true);
+    pHandler->setContext(pSaved);
+    return SendAwaiter();
+}
@@ -0,0 +1,169 @@
+#pragma once
+#include <sched.h>
+#include <string>
+#include <vector>
+#include "framework.h"
+
+//
+// Client and server CPU placement for separate process runs. The named
+// placements are picked from the Linux sysfs topology among the CPUs this
+// process may run on:
+//   core    both on one CPU
+//   smt     two hardware threads of one core
+//   l3      two cores sharing an L3 cache
+//   socket  two CPUs in different packages
+// "N:M" pins the client to CPU N and the server to CPU M.
+//
+
+struct CpuPlacement {
+    char name[16];
+    int clientCpu;
+    int serverCpu;
+
+    bool isPinned() const {
+        return clientCpu >= 0;
+    }
+};
+
+struct CpuTopology {
+    int cpu;
+    int package;
+    int core;
+    std::string l3;
+};
+
+// Reads the first line of a sysfs file, empty when it does not exist
+inline std::string readSysFile(const char *path)
+{
+    char line[256] = "";
+    FILE *f = fopen(path, "r");
+    if (f) {
+        if (!fgets(line, sizeof(line), f)) {
+            line[0] = 0;
+        }
+        fclose(f);
+    }
+    line[strcspn(line, "\n")] = 0;
+    return line;
+}
+
+inline std::vector<CpuTopology> getCpuTopology()
+{
+    std::vector<CpuTopology> cpus;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        return cpus;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        char path[128];
+        CpuTopology t;
+        t.cpu = cpu;
+        snprintf(path, sizeof(path),
+                "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        t.package = atoi(readSysFile(path).c_str());
+        snprintf(path, sizeof(path),
+                "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        t.core = atoi(readSysFile(path).c_str());
+        // The L3 is the cache index with level 3, identified by its CPU list
+        for (int index = 0; index < 8; index++) {
+            snprintf(path, sizeof(path),
+                    "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+            std::string level = readSysFile(path);
+            if (level.empty()) {
+                break;
+            }
+            if (level == "3") {
+                snprintf(path, sizeof(path),
+                        "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+                        cpu, index);
+                t.l3 = readSysFile(path);
+            }
+        }
+        cpus.push_back(t);
+    }
+#endif
+    return cpus;
+}
+
+//
+// Resolves a placement name to a pair of CPUs. Prints why and returns false
+// when the host has no such pair.
+//
+inline bool resolvePlacement(const char *spec, CpuPlacement *pPlacement)
+{
+    snprintf(pPlacement->name, sizeof(pPlacement->name), "%s", spec);
+    pPlacement->clientCpu = -1;
+    pPlacement->serverCpu = -1;
+    if (strcmp(spec, "none") == 0) {
+        return true;
+    }
+    int clientCpu, serverCpu;
+    char end;
+    if (sscanf(spec, "%d:%d%c", &clientCpu, &serverCpu, &end) == 2) {
+        pPlacement->clientCpu = clientCpu;
+        pPlacement->serverCpu = serverCpu;
+        return true;
+    }
+    if (strcmp(spec, "core") && strcmp(spec, "smt") && strcmp(spec, "l3")
+            && strcmp(spec, "socket")) {
+        fprintf(stderr, "Invalid placement %s, use none, core, smt, l3, socket"
+                " or client:server cpus\n", spec);
+        return false;
+    }
+    std::vector<CpuTopology> cpus = getCpuTopology();
+    if (cpus.empty()) {
+        fprintf(stderr, "No CPU topology on this host for placement %s\n", spec);
+        return false;
+    }
+    if (strcmp(spec, "core") == 0) {
+        pPlacement->clientCpu = pPlacement->serverCpu = cpus[0].cpu;
+        return true;
+    }
+    for (size_t i = 0; i < cpus.size(); i++) {
+        for (size_t j = i + 1; j < cpus.size(); j++) {
+            const CpuTopology &a = cpus[i];
+            const CpuTopology &b = cpus[j];
+            bool sameCore = a.package == b.package && a.core == b.core;
+            bool found;
+            if (strcmp(spec, "smt") == 0) {
+                found = sameCore;
+            } else if (strcmp(spec, "l3") == 0) {
+                found = !sameCore && !a.l3.empty() && a.l3 == b.l3;
+            } else {
+                found = a.package != b.package;
+            }
+            if (found) {
+                pPlacement->clientCpu = a.cpu;
+                pPlacement->serverCpu = b.cpu;
+                return true;
+            }
+        }
+    }
+    fprintf(stderr, "No two CPUs of %d available fit placement %s\n",
+            (int) cpus.size(), spec);
+    return false;
+}
+
+// Pins the calling process to one CPU, -1 leaves it unpinned
+inline void pinToCpu(int cpu)
+{
+    if (cpu < 0) {
+        return;
+    }
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        ERRNO_OUT("Cannot pin to cpu %d", cpu);
+        exit(1);
+    }
+#else
+    ERROR_OUT("CPU pinning is only supported on Linux\n");
+#endif
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#include "histogram.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// CPU time used by all threads of this process
+inline uint64_t getProcessCpuNanos()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Gives up the CPU for at least nanos, nothing for 0
+inline void sleepNanos(uint64_t nanos)
+{
+    if (nanos) {
+        timespec delay = {(time_t) (nanos / 1000000000), (long) (nanos % 1000000000)};
+        nanosleep(&delay, NULL);
+    }
+}
+
+// Free running cycle counter: the TSC on x86, the virtual counter on arm64.
+// Returns 0 where there is none.
+inline uint64_t readCycleCounter()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return 0;
+#endif
+}
+
+//
+// Cycle counter ticks per nanosecond, measured once against the monotonic
+// clock over 20ms. The TSC runs at the nominal frequency, so CPU time times
+// this rate gives reference cycles, not the turbo cycles a PMU would count.
+//
+inline double getCyclesPerNano()
+{
+    static double cyclesPerNano = -1;
+    if (cyclesPerNano < 0) {
+        uint64_t beginNanos = getMonotonicNanos();
+        uint64_t beginCycles = readCycleCounter();
+        timespec delay = {0, 20 * 1000 * 1000};
+        nanosleep(&delay, NULL);
+        uint64_t elapsed = getMonotonicNanos() - beginNanos;
+        cyclesPerNano = (readCycleCounter() - beginCycles) / (double) elapsed;
+    }
+    return cyclesPerNano;
+}
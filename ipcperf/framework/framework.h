@@ -2,15 +2,37 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 #include <iostream>
 #include <sys/time.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include "trace.h"
+#include "livestats.h"
+
+#ifndef MSG_NOSIGNAL
+// Mac OSX has SO_NOSIGPIPE instead
+#define MSG_NOSIGNAL 0
+#endif
 
 #ifndef traceLevel
 #define traceLevel 0
 #endif
 
+// Largest message any transport has to carry, used to size shared memory
+// segments and payload buffers.
+const int MaxMessageSize = 1 << 20;
+
+// Size of the per loop receive buffer of the socket transports. Messages
+// larger than this arrive in several process() calls.
+const int RecvBufferSize = 64 * 1024;
+
 
 inline void diep(const char *s)
 {
@@ -48,6 +70,75 @@ fprintf(stderr, ": %d (%s)\e[0m\n", errno, strerror(errno));\
     fflush(stderr);\
 }
 
+// Request/response traffic must not wait for Nagle to coalesce the tail of
+// a message that was written in several pieces.
+inline void setNoDelay(int fd)
+{
+    int oneval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &oneval, sizeof(oneval));
+}
+
+// Fills ss with the address of a port. A port starting with '/' is the path
+// of a unix domain socket, anything else a TCP/UDP port on address.
+// Returns the length of the address.
+inline socklen_t makeAddress(const char *address, const char *port,
+        sockaddr_storage *ss)
+{
+    memset(ss, 0, sizeof(*ss));
+    if (port[0] == '/') {
+        sockaddr_un *sun = (sockaddr_un*) ss;
+        sun->sun_family = AF_UNIX;
+        strncpy(sun->sun_path, port, sizeof(sun->sun_path) - 1);
+        return sizeof(sockaddr_un);
+    }
+    sockaddr_in *sin = (sockaddr_in*) ss;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(atoi(port));
+    if (address) {
+        inet_pton(AF_INET, address, &(sin->sin_addr));
+    }
+    return sizeof(sockaddr_in);
+}
+
+//
+// Writes all of data to a non blocking socket. A full socket buffer is
+// waited out with poll() when canWait is set, which needs a peer in another
+// process to drain it. Otherwise both ends share this thread and nothing
+// would ever drain it, so it exits like a full message ring does.
+// Returns false when the peer is gone. pCalls, when given, counts the
+// send() calls made.
+//
+inline bool sendAll(int fd, const char *data, int len, bool canWait,
+        uint64_t *pCalls = NULL)
+{
+    while (len > 0) {
+        if (pCalls) {
+            (*pCalls)++;
+        }
+        ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+        if (n > 0) {
+            data += n;
+            len -= n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!canWait) {
+                ERROR_OUT("Socket buffer full, too many bytes in flight\n");
+                exit(1);
+            }
+            pollfd pfd = {fd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        perror("send");
+        return false;
+    }
+    return true;
+}
+
 inline long int getTimeDiff(struct timeval *t2, struct timeval *t1)
 {
     return (t2->tv_usec + 1000000 * t2->tv_sec) - (t1->tv_usec + 1000000 * t1->tv_sec);
@@ -96,6 +187,17 @@ protected:
 
 
 struct Context;
+struct OutputStats;
+struct StampStats;
+
+// Called by the loop when a timer added with EventMain::addTimer() expires
+class TimerHandler {
+public:
+    virtual void onTimer(int id) = 0;
+
+    virtual ~TimerHandler() {
+    }
+};
 
 class EventMain;
 
@@ -125,7 +227,17 @@ public:
     }
 
     void send(const char *data, int len, bool iseof);
+    char *acquireSend(int len);
+    void commitSend(char *buf, int len, bool iseof);
+    bool holdReceive();
+    void releaseReceive();
     virtual void process(char *data, int length, bool iseof) = 0;
+    // Called with the context of a connection the loop closed, at end of
+    // file, on an error or through disconnect(), before another connection
+    // can get the same context. Handlers that keep state per context drop
+    // it here.
+    virtual void closed() {
+    }
 
     EventMain *getParent() {
         return (EventMain*) this->parent;
@@ -134,21 +246,136 @@ public:
 };
 
 
+// Listening socket options of the TCP transports, see setAcceptOptions().
+// AcceptNonBlock accepts with accept4() and SOCK_NONBLOCK, which saves the
+// fcntl() of every connection. AcceptReusePort sets SO_REUSEPORT, so the
+// loops of several threads can each bind the port and the kernel spreads
+// the connections over them.
+const int AcceptNonBlock = 1;
+const int AcceptReusePort = 2;
+
+//
+// Besides send(), which copies the caller's buffer, a handler can lease a
+// send buffer from the transport: acquireSend() returns room for len bytes,
+// the handler writes the message in place and passes it to commitSend().
+// Only one lease may be open at a time and nothing else may be sent on
+// the connection meanwhile. The ring transports hand out the ring slot
+// itself; the default is a scratch buffer that commitSend() sends with
+// send().
+//
+// The data passed to process() is valid until it returns. Calling
+// holdReceive() from process() keeps it valid until releaseReceive(), and
+// no further message is delivered to that handler meanwhile. It returns
+// false when the transport reuses the buffer, the handler has to copy then.
+// The socket loops hand the held buffer over and read on into a pooled one
+// (see conntable.h), so delivery goes on; a connection holds one buffer at
+// a time and releases it with its context set.
+//
 class EventMain: public Processor {
+protected:
+    char *leaseBuffer;
+    int leaseSize;
 
 public:
+    EventMain() :
+            leaseBuffer(NULL), leaseSize(0) {
+    }
     virtual void cancelLoop() = 0;
     virtual void bindServer(const char *port, EventHandler *pProcessor) = 0;
     virtual void send(EventHandler *p, const char *data, int len, bool isDataEnd) = 0;
+    virtual char *acquireSend(EventHandler *p, int len) {
+        if (len > leaseSize) {
+            free(leaseBuffer);
+            leaseBuffer = (char*) malloc(len);
+            dieif(!leaseBuffer, "malloc");
+            leaseSize = len;
+        }
+        return leaseBuffer;
+    }
+    virtual void commitSend(EventHandler *p, char *buf, int len, bool isDataEnd) {
+        send(p, buf, len, isDataEnd);
+    }
+    virtual bool holdReceive(EventHandler *p) {
+        return false;
+    }
+    virtual void releaseReceive(EventHandler *p) {
+    }
+    // Output batching of the socket transports, see outqueue.h. The others
+    // have nothing to batch and ignore it.
+    virtual void setBatching(int maxBytes, uint64_t maxDelayNanos) {
+    }
+    virtual OutputStats *outputStats() {
+        return NULL;
+    }
+    // Kernel send and receive timestamps of the socket transports, see
+    // sockstamps.h. Called before any socket exists, returns false when
+    // the transport cannot stamp.
+    virtual bool setTimestamping(bool isEnabled) {
+        return !isEnabled;
+    }
+    virtual StampStats *stampStats() {
+        return NULL;
+    }
+    // One shot timers run by the loop: pTimer->onTimer() is called once
+    // delayNanos have passed, a delay of 0 defers the call to the next turn
+    // of the loop. Returns the id for cancelTimer(), or -1 when the
+    // transport has no timers (see TransportTimers).
+    virtual int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return -1;
+    }
+    virtual void cancelTimer(int id) {
+    }
     virtual void connectToServer(const char *address, const char *port,
             EventHandler *pProcessor) = 0;
+    // Closes the connection of p's context as if the peer had, after which
+    // p can connect again. Transports without connections ignore it.
+    virtual void disconnect(EventHandler *p) {
+    }
+    // Called between initialize() and bindServer(), returns false when the
+    // transport cannot set the options
+    virtual bool setAcceptOptions(int options) {
+        return !options;
+    }
+    // Largest message the transport can deliver in one send
+    virtual int maxMessageSize() {
+        return MaxMessageSize;
+    }
     void setParent(EventHandler *pProcessor) {
         pProcessor->parent = this;
     }
+    // Tells the handler of a closed connection, see EventHandler::closed()
+    void notifyClosed(EventHandler *p, Context *pContext) {
+        if (p) {
+            p->setContext(pContext);
+            p->closed();
+        }
+    }
 
 };
 
 inline void EventHandler::send(const char *data, int len, bool iseof) {
+    TRACE_EVENT(TraceSend, len);
+    LIVE_STAT(liveSent(pLive, len));
     ((EventMain*) this->parent)->send(this, data, len, iseof);
+    TRACE_EVENT(TraceSendDone, 0);
+}
+
+inline char *EventHandler::acquireSend(int len) {
+    return ((EventMain*) this->parent)->acquireSend(this, len);
+}
+
+inline void EventHandler::commitSend(char *buf, int len, bool iseof) {
+    TRACE_EVENT(TraceSend, len);
+    LIVE_STAT(liveSent(pLive, len));
+    ((EventMain*) this->parent)->commitSend(this, buf, len, iseof);
+    TRACE_EVENT(TraceSendDone, 0);
+}
+
+inline bool EventHandler::holdReceive() {
+    return ((EventMain*) this->parent)->holdReceive(this);
+}
+
+inline void EventHandler::releaseReceive() {
+    ((EventMain*) this->parent)->releaseReceive(this);
 }
 
@@ -0,0 +1,195 @@
+#pragma once
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include "framework.h"
+
+//
+// Length prefixed binary frames, so a handler sees whole messages whatever
+// the transport does to them: stream sockets coalesce and split writes,
+// datagram and ring transports deliver one message per call. Both ends run
+// on one host, so the header is in host byte order.
+//
+struct FrameHeader {
+    uint16_t type;
+    uint16_t flags;
+    // Payload bytes following the header
+    uint32_t length;
+    uint32_t seq;
+};
+
+const int FrameHeaderSize = sizeof(FrameHeader);
+
+// Receives the frames a FrameReader parses
+class FrameSink {
+public:
+    // frame points at the header followed by the payload, contiguous and
+    // writable until the call returns. It is NULL for a frame whose payload
+    // the sink declined.
+    virtual void processFrame(const FrameHeader &header, char *frame) = 0;
+
+    // Whether a frame split across reads has to be assembled. A sink that
+    // only needs the header of some types saves the copy of their payload.
+    virtual bool wantsPayload(const FrameHeader &header) {
+        return true;
+    }
+
+    virtual ~FrameSink() {
+    }
+};
+
+//
+// Incremental reassembly of the frames of one connection. feed() takes the
+// bytes of each read and passes every complete frame in them to the sink.
+// A frame that lies entirely in the read is passed in place; one split
+// across reads is assembled in the reader's buffer first.
+//
+class FrameReader {
+public:
+    FrameReader() : numBuffered(0), keepPayload(true) {
+    }
+
+    // Returns false on a frame longer than MaxMessageSize, which means the
+    // stream is out of step.
+    bool feed(char *data, int len, FrameSink *pSink) {
+        while (len > 0) {
+            if (numBuffered == 0 && len >= FrameHeaderSize) {
+                memcpy(&header, data, FrameHeaderSize);
+                if (header.length > (uint32_t) MaxMessageSize) {
+                    return false;
+                }
+                int total = FrameHeaderSize + header.length;
+                if (len >= total) {
+                    LIVE_STAT(liveAdd(pLive->messagesReceived, 1));
+                    pSink->processFrame(header, data);
+                    data += total;
+                    len -= total;
+                    continue;
+                }
+            }
+            if (numBuffered < FrameHeaderSize) {
+                int n = FrameHeaderSize - numBuffered;
+                n = len < n ? len : n;
+                memcpy((char*) &header + numBuffered, data, n);
+                numBuffered += n;
+                data += n;
+                len -= n;
+                if (numBuffered < FrameHeaderSize) {
+                    continue;
+                }
+                if (header.length > (uint32_t) MaxMessageSize) {
+                    return false;
+                }
+                keepPayload = pSink->wantsPayload(header);
+                if (keepPayload) {
+                    buffer.resize(FrameHeaderSize + header.length);
+                    memcpy(&buffer[0], &header, FrameHeaderSize);
+                }
+            }
+            int total = FrameHeaderSize + header.length;
+            int n = total - numBuffered;
+            n = len < n ? len : n;
+            if (keepPayload) {
+                memcpy(&buffer[numBuffered], data, n);
+            }
+            numBuffered += n;
+            data += n;
+            len -= n;
+            if (numBuffered == total) {
+                numBuffered = 0;
+                LIVE_STAT(liveAdd(pLive->messagesReceived, 1));
+                pSink->processFrame(header, keepPayload ? &buffer[0] : NULL);
+            }
+        }
+        return true;
+    }
+
+private:
+    FrameHeader header;
+    // Bytes of the current frame read so far, skipped payload included
+    int numBuffered;
+    bool keepPayload;
+    std::vector<char> buffer;
+};
+
+//
+// Base of the handlers that speak frames. It keeps a reader per connection
+// and dispatches every frame to processFrame(), where the subclass switches
+// on the frame type.
+//
+class FrameHandler: public EventHandler, public FrameSink {
+public:
+    std::map<Context*, FrameReader> readers;
+
+    FrameHandler() : pLastContext(NULL), pLastReader(NULL), pFeeding(NULL),
+            isFeedingClosed(false) {
+    }
+
+    virtual void process(char *data, int len, bool iseof) {
+        TRACE_EVENT(TraceDispatch, len);
+        LIVE_STAT(liveAdd(pLive->bytesReceived, len));
+        Context *pContext = getContext();
+        if (!pLastReader || pLastContext != pContext) {
+            pLastReader = &readers[pContext];
+            pLastContext = pContext;
+        }
+        pFeeding = pContext;
+        bool isValid = pLastReader->feed(data, len, this);
+        pFeeding = NULL;
+        if (!isValid) {
+            ERROR_OUT("Frame longer than %d bytes, stream out of step\n",
+                    MaxMessageSize);
+            exit(1);
+        }
+        if (isFeedingClosed) {
+            isFeedingClosed = false;
+            eraseReader(pContext);
+        }
+        TRACE_EVENT(TraceHandlerDone, 0);
+    }
+
+    // A reused fd must not inherit the partial frame of its last connection.
+    // A connection closed from its own processFrame() keeps its reader until
+    // feed() returns.
+    virtual void closed() {
+        if (getContext() == pFeeding) {
+            isFeedingClosed = true;
+        } else {
+            eraseReader(getContext());
+        }
+    }
+
+    void invalidFrame(const FrameHeader &header) {
+        ERROR_OUT("Unexpected frame type %u, seq %u, length %u\n", header.type,
+                header.seq, header.length);
+        exit(1);
+    }
+
+    // Sends a frame through a send buffer leased from the transport
+    void sendFrame(uint16_t type, uint16_t flags, uint32_t seq,
+            const char *payload, uint32_t length) {
+        FrameHeader header = {type, flags, length, seq};
+        char *buf = acquireSend(FrameHeaderSize + length);
+        memcpy(buf, &header, FrameHeaderSize);
+        if (length) {
+            memcpy(buf + FrameHeaderSize, payload, length);
+        }
+        commitSend(buf, FrameHeaderSize + length, true);
+    }
+
+private:
+    // Reader of the last process() call, which saves the map lookup while
+    // one connection is busy
+    Context *pLastContext;
+    FrameReader *pLastReader;
+    // Connection whose reader is in feed()
+    Context *pFeeding;
+    bool isFeedingClosed;
+
+    void eraseReader(Context *pContext) {
+        if (pContext == pLastContext) {
+            pLastReader = NULL;
+        }
+        readers.erase(pContext);
+    }
+};
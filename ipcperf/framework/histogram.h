@@ -0,0 +1,195 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+//
+// Monotonic time source used for latency measurements. gettimeofday can
+// jump with NTP adjustments and only has microsecond resolution, which is
+// too coarse for the shared memory transports.
+//
+inline uint64_t getMonotonicNanos()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Log-bucketed latency histogram in the spirit of HdrHistogram. Values below
+// 2^SubBucketBits are recorded exactly, larger values are grouped in buckets
+// whose width doubles with every power of two, so the relative error stays
+// below 1/2^(SubBucketBits-1) (~1.6%) over the whole 64 bit range while the
+// table stays a fixed size and recording is a couple of shifts.
+//
+class LatencyHistogram {
+public:
+    static const int SubBucketBits = 7;
+    static const int HalfSubBucketCount = 1 << (SubBucketBits - 1);
+    static const int NumBuckets = (64 - SubBucketBits + 2) * HalfSubBucketCount;
+
+    LatencyHistogram() {
+        reset();
+    }
+
+    void reset() {
+        memset(counts, 0, sizeof(counts));
+        totalCount = 0;
+        totalSum = 0;
+        minValue = UINT64_MAX;
+        maxValue = 0;
+    }
+
+    static int indexOf(uint64_t value) {
+        if (value < (1ULL << SubBucketBits)) {
+            return (int) value;
+        }
+        int shift = 63 - __builtin_clzll(value) - (SubBucketBits - 1);
+        return (shift << (SubBucketBits - 1)) + (int) (value >> shift);
+    }
+
+    // Lowest value that maps to the bucket
+    static uint64_t lowestValueAt(int index) {
+        if (index < (1 << SubBucketBits)) {
+            return index;
+        }
+        int shift = (index >> (SubBucketBits - 1)) - 1;
+        uint64_t sub = index - (shift << (SubBucketBits - 1));
+        return sub << shift;
+    }
+
+    // Highest value that maps to the bucket
+    static uint64_t highestValueAt(int index) {
+        if (index < (1 << SubBucketBits)) {
+            return index;
+        }
+        int shift = (index >> (SubBucketBits - 1)) - 1;
+        uint64_t sub = index - (shift << (SubBucketBits - 1));
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void record(uint64_t value) {
+        counts[indexOf(value)]++;
+        totalCount++;
+        totalSum += value;
+        if (value < minValue) {
+            minValue = value;
+        }
+        if (value > maxValue) {
+            maxValue = value;
+        }
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (int i = 0; i < NumBuckets; i++) {
+            counts[i] += other.counts[i];
+        }
+        totalCount += other.totalCount;
+        totalSum += other.totalSum;
+        if (other.minValue < minValue) {
+            minValue = other.minValue;
+        }
+        if (other.maxValue > maxValue) {
+            maxValue = other.maxValue;
+        }
+    }
+
+    uint64_t count() const {
+        return totalCount;
+    }
+
+    uint64_t min() const {
+        return totalCount ? minValue : 0;
+    }
+
+    uint64_t max() const {
+        return maxValue;
+    }
+
+    double mean() const {
+        return totalCount ? (double) totalSum / totalCount : 0.0;
+    }
+
+    // Value at the given percentile (0-100). Reports the upper edge of the
+    // bucket, clamped to the largest recorded value.
+    uint64_t valueAtPercentile(double percentile) const {
+        if (!totalCount) {
+            return 0;
+        }
+        uint64_t target = (uint64_t) (percentile / 100.0 * totalCount + 0.5);
+        if (target < 1) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for (int i = 0; i < NumBuckets; i++) {
+            seen += counts[i];
+            if (seen >= target) {
+                uint64_t value = highestValueAt(i);
+                return value < maxValue ? value : maxValue;
+            }
+        }
+        return maxValue;
+    }
+
+    // One line summary, values are recorded in nanoseconds and printed in
+    // microseconds.
+    void printSummary(FILE *out, const char *label) const {
+        fprintf(out, "%s latency usec: count %llu, min %.2f, mean %.2f, p50 %.2f, "
+                "p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n", label,
+                (unsigned long long) totalCount, min() / 1000.0, mean() / 1000.0,
+                valueAtPercentile(50) / 1000.0, valueAtPercentile(90) / 1000.0,
+                valueAtPercentile(99) / 1000.0, valueAtPercentile(99.9) / 1000.0,
+                max() / 1000.0);
+    }
+
+    // Percentile distribution in the HdrHistogram output format: the step
+    // between reported percentiles halves every time the remaining tail
+    // halves, so the tail gets as many rows as the body.
+    void printDistribution(FILE *out, int ticksPerHalfDistance = 2) const {
+        fprintf(out, "%12s %12s %12s %12s\n", "Value(usec)", "Percentile",
+                "TotalCount", "1/(1-Pct)");
+        if (!totalCount) {
+            return;
+        }
+        double percentile = 0;
+        double step = 100.0 / (2 * ticksPerHalfDistance);
+        int ticks = 0;
+        while (true) {
+            uint64_t value = valueAtPercentile(percentile);
+            uint64_t below = countAtOrBelow(value);
+            double pct = (double) below / totalCount;
+            if (below >= totalCount) {
+                fprintf(out, "%12.3f %12.6f %12llu\n", value / 1000.0, 1.0,
+                        (unsigned long long) below);
+                break;
+            }
+            fprintf(out, "%12.3f %12.6f %12llu %12.2f\n", value / 1000.0, pct,
+                    (unsigned long long) below, 1.0 / (1.0 - pct));
+            percentile += step;
+            if (++ticks == ticksPerHalfDistance) {
+                ticks = 0;
+                step /= 2;
+            }
+            if (step < 1e-6) {
+                percentile = 100;
+            }
+        }
+    }
+
+private:
+    uint64_t countAtOrBelow(uint64_t value) const {
+        uint64_t seen = 0;
+        int last = indexOf(value);
+        for (int i = 0; i <= last; i++) {
+            seen += counts[i];
+        }
+        return seen;
+    }
+
+    uint64_t counts[NumBuckets];
+    uint64_t totalCount;
+    uint64_t totalSum;
+    uint64_t minValue;
+    uint64_t maxValue;
+};
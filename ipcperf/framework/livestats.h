@@ -0,0 +1,195 @@
+#pragma once
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include "histogram.h"
+
+//
+// Live counters of a running process in a small shared memory segment,
+// /dev/shm/ipcperf-<pid> on Linux, that ipcstat samples while a long run
+// goes on. The loop adds to the counters of its own page with relaxed
+// loads and stores, no locked instruction and no system call, and the
+// reader maps the page read only, so sampling costs the loop at most the
+// cache misses of the lines the reader touched.
+//
+// Every counter has one writer: each process runs one loop thread, a
+// forked server or driver cell opens a page of its own. Publishing is off
+// until liveStatsEnable(); LIVE_STAT then costs a predictable branch.
+//
+
+const uint32_t LiveStatsMagic = 0x4c495645;
+const uint32_t LiveStatsVersion = 1;
+
+struct LiveStatsPage {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    // "client", "server" or "client+server"
+    char role[20];
+    uint64_t startNanos;
+    std::atomic<uint64_t> messagesSent;
+    std::atomic<uint64_t> bytesSent;
+    // Frames passed to handlers and the bytes read for them
+    std::atomic<uint64_t> messagesReceived;
+    std::atomic<uint64_t> bytesReceived;
+    // Turns of the loop, and those that found nothing to do: a wait that
+    // timed out, or a spin over rings that were all empty
+    std::atomic<uint64_t> loopIterations;
+    std::atomic<uint64_t> emptyPolls;
+    // Round trips of the clients, buckets as in LatencyHistogram
+    std::atomic<uint64_t> latencyCount;
+    std::atomic<uint64_t> latencySum;
+    std::atomic<uint64_t> latency[LatencyHistogram::NumBuckets];
+};
+
+inline LiveStatsPage *&liveStatsPage()
+{
+    static LiveStatsPage *pPage = NULL;
+    return pPage;
+}
+
+// Only the owning thread writes a counter, so a plain add is enough
+inline void liveAdd(std::atomic<uint64_t> &counter, uint64_t n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+}
+
+// A statement of its own, safe in an unbraced if/else
+#define LIVE_STAT(statement) do {\
+if (LiveStatsPage *pLive = liveStatsPage()) {\
+statement;\
+}\
+} while (0)
+
+inline void liveSent(LiveStatsPage *pLive, int len)
+{
+    liveAdd(pLive->messagesSent, 1);
+    liveAdd(pLive->bytesSent, len);
+}
+
+// numEvents is what the wait returned or the messages a spin dispatched
+inline void liveLoop(LiveStatsPage *pLive, int numEvents)
+{
+    liveAdd(pLive->loopIterations, 1);
+    if (numEvents <= 0) {
+        liveAdd(pLive->emptyPolls, 1);
+    }
+}
+
+inline void liveLatency(LiveStatsPage *pLive, uint64_t nanos)
+{
+    liveAdd(pLive->latency[LatencyHistogram::indexOf(nanos)], 1);
+    liveAdd(pLive->latencyCount, 1);
+    liveAdd(pLive->latencySum, nanos);
+}
+
+inline void liveStatsName(pid_t pid, char *name, size_t size)
+{
+    snprintf(name, size, "/ipcperf-%d", (int) pid);
+}
+
+inline void liveStatsClose();
+
+inline struct sigaction &liveStatsPrevious(int sig)
+{
+    static struct sigaction previous[2];
+    return previous[sig == SIGINT];
+}
+
+// Removes the segment, then lets the handler that was there before run,
+// the trace dump or the default exit
+inline void liveStatsSignal(int sig)
+{
+    liveStatsClose();
+    struct sigaction &previous = liveStatsPrevious(sig);
+    if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(sig);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+inline void liveStatsAtExit()
+{
+    liveStatsClose();
+}
+
+//
+// Creates the page of this process, a forked child drops the mapping of
+// its parent. Returns false when shared memory cannot be had.
+//
+inline bool liveStatsEnable(const char *role)
+{
+    static bool isHooked = false;
+    liveStatsPage() = NULL;
+    char name[64];
+    liveStatsName(getpid(), name, sizeof(name));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(name);
+        return false;
+    }
+    size_t size = sizeof(LiveStatsPage);
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(name);
+        return false;
+    }
+    // A new segment is zero filled, which is what the counters start at
+    LiveStatsPage *pPage = (LiveStatsPage*) p;
+    pPage->pid = getpid();
+    snprintf(pPage->role, sizeof(pPage->role), "%s", role);
+    pPage->startNanos = getMonotonicNanos();
+    pPage->version = LiveStatsVersion;
+    std::atomic_thread_fence(std::memory_order_release);
+    pPage->magic = LiveStatsMagic;
+    liveStatsPage() = pPage;
+    if (!isHooked) {
+        isHooked = true;
+        atexit(liveStatsAtExit);
+    }
+    // Installed after traceEnable(), whose handler then runs from ours
+    int sigs[2] = {SIGTERM, SIGINT};
+    for (int i = 0; i < 2; i++) {
+        struct sigaction action;
+        sigaction(sigs[i], NULL, &action);
+        if (action.sa_handler != liveStatsSignal) {
+            liveStatsPrevious(sigs[i]) = action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = liveStatsSignal;
+            sigaction(sigs[i], &action, NULL);
+        }
+    }
+    return true;
+}
+
+// Stops publishing and removes the segment, a reader that has it mapped
+// keeps its last values
+inline void liveStatsClose()
+{
+    LiveStatsPage *pPage = liveStatsPage();
+    if (!pPage || pPage->pid != getpid()) {
+        return;
+    }
+    liveStatsPage() = NULL;
+    char name[64];
+    liveStatsName(getpid(), name, sizeof(name));
+    shm_unlink(name);
+    munmap(pPage, sizeof(LiveStatsPage));
+}
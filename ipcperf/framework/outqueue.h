@@ -0,0 +1,330 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <sys/uio.h>
+#include "framework.h"
+#include "histogram.h"
+
+//
+// Output batching for the socket transports. Messages are appended to a
+// per socket queue and written with one call when the loop is about to
+// wait for events, or earlier once a queue holds maxBytes or its oldest
+// message is maxDelayNanos old. A stream socket queue is one contiguous
+// buffer, so a flush is a single send(). A datagram queue keeps every
+// message and its destination and goes out with one sendmmsg() on Linux.
+// With maxBytes 0 every message is sent right away, as without the layer.
+//
+// A loop that sets a WritableWatcher never blocks on a full stream socket.
+// What the socket does not take is kept in the queue's backlog, later
+// sends go behind it, and the watcher is asked to wait for writability;
+// the loop then calls drain() until the backlog is gone. Without a watcher
+// a full socket is left to sendAll().
+//
+
+// Counters of the sends since the last reset
+struct OutputStats {
+    uint64_t numMessages;
+    uint64_t numSyscalls;
+    // Time each message spent queued before its flush
+    LatencyHistogram queueDelay;
+    // Times a stream socket filled up and got a backlog
+    uint64_t numBlocked;
+    // Bytes in the backlogs now and at most since the reset
+    uint64_t backlogBytes;
+    uint64_t peakBacklogBytes;
+
+    OutputStats() : backlogBytes(0) {
+        reset();
+    }
+
+    // Backlogs outlive a phase, the peak starts from what is left
+    void reset() {
+        numMessages = numSyscalls = numBlocked = 0;
+        peakBacklogBytes = backlogBytes;
+        queueDelay.reset();
+    }
+
+    double syscallsPerMessage() {
+        return numMessages ? numSyscalls / (double) numMessages : 0;
+    }
+};
+
+// Implemented by a loop that waits for writability of full sockets
+class WritableWatcher {
+public:
+    virtual void watchWritable(int fd, bool isWatching) = 0;
+
+    virtual ~WritableWatcher() {
+    }
+};
+
+class OutputBatcher {
+public:
+    struct Queued {
+        int offset;
+        int len;
+        uint64_t enqueueNanos;
+        sockaddr_storage dest;
+        socklen_t destLen;
+    };
+
+    struct Queue {
+        int fd;
+        bool isDatagram;
+        std::vector<char> buffer;
+        std::vector<Queued> messages;
+        bool isPending;
+        // Stream bytes the socket did not take yet, from backlogSent on
+        std::vector<char> backlog;
+        size_t backlogSent;
+    };
+
+    OutputStats stats;
+    int maxBytes;
+    uint64_t maxDelayNanos;
+
+    OutputBatcher() : maxBytes(0), maxDelayNanos(0), pWatcher(NULL) {
+    }
+
+    ~OutputBatcher() {
+        for (size_t i = 0; i < queues.size(); i++) {
+            delete queues[i];
+        }
+    }
+
+    void setPolicy(int maxBytes, uint64_t maxDelayNanos) {
+        this->maxBytes = maxBytes;
+        this->maxDelayNanos = maxDelayNanos;
+    }
+
+    bool isBatching() {
+        return maxBytes > 0;
+    }
+
+    void setWatcher(WritableWatcher *pWatcher) {
+        this->pWatcher = pWatcher;
+    }
+
+    //
+    // Queues or sends a message. dest is the datagram destination, NULL on
+    // a connected stream socket. canWait is passed on to sendAll() when
+    // there is no watcher.
+    // Returns false when the peer is gone.
+    //
+    bool send(int fd, const char *data, int len, const sockaddr *dest,
+            socklen_t destLen, bool canWait) {
+        stats.numMessages++;
+        if (!isBatching()) {
+            stats.queueDelay.record(0);
+            if (dest) {
+                stats.numSyscalls++;
+                if (::sendto(fd, data, len, 0, dest, destLen) == -1) {
+                    perror("sendto");
+                    return false;
+                }
+                return true;
+            }
+            return writeStream(fd, data, len, canWait);
+        }
+        Queue *q = queueOf(fd, dest != NULL);
+        Queued m;
+        m.offset = (int) q->buffer.size();
+        m.len = len;
+        m.enqueueNanos = getMonotonicNanos();
+        m.destLen = dest ? destLen : 0;
+        if (dest) {
+            memcpy(&m.dest, dest, destLen);
+        }
+        q->buffer.insert(q->buffer.end(), data, data + len);
+        q->messages.push_back(m);
+        if (!q->isPending) {
+            q->isPending = true;
+            pending.push_back(q);
+        }
+        if ((int) q->buffer.size() >= maxBytes
+                || m.enqueueNanos - q->messages[0].enqueueNanos >= maxDelayNanos) {
+            return flush(q, canWait);
+        }
+        return true;
+    }
+
+    // Writes every queue with messages, called before the loop waits
+    void flushAll(bool canWait) {
+        for (size_t i = 0; i < pending.size(); i++) {
+            flush(pending[i], canWait);
+            pending[i]->isPending = false;
+        }
+        pending.clear();
+    }
+
+    //
+    // Writes what the backlog of a writable socket lets through and stops
+    // the watch once it is empty. Returns false when the peer is gone.
+    //
+    bool drain(int fd) {
+        Queue *q = fd < (int) queues.size() ? queues[fd] : NULL;
+        if (!q || q->backlog.empty()) {
+            return true;
+        }
+        int n = sendSome(fd, &q->backlog[q->backlogSent],
+                (int) (q->backlog.size() - q->backlogSent));
+        if (n < 0) {
+            return false;
+        }
+        q->backlogSent += n;
+        stats.backlogBytes -= n;
+        if (q->backlogSent == q->backlog.size()) {
+            q->backlog.clear();
+            q->backlogSent = 0;
+            pWatcher->watchWritable(fd, false);
+        } else if (q->backlogSent > q->backlog.size() / 2) {
+            // A consumer that never catches up would grow it forever
+            q->backlog.erase(q->backlog.begin(),
+                    q->backlog.begin() + q->backlogSent);
+            q->backlogSent = 0;
+        }
+        return true;
+    }
+
+    // Drops what is queued for a socket that is being closed
+    void forget(int fd) {
+        if (fd < (int) queues.size() && queues[fd]) {
+            Queue *q = queues[fd];
+            q->buffer.clear();
+            q->messages.clear();
+            stats.backlogBytes -= q->backlog.size() - q->backlogSent;
+            q->backlog.clear();
+            q->backlogSent = 0;
+        }
+    }
+
+private:
+    // Indexed by fd
+    std::vector<Queue*> queues;
+    std::vector<Queue*> pending;
+    WritableWatcher *pWatcher;
+
+    Queue *queueOf(int fd, bool isDatagram) {
+        if (fd >= (int) queues.size()) {
+            queues.resize(fd + 1, NULL);
+        }
+        if (!queues[fd]) {
+            queues[fd] = new Queue();
+            queues[fd]->fd = fd;
+            queues[fd]->isPending = false;
+            queues[fd]->backlogSent = 0;
+        }
+        queues[fd]->isDatagram = isDatagram;
+        return queues[fd];
+    }
+
+    bool flush(Queue *q, bool canWait) {
+        if (q->messages.empty()) {
+            return true;
+        }
+        uint64_t now = getMonotonicNanos();
+        for (size_t i = 0; i < q->messages.size(); i++) {
+            stats.queueDelay.record(now - q->messages[i].enqueueNanos);
+        }
+        bool ok = q->isDatagram ? flushDatagrams(q)
+                : writeStream(q->fd, &q->buffer[0], (int) q->buffer.size(),
+                        canWait);
+        q->buffer.clear();
+        q->messages.clear();
+        return ok;
+    }
+
+    // Sends until done or the socket is full, returns the bytes sent or -1
+    // when the peer is gone
+    int sendSome(int fd, const char *data, int len) {
+        int sent = 0;
+        while (sent < len) {
+            stats.numSyscalls++;
+            ssize_t n = ::send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                sent += n;
+            } else if (n == -1 && errno == EINTR) {
+                continue;
+            } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                perror("send");
+                return -1;
+            }
+        }
+        return sent;
+    }
+
+    // Writes stream bytes behind the backlog of the socket, what does not
+    // fit starts or extends the backlog
+    bool writeStream(int fd, const char *data, int len, bool canWait) {
+        if (!pWatcher) {
+            return sendAll(fd, data, len, canWait, &stats.numSyscalls);
+        }
+        Queue *q = queueOf(fd, false);
+        if (q->backlog.empty()) {
+            int n = sendSome(fd, data, len);
+            if (n < 0) {
+                return false;
+            }
+            if (n == len) {
+                return true;
+            }
+            data += n;
+            len -= n;
+            stats.numBlocked++;
+            pWatcher->watchWritable(fd, true);
+        }
+        q->backlog.insert(q->backlog.end(), data, data + len);
+        stats.backlogBytes += len;
+        if (stats.backlogBytes > stats.peakBacklogBytes) {
+            stats.peakBacklogBytes = stats.backlogBytes;
+        }
+        return true;
+    }
+
+    bool flushDatagrams(Queue *q) {
+        size_t n = q->messages.size();
+#ifdef __linux__
+        std::vector<mmsghdr> headers(n);
+        std::vector<iovec> iovs(n);
+        for (size_t i = 0; i < n; i++) {
+            Queued &m = q->messages[i];
+            iovs[i].iov_base = &q->buffer[m.offset];
+            iovs[i].iov_len = m.len;
+            memset(&headers[i], 0, sizeof(mmsghdr));
+            headers[i].msg_hdr.msg_name = &m.dest;
+            headers[i].msg_hdr.msg_namelen = m.destLen;
+            headers[i].msg_hdr.msg_iov = &iovs[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+        size_t sent = 0;
+        while (sent < n) {
+            stats.numSyscalls++;
+            int r = sendmmsg(q->fd, &headers[sent], n - sent, 0);
+            if (r == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // A full socket buffer drops the rest, as sendto() would
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("sendmmsg");
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            sent += r;
+        }
+#else
+        for (size_t i = 0; i < n; i++) {
+            Queued &m = q->messages[i];
+            stats.numSyscalls++;
+            if (::sendto(q->fd, &q->buffer[m.offset], m.len, 0,
+                    (sockaddr*) &m.dest, m.destLen) == -1) {
+                perror("sendto");
+                return false;
+            }
+        }
+#endif
+        return true;
+    }
+};
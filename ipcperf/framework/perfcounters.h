@@ -0,0 +1,154 @@
+#pragma once
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include "framework.h"
+
+//
+// Hardware and software event counts of one process, read through
+// perf_event_open() around a measured region. Every counter is opened on
+// its own, so a VM without a PMU still gets the software counters. A
+// counter that cannot be opened reads as -1. When the PMU is shared the
+// kernel multiplexes the hardware counters and the counts are scaled up
+// to the whole region.
+//
+enum PerfCounter {
+    PerfCycles,
+    PerfInstructions,
+    PerfCacheMisses,
+    PerfBranchMisses,
+    PerfContextSwitches,
+    PerfMigrations,
+    NumPerfCounters
+};
+
+inline const char *perfCounterName(int counter)
+{
+    static const char *names[NumPerfCounters] = {"cycles", "instructions",
+            "cache misses", "branch misses", "context switches", "migrations"};
+    return names[counter];
+}
+
+// Counts of a region, -1 for a counter that is not available
+struct PerfCounts {
+    double values[NumPerfCounters];
+
+    void clear() {
+        for (int i = 0; i < NumPerfCounters; i++) {
+            values[i] = -1;
+        }
+    }
+
+    // Per message counts, unavailable counters stay -1
+    PerfCounts perMessage(uint64_t numMessages) const {
+        PerfCounts counts;
+        for (int i = 0; i < NumPerfCounters; i++) {
+            counts.values[i] = values[i] < 0 || !numMessages ? values[i]
+                    : values[i] / numMessages;
+        }
+        return counts;
+    }
+};
+
+class PerfCounters {
+public:
+    PerfCounters() {
+        for (int i = 0; i < NumPerfCounters; i++) {
+            fds[i] = -1;
+        }
+    }
+
+    ~PerfCounters() {
+        close();
+    }
+
+    // Counts pid, 0 for this process. Returns false when no counter opens.
+    bool open(pid_t pid) {
+        close();
+        bool isOpen = false;
+#ifdef __linux__
+        static const uint32_t types[NumPerfCounters] = {PERF_TYPE_HARDWARE,
+                PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                PERF_TYPE_SOFTWARE, PERF_TYPE_SOFTWARE};
+        static const uint64_t configs[NumPerfCounters] = {
+                PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+                PERF_COUNT_SW_CONTEXT_SWITCHES, PERF_COUNT_SW_CPU_MIGRATIONS};
+        for (int i = 0; i < NumPerfCounters; i++) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                    | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // User and kernel time alike, the kernel side is most of IPC.
+            // A perf_event_paranoid of 2 only allows user space, retry so.
+            fds[i] = (int) syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+            if (fds[i] == -1 && errno == EACCES) {
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                fds[i] = (int) syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+            }
+            isOpen = isOpen || fds[i] != -1;
+        }
+#endif
+        return isOpen;
+    }
+
+    void close() {
+        for (int i = 0; i < NumPerfCounters; i++) {
+            if (fds[i] != -1) {
+                ::close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+    }
+
+    void start() {
+#ifdef __linux__
+        for (int i = 0; i < NumPerfCounters; i++) {
+            if (fds[i] != -1) {
+                ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // Stops counting and returns the counts since start()
+    PerfCounts stop() {
+        PerfCounts counts;
+        counts.clear();
+#ifdef __linux__
+        for (int i = 0; i < NumPerfCounters; i++) {
+            if (fds[i] == -1) {
+                continue;
+            }
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            // value, time enabled, time running
+            uint64_t data[3];
+            if (read(fds[i], data, sizeof(data)) != sizeof(data)) {
+                continue;
+            }
+            if (data[2]) {
+                counts.values[i] = (double) data[0] * data[1] / data[2];
+            } else if (data[1] == 0) {
+                counts.values[i] = 0;
+            }
+        }
+#endif
+        return counts;
+    }
+
+private:
+    int fds[NumPerfCounters];
+};
@@ -0,0 +1,304 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+#include "framework.h"
+#include "framing.h"
+
+//
+// Request/response calls over any EventMain. A call is a frame (see
+// framing.h) of type FrameRpcRequest whose payload starts with an
+// RpcHeader: a 64 bit call id chosen by the client, the method and a
+// status, followed by the request body. The server answers with a
+// FrameRpcResponse carrying the same call id, so a client can have many
+// calls outstanding on one connection and they may complete in any order.
+//
+// RpcServer dispatches requests to the RpcMethod registered for their
+// method. A method replies through the RpcCall it was given, right away or
+// later from a timer or another event of the loop; a method that is slow
+// should do the latter, since the loop serves nothing else while one runs.
+// RpcClient sends calls and hands each response to the RpcCallback given
+// with its call.
+//
+// Bodies are raw bytes. RpcTypedMethod and the typed call() and reply()
+// carry trivially copyable structs as they are, both ends are on one host.
+//
+
+enum RpcFrameType {
+    FrameRpcRequest = 16,
+    FrameRpcResponse = 17
+};
+
+enum RpcStatus {
+    RpcOk = 0,
+    // No method is registered under the number
+    RpcNoMethod = 1,
+    // Body of the wrong size for a typed method
+    RpcBadRequest = 2,
+    // Given by the client to a call still outstanding RpcMaxCallSlots calls
+    // later, its response is dropped if it comes
+    RpcAbandoned = 3,
+    // Statuses from here on are for the methods to use
+    RpcUserStatus = 16
+};
+
+struct RpcHeader {
+    uint64_t callId;
+    uint32_t method;
+    int32_t status;
+};
+
+const int RpcHeaderSize = sizeof(RpcHeader);
+
+// Most calls a client tracks, the bound of its call table
+const size_t RpcMaxCallSlots = 1 << 16;
+
+class RpcServer;
+
+// A request being served, copied by a method that replies later
+struct RpcCall {
+    RpcServer *pServer;
+    Context *pContext;
+    uint64_t callId;
+    uint32_t method;
+
+    inline void reply(const char *body, uint32_t len, int status = RpcOk);
+
+    // Not for pointers, reply(body, len) would lose to it
+    template <class Response, class = typename std::enable_if<
+            !std::is_pointer<Response>::value>::type>
+    void reply(const Response &response, int status = RpcOk) {
+        static_assert(std::is_trivially_copyable<Response>::value,
+                "RPC bodies are sent as they are in memory");
+        reply((const char*) &response, sizeof(response), status);
+    }
+};
+
+class RpcMethod {
+public:
+    // body is valid until the call returns, like the data of process()
+    virtual void handle(RpcCall &call, const char *body, uint32_t len) = 0;
+
+    virtual ~RpcMethod() {
+    }
+};
+
+template <class Request>
+class RpcTypedMethod: public RpcMethod {
+public:
+    static_assert(std::is_trivially_copyable<Request>::value,
+            "RPC bodies are sent as they are in memory");
+
+    virtual void handle(RpcCall &call, const Request &request) = 0;
+
+    void handle(RpcCall &call, const char *body, uint32_t len) {
+        if (len != sizeof(Request)) {
+            call.reply(NULL, 0, RpcBadRequest);
+            return;
+        }
+        // The body may lie unaligned behind the headers
+        Request request;
+        memcpy(&request, body, sizeof(request));
+        handle(call, request);
+    }
+};
+
+class RpcServer: public FrameHandler {
+public:
+    RpcServer() {
+        description = "rpc server";
+    }
+
+    // The server does not own the method
+    void registerMethod(uint32_t method, RpcMethod *pMethod) {
+        if (method >= methods.size()) {
+            methods.resize(method + 1, NULL);
+        }
+        methods[method] = pMethod;
+    }
+
+    virtual void processFrame(const FrameHeader &header, char *frame) {
+        if (header.type != FrameRpcRequest || header.length < RpcHeaderSize) {
+            invalidFrame(header);
+        }
+        RpcHeader rpc;
+        memcpy(&rpc, frame + FrameHeaderSize, RpcHeaderSize);
+        RpcCall call = {this, getContext(), rpc.callId, rpc.method};
+        RpcMethod *pMethod = rpc.method < methods.size() ? methods[rpc.method]
+                : NULL;
+        if (!pMethod) {
+            call.reply(NULL, 0, RpcNoMethod);
+            return;
+        }
+        pMethod->handle(call, frame + FrameHeaderSize + RpcHeaderSize,
+                header.length - RpcHeaderSize);
+    }
+
+    void sendReply(const RpcCall &call, const char *body, uint32_t len,
+            int status) {
+        // A deferred reply goes out while another connection may be the
+        // current one
+        Context *pSaved = getContext();
+        setContext(call.pContext);
+        sendRpcFrame(this, FrameRpcResponse, call.callId, call.method, status,
+                body, len);
+        setContext(pSaved);
+    }
+
+    // One leased buffer for header, RPC header and body
+    static void sendRpcFrame(EventHandler *pHandler, uint16_t type,
+            uint64_t callId, uint32_t method, int status, const char *body,
+            uint32_t len) {
+        FrameHeader header = {type, 0, (uint32_t) (RpcHeaderSize + len),
+                (uint32_t) callId};
+        RpcHeader rpc = {callId, method, status};
+        int total = FrameHeaderSize + RpcHeaderSize + len;
+        char *buf = pHandler->acquireSend(total);
+        memcpy(buf, &header, FrameHeaderSize);
+        memcpy(buf + FrameHeaderSize, &rpc, RpcHeaderSize);
+        if (len) {
+            memcpy(buf + FrameHeaderSize + RpcHeaderSize, body, len);
+        }
+        pHandler->commitSend(buf, total, true);
+    }
+
+private:
+    std::vector<RpcMethod*> methods;
+};
+
+inline void RpcCall::reply(const char *body, uint32_t len, int status)
+{
+    pServer->sendReply(*this, body, len, status);
+}
+
+// Receives the response of a call, body is valid until it returns
+class RpcCallback {
+public:
+    virtual void onResponse(uint64_t callId, int status, const char *body,
+            uint32_t len) = 0;
+
+    virtual ~RpcCallback() {
+    }
+};
+
+//
+// Calling end of one connection. connected() is called once the transport
+// has connected it, calls can be made from then on. A call that has no
+// response by the time RpcMaxCallSlots more calls were made is abandoned,
+// its callback gets RpcAbandoned, so one stuck call cannot make the call
+// table grow with every call after it.
+//
+class RpcClient: public FrameHandler {
+public:
+    RpcClient() : nextCallId(1), numPending(0) {
+        description = "rpc client";
+        slots.resize(64);
+    }
+
+    virtual void connected() {
+    }
+
+    void enable() {
+        connected();
+    }
+
+    // Returns the call id, pCallback gets the response
+    uint64_t call(uint32_t method, const char *body, uint32_t len,
+            RpcCallback *pCallback) {
+        uint64_t callId = nextCallId++;
+        Slot *pSlot = &slots[callId & (slots.size() - 1)];
+        if (pSlot->callId) {
+            grow(callId);
+            pSlot = &slots[callId & (slots.size() - 1)];
+        }
+        if (pSlot->callId) {
+            abandon(pSlot);
+            // The callback may have made calls and grown the table
+            pSlot = &slots[callId & (slots.size() - 1)];
+        }
+        pSlot->callId = callId;
+        pSlot->pCallback = pCallback;
+        numPending++;
+        RpcServer::sendRpcFrame(this, FrameRpcRequest, callId, method, RpcOk,
+                body, len);
+        return callId;
+    }
+
+    template <class Request>
+    uint64_t call(uint32_t method, const Request &request,
+            RpcCallback *pCallback) {
+        static_assert(std::is_trivially_copyable<Request>::value,
+                "RPC bodies are sent as they are in memory");
+        return call(method, (const char*) &request, sizeof(request), pCallback);
+    }
+
+    int numOutstanding() {
+        return numPending;
+    }
+
+    virtual void processFrame(const FrameHeader &header, char *frame) {
+        if (header.type != FrameRpcResponse || header.length < RpcHeaderSize) {
+            invalidFrame(header);
+        }
+        RpcHeader rpc;
+        memcpy(&rpc, frame + FrameHeaderSize, RpcHeaderSize);
+        Slot &slot = slots[rpc.callId & (slots.size() - 1)];
+        if (!rpc.callId || slot.callId != rpc.callId) {
+            // Late response to an abandoned call
+            if (rpc.callId && rpc.callId < nextCallId) {
+                return;
+            }
+            ERROR_OUT("Response to call %llu, which was never made\n",
+                    (unsigned long long) rpc.callId);
+            exit(1);
+        }
+        RpcCallback *pCallback = slot.pCallback;
+        slot.callId = 0;
+        numPending--;
+        pCallback->onResponse(rpc.callId, rpc.status,
+                frame + FrameHeaderSize + RpcHeaderSize,
+                header.length - RpcHeaderSize);
+    }
+
+private:
+    // Outstanding calls by call id modulo the table size, a power of two.
+    // Ids are handed out in order, so the table only grows when a call is
+    // still outstanding a whole table size of calls later, and stops at
+    // RpcMaxCallSlots.
+    struct Slot {
+        // 0 for a free slot
+        uint64_t callId;
+        RpcCallback *pCallback;
+    };
+
+    uint64_t nextCallId;
+    int numPending;
+    std::vector<Slot> slots;
+
+    // Doubles the table until callId has a slot of its own or the table
+    // has RpcMaxCallSlots. Ids apart in one table stay apart in the double
+    // one, so the outstanding calls always have their own slots.
+    void grow(uint64_t callId) {
+        size_t size = slots.size();
+        while (size < RpcMaxCallSlots && slots[callId & (size - 1)].callId) {
+            size *= 2;
+            std::vector<Slot> old;
+            old.swap(slots);
+            slots.assign(size, Slot());
+            for (size_t i = 0; i < old.size(); i++) {
+                if (old[i].callId) {
+                    slots[old[i].callId & (size - 1)] = old[i];
+                }
+            }
+        }
+    }
+
+    void abandon(Slot *pSlot) {
+        uint64_t callId = pSlot->callId;
+        RpcCallback *pCallback = pSlot->pCallback;
+        pSlot->callId = 0;
+        numPending--;
+        pCallback->onResponse(callId, RpcAbandoned, NULL, 0);
+    }
+};
@@ -0,0 +1,132 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include "framework.h"
+
+// Bytes of payload space in each direction of the shared memory transports.
+// A message of up to half the capacity always fits an empty ring.
+const uint64_t RingCapacity = 4 * MaxMessageSize;
+
+//
+// Single producer, single consumer ring of variable sized messages. It is
+// placed in memory visible to both ends (SysV shared memory, an mmap'd file
+// or the heap) so a transport can keep several messages in flight in each
+// direction. A record is a length word followed by the payload, padded to 8
+// bytes. A record that does not fit before the end of the buffer is
+// preceded by a wrap marker and starts again at offset 0, so every payload
+// is contiguous and can be handed to the handler in place.
+//
+// head and tail are free running byte positions; the producer owns head and
+// the consumer owns tail, each on its own cache line.
+//
+class MessageRing {
+public:
+    static const uint32_t WrapMarker = 0xFFFFFFFF;
+    static const uint64_t HeaderSize = 8;
+
+    // Bytes needed for a ring with the given capacity (a power of two)
+    static size_t totalSize(uint64_t capacity) {
+        return sizeof(MessageRing) + capacity;
+    }
+
+    void init(uint64_t capacity) {
+        this->capacity = capacity;
+        head.store(0, std::memory_order_relaxed);
+        reservePos = 0;
+        tail.store(0, std::memory_order_relaxed);
+        peekPos = 0;
+        peekSize = 0;
+        held = false;
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    // Producer: returns space for a len byte payload, or NULL when the
+    // consumer has not freed enough room yet.
+    char *reserve(uint32_t len) {
+        uint64_t recordSize = recordSizeOf(len);
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        uint64_t offset = pos & (capacity - 1);
+        uint64_t pad = (offset + recordSize > capacity) ? capacity - offset : 0;
+        uint64_t used = pos - tail.load(std::memory_order_acquire);
+        if (used + pad + recordSize > capacity) {
+            return NULL;
+        }
+        if (pad) {
+            *(uint32_t*) (data() + offset) = WrapMarker;
+            pos += pad;
+            offset = 0;
+        }
+        reservePos = pos;
+        return data() + offset + HeaderSize;
+    }
+
+    // Producer: publishes the reserved record with its final length, which
+    // may be smaller than the reserved one.
+    void commit(uint32_t len) {
+        uint64_t offset = reservePos & (capacity - 1);
+        *(uint32_t*) (data() + offset) = len;
+        head.store(reservePos + recordSizeOf(len), std::memory_order_release);
+    }
+
+    // Consumer: the oldest message, left in the ring until release()
+    bool peek(char **msg, uint32_t *len) {
+        uint64_t pos = tail.load(std::memory_order_relaxed);
+        if (pos == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        uint64_t offset = pos & (capacity - 1);
+        uint32_t size = *(uint32_t*) (data() + offset);
+        if (size == WrapMarker) {
+            pos += capacity - offset;
+            offset = 0;
+            size = *(uint32_t*) data();
+        }
+        peekPos = pos;
+        peekSize = size;
+        *msg = data() + offset + HeaderSize;
+        *len = size;
+        return true;
+    }
+
+    // Consumer: frees the message returned by the last peek()
+    void release() {
+        held = false;
+        tail.store(peekPos + recordSizeOf(peekSize), std::memory_order_release);
+    }
+
+    // Consumer: marks the message of the last peek() as still in use by
+    // the handler, so the transport leaves the release to it
+    void hold() {
+        held = true;
+    }
+
+    bool isHeld() {
+        return held;
+    }
+
+    bool empty() {
+        return tail.load(std::memory_order_relaxed)
+                == head.load(std::memory_order_acquire);
+    }
+
+private:
+    static uint64_t recordSizeOf(uint32_t len) {
+        return (HeaderSize + len + 7) & ~7ULL;
+    }
+
+    char *data() {
+        return (char*) (this + 1);
+    }
+
+    // Read only after init
+    alignas(64) uint64_t capacity;
+    // Producer side
+    alignas(64) std::atomic<uint64_t> head;
+    uint64_t reservePos;
+    // Consumer side
+    alignas(64) std::atomic<uint64_t> tail;
+    uint64_t peekPos;
+    uint32_t peekSize;
+    bool held;
+} __attribute__((aligned(64)));
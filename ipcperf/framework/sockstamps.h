@@ -0,0 +1,251 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
+#include "framework.h"
+#include "histogram.h"
+#include "conntable.h"
+
+//
+// Kernel software timestamps of the socket transports (SO_TIMESTAMPING),
+// which split a round trip at the kernel boundaries:
+//
+// - send: from the send call to the kernel handing the data to the device,
+//   read back from the socket error queue
+// - transit: on a client socket, from its last send leaving the kernel to
+//   the next data arriving in it, which is the way there, the peer and the
+//   way back
+// - wakeup: from the data arriving in the kernel to recvmsg() returning it
+//   to the loop
+// - handler: from recvmsg() returning to the handler's process() returning
+//
+// The kernel stamps with CLOCK_REALTIME, so the loop does too. Linux only,
+// elsewhere enabling it fails and the loops read as before.
+//
+
+const int NumStampParts = 4;
+
+// Histograms of the four parts, reset with the output stats every phase
+struct StampStats {
+    LatencyHistogram send;
+    LatencyHistogram transit;
+    LatencyHistogram wakeup;
+    LatencyHistogram handler;
+
+    static const char *partName(int i) {
+        static const char *names[NumStampParts] = {"send", "transit", "wakeup",
+                "handler"};
+        return names[i];
+    }
+
+    LatencyHistogram *part(int i) {
+        LatencyHistogram *parts[NumStampParts] = {&send, &transit, &wakeup,
+                &handler};
+        return parts[i];
+    }
+
+    void reset() {
+        send.reset();
+        transit.reset();
+        wakeup.reset();
+        handler.reset();
+    }
+};
+
+inline uint64_t getRealtimeNanos()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class SocketStamps {
+public:
+    StampStats stats;
+
+    SocketStamps() : isEnabled(false), recvNanos(0) {
+    }
+
+    bool enabled() {
+        return isEnabled;
+    }
+
+    // Stamps the sockets set up from now on. Returns false where the
+    // system has no SO_TIMESTAMPING.
+    bool setEnabled(bool isEnabled) {
+#ifdef __linux__
+        this->isEnabled = isEnabled;
+        return true;
+#else
+        return !isEnabled;
+#endif
+    }
+
+    // Turns stamping on for a new socket, isClient selects the sockets
+    // whose transit is measured
+    void addSocket(int fd, bool isClient) {
+        if (!isEnabled) {
+            return;
+        }
+#ifdef __linux__
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE
+                | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY
+                | SOF_TIMESTAMPING_OPT_ID;
+        if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                sizeof(flags)) == -1) {
+            perror("SO_TIMESTAMPING");
+            return;
+        }
+#endif
+        Socket *s = sockets.get(fd);
+        memset(s, 0, sizeof(*s));
+        s->isStamped = true;
+        s->isClient = isClient;
+    }
+
+    //
+    // recv()/recvfrom() with the receive stamp. Accounts transit and
+    // wakeup and starts the handler time, see handled(). Without stamping
+    // it is the plain call.
+    //
+    ssize_t recv(int fd, char *buf, size_t len, sockaddr *from = NULL,
+            socklen_t *pFromLen = NULL) {
+        Socket *s = isEnabled ? sockets.find(fd) : NULL;
+        if (!s || !s->isStamped) {
+            return from ? recvfrom(fd, buf, len, 0, from, pFromLen)
+                    : ::recv(fd, buf, len, 0);
+        }
+        // Stamps of sends that went out after the last drain, they would
+        // also make the socket look ready
+        readSendStamps(s, fd);
+        iovec iov = {buf, len};
+        char control[256];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = from;
+        msg.msg_namelen = pFromLen ? *pFromLen : 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(fd, &msg, 0);
+        if (n <= 0) {
+            return n;
+        }
+        recvNanos = getRealtimeNanos();
+        if (pFromLen) {
+            *pFromLen = msg.msg_namelen;
+        }
+        uint64_t stamp = readStamp(&msg);
+        if (stamp && stamp <= recvNanos) {
+            stats.wakeup.record(recvNanos - stamp);
+            if (s->isClient && s->lastSendStamp && s->lastSendStamp <= stamp) {
+                stats.transit.record(stamp - s->lastSendStamp);
+                s->lastSendStamp = 0;
+            }
+        }
+        return n;
+    }
+
+    // Called when the handler returns from the data recv() gave it
+    void handled() {
+        if (recvNanos) {
+            stats.handler.record(getRealtimeNanos() - recvNanos);
+            recvNanos = 0;
+        }
+    }
+
+    // Around every send of the loop. The first send since the last stamp
+    // was read starts the send time, so with output batching it includes
+    // the time queued.
+    void beforeSend(int fd) {
+        Socket *s = isEnabled ? sockets.find(fd) : NULL;
+        if (s && s->isStamped && !s->sendNanos) {
+            s->sendNanos = getRealtimeNanos();
+        }
+    }
+
+    void afterSend(int fd) {
+        Socket *s = isEnabled ? sockets.find(fd) : NULL;
+        if (s && s->isStamped) {
+            readSendStamps(s, fd);
+        }
+    }
+
+    //
+    // Reads the send stamps queued on a socket. The error queue also makes
+    // a socket report an error to epoll and select, returns true when that
+    // was all and the socket is fine.
+    //
+    bool drainErrors(int fd) {
+        Socket *s = isEnabled ? sockets.find(fd) : NULL;
+        if (!s || !s->isStamped) {
+            return false;
+        }
+        readSendStamps(s, fd);
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        return error == 0;
+    }
+
+private:
+    struct Socket {
+        bool isStamped;
+        bool isClient;
+        // Start of the first send not stamped yet
+        uint64_t sendNanos;
+        // Kernel stamp of the last send, until data comes back
+        uint64_t lastSendStamp;
+    };
+
+    bool isEnabled;
+    ConnTable<Socket> sockets;
+    // When the last stamped recv() returned, for handled()
+    uint64_t recvNanos;
+
+    void readSendStamps(Socket *s, int fd) {
+#ifdef __linux__
+        char control[256];
+        while (true) {
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+                break;
+            }
+            uint64_t stamp = readStamp(&msg);
+            if (!stamp) {
+                continue;
+            }
+            if (s->sendNanos && s->sendNanos <= stamp) {
+                stats.send.record(stamp - s->sendNanos);
+            }
+            s->sendNanos = 0;
+            s->lastSendStamp = stamp;
+        }
+#endif
+    }
+
+    // The software stamp of an SCM_TIMESTAMPING message, 0 when there is
+    // none
+    static uint64_t readStamp(msghdr *pMsg) {
+#ifdef __linux__
+        for (cmsghdr *c = CMSG_FIRSTHDR(pMsg); c; c = CMSG_NXTHDR(pMsg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+                scm_timestamping tss;
+                memcpy(&tss, CMSG_DATA(c), sizeof(tss));
+                return tss.ts[0].tv_sec * 1000000000ULL + tss.ts[0].tv_nsec;
+            }
+        }
+#endif
+        return 0;
+    }
+};
@@ -0,0 +1,242 @@
+#pragma once
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include "framework.h"
+#include "shmring.h"
+#include "timers.h"
+
+//
+// Compile time counterpart of EventMain/EventHandler for the ring loops of
+// the memcpy, shmem and mmap transports. The loop is instantiated with its
+// server and client handler templates, which in turn get the loop type as
+// their parameter, so dispatch to process() and the handler's send() are
+// direct calls the compiler can inline instead of going through the
+// virtual process(), send(), acquireSend() and commitSend(). Client and
+// server run in one process, the placement of the two rings is a policy:
+// HeapRings as memcpy, ShmRings as shmem and MmapRings as mmap.
+//
+// The loop body and the handler's send are kept in step with the virtual
+// ring loops: the same timer check, held ring check, trace events and live
+// counters every turn, so the two differ in dispatch alone. A change to
+// one belongs in the other.
+//
+
+const size_t StaticRingSize = MessageRing::totalSize(RingCapacity);
+
+struct HeapRings {
+    static const char *name() {
+        return "memcpy";
+    }
+
+    static char *map(size_t size) {
+        char *p = (char*) aligned_alloc(64, size);
+        dieif(!p, "aligned_alloc");
+        return p;
+    }
+
+    static void unmap(char *p, size_t size) {
+        free(p);
+    }
+};
+
+struct ShmRings {
+    static const char *name() {
+        return "shmem";
+    }
+
+    // A private segment, removed as soon as it is attached since no other
+    // process needs to find it
+    static char *map(size_t size) {
+        int id = shmget(IPC_PRIVATE, size, 0600 | IPC_CREAT);
+        dieif(id == -1, "shmget");
+        char *p = (char*) shmat(id, NULL, 0);
+        dieif(p == (char*) -1, "shmat");
+        shmctl(id, IPC_RMID, NULL);
+        return p;
+    }
+
+    static void unmap(char *p, size_t size) {
+        shmdt(p);
+    }
+};
+
+struct MmapRings {
+    static const char *name() {
+        return "mmap";
+    }
+
+    // A file of its own per run, removed at once: the mapping keeps its
+    // pages and runs side by side never share one
+    static char *map(size_t size) {
+        char path[] = "/tmp/mmapstaticXXXXXX";
+        int fd = mkstemp(path);
+        dieif(fd < 0, "mkstemp");
+        unlink(path);
+        dieif(ftruncate(fd, size) == -1, "ftruncate");
+        char *p = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+        dieif(p == (char*) MAP_FAILED, "mmap");
+        close(fd);
+        return p;
+    }
+
+    static void unmap(char *p, size_t size) {
+        munmap(p, size);
+    }
+};
+
+// Base of the static handlers, Main is the loop they run in
+template <class Main>
+class StaticHandler {
+protected:
+    Main *pMain;
+    // Rings the handler sends to and receives from
+    MessageRing *pSendRing;
+    MessageRing *pRecvRing;
+
+public:
+    StaticHandler() : pMain(NULL), pSendRing(NULL), pRecvRing(NULL) {
+    }
+
+    void setParent(Main *pMain, MessageRing *pSendRing,
+            MessageRing *pRecvRing) {
+        this->pMain = pMain;
+        this->pSendRing = pSendRing;
+        this->pRecvRing = pRecvRing;
+    }
+
+    Main *getParent() {
+        return pMain;
+    }
+
+    void enable() {
+    }
+
+    char *acquireSend(int len) {
+        char *buf = pSendRing->reserve(len);
+        if (!buf) {
+            ERROR_OUT("Message ring full, too many bytes in flight\n");
+            exit(1);
+        }
+        return buf;
+    }
+
+    void commitSend(char *buf, int len) {
+        TRACE_EVENT(TraceSend, len);
+        LIVE_STAT(liveSent(pLive, len));
+        pSendRing->commit(len);
+        TRACE_EVENT(TraceSendDone, 0);
+    }
+
+    void send(const char *data, int len) {
+        TRACE_EVENT(TraceSend, len);
+        LIVE_STAT(liveSent(pLive, len));
+        char *buf = acquireSend(len);
+        memcpy(buf, data, len);
+        pSendRing->commit(len);
+        TRACE_EVENT(TraceSendDone, 0);
+    }
+
+    // As EventHandler::holdReceive(), the ring delivers nothing more to the
+    // handler until releaseReceive()
+    bool holdReceive() {
+        pRecvRing->hold();
+        return true;
+    }
+
+    void releaseReceive() {
+        pRecvRing->release();
+    }
+};
+
+template <class Rings, template <class> class ServerT,
+        template <class> class ClientT>
+class StaticRingMain {
+public:
+    typedef ServerT<StaticRingMain> Server;
+    typedef ClientT<StaticRingMain> Client;
+
+protected:
+    MessageRing *toServer;
+    MessageRing *toClient;
+    Server *server;
+    Client *client;
+    bool loopEnd;
+    TimerQueue timers;
+
+public:
+    StaticRingMain() : toServer(NULL), toClient(NULL), server(NULL),
+            client(NULL), loopEnd(false) {
+    }
+
+    ~StaticRingMain() {
+        if (toServer) {
+            Rings::unmap((char*) toServer, 2 * StaticRingSize);
+        }
+    }
+
+    void initialize() {
+        loopEnd = false;
+        if (!toServer) {
+            char *p = Rings::map(2 * StaticRingSize);
+            toServer = (MessageRing*) p;
+            toClient = (MessageRing*) (p + StaticRingSize);
+        }
+        toServer->init(RingCapacity);
+        toClient->init(RingCapacity);
+    }
+
+    void bindServer(Server *pServer) {
+        server = pServer;
+        server->setParent(this, toClient, toServer);
+    }
+
+    void connectToServer(Client *pClient) {
+        client = pClient;
+        client->setParent(this, toServer, toClient);
+        client->enable();
+    }
+
+    // Returns whether there was a message
+    template <class Handler>
+    bool dispatch(MessageRing *ring, Handler *dest) {
+        char *data;
+        uint32_t len;
+        if (ring->isHeld() || !ring->peek(&data, &len)) {
+            return false;
+        }
+        TRACE_EVENT(TraceRecv, len);
+        dest->process(data, len);
+        if (!ring->isHeld()) {
+            ring->release();
+        }
+        return true;
+    }
+
+    void process() {
+        while (!loopEnd) {
+            timers.runDue();
+            int numDispatched = 0;
+            if (server) {
+                numDispatched += dispatch(toServer, server);
+            }
+            if (client) {
+                numDispatched += dispatch(toClient, client);
+            }
+            LIVE_STAT(liveLoop(pLive, numDispatched));
+        }
+    }
+
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(getMonotonicNanos() + delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
+    }
+
+    void cancelLoop() {
+        loopEnd = true;
+    }
+};
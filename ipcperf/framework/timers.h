@@ -0,0 +1,211 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+#include "framework.h"
+#include "histogram.h"
+
+//
+// Pending timers of one event loop, for the backends that have no timer
+// objects of their own. A binary heap ordered by deadline, then by order of
+// addition. Cancelling only marks the timer, its heap entry is dropped when
+// it comes to the top. Ids are reused, a generation count tells a stale
+// heap entry from the timer that now has its id.
+//
+class TimerQueue {
+public:
+    TimerQueue() : numAdded(0) {
+    }
+
+    // Returns the timer id
+    int add(uint64_t deadline, TimerHandler *pTimer) {
+        int id;
+        if (freeIds.empty()) {
+            id = (int) slots.size();
+            Slot slot = {NULL, 0};
+            slots.push_back(slot);
+        } else {
+            id = freeIds.back();
+            freeIds.pop_back();
+        }
+        slots[id].pTimer = pTimer;
+        Entry entry = {deadline, numAdded++, id, slots[id].generation};
+        heap.push_back(entry);
+        std::push_heap(heap.begin(), heap.end(), Later());
+        return id;
+    }
+
+    void cancel(int id) {
+        if (id >= 0 && id < (int) slots.size() && slots[id].pTimer) {
+            retire(id);
+        }
+    }
+
+    // Earliest deadline, UINT64_MAX when no timer is pending
+    uint64_t nextDeadline() {
+        dropCancelled();
+        return heap.empty() ? UINT64_MAX : heap[0].deadline;
+    }
+
+    // Nanoseconds until the earliest deadline, 0 when it is past and -1
+    // when no timer is pending, for loops that wait with a timeout
+    int64_t nanosToNext() {
+        uint64_t deadline = nextDeadline();
+        if (deadline == UINT64_MAX) {
+            return -1;
+        }
+        uint64_t now = getMonotonicNanos();
+        return deadline > now ? (int64_t) (deadline - now) : 0;
+    }
+
+    // For loops that spin: runs the timers that are due, and only reads
+    // the clock when one is pending
+    int runDue() {
+        if (nextDeadline() == UINT64_MAX) {
+            return 0;
+        }
+        return runExpired(getMonotonicNanos());
+    }
+
+    // Runs the timers due at now. A timer added by a callback waits for
+    // the next call even with a delay of 0. Returns how many ran.
+    int runExpired(uint64_t now) {
+        int numRun = 0;
+        while (nextDeadline() <= now) {
+            Entry entry = heap[0];
+            std::pop_heap(heap.begin(), heap.end(), Later());
+            heap.pop_back();
+            TimerHandler *pTimer = slots[entry.id].pTimer;
+            retire(entry.id);
+            pTimer->onTimer(entry.id);
+            numRun++;
+        }
+        return numRun;
+    }
+
+private:
+    struct Entry {
+        uint64_t deadline;
+        uint64_t order;
+        int id;
+        uint32_t generation;
+    };
+
+    struct Slot {
+        TimerHandler *pTimer;
+        uint32_t generation;
+    };
+
+    struct Later {
+        bool operator()(const Entry &a, const Entry &b) const {
+            return a.deadline != b.deadline ? a.deadline > b.deadline
+                    : a.order > b.order;
+        }
+    };
+
+    std::vector<Entry> heap;
+    std::vector<Slot> slots;
+    std::vector<int> freeIds;
+    uint64_t numAdded;
+
+    void retire(int id) {
+        slots[id].pTimer = NULL;
+        slots[id].generation++;
+        freeIds.push_back(id);
+    }
+
+    void dropCancelled() {
+        while (!heap.empty()
+                && heap[0].generation != slots[heap[0].id].generation) {
+            std::pop_heap(heap.begin(), heap.end(), Later());
+            heap.pop_back();
+        }
+    }
+};
+
+#ifdef __linux__
+//
+// A TimerQueue behind one timerfd for the epoll loops. The fd is armed to
+// the earliest deadline and is registered like a socket; run() is called
+// when it becomes readable and rearms it once for the whole batch.
+//
+class TimerFd {
+public:
+    TimerFd() : fd(-1), armedDeadline(UINT64_MAX), isRunning(false) {
+    }
+
+    ~TimerFd() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    int create() {
+        if (fd != -1) {
+            close(fd);
+        }
+        fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        dieif(fd == -1, "timerfd_create");
+        armedDeadline = UINT64_MAX;
+        return fd;
+    }
+
+    int getFd() {
+        return fd;
+    }
+
+    int add(uint64_t delayNanos, TimerHandler *pTimer) {
+        int id = timers.add(getMonotonicNanos() + delayNanos, pTimer);
+        if (!isRunning) {
+            arm();
+        }
+        return id;
+    }
+
+    // The timerfd stays armed, an early wakeup finds nothing due
+    void cancel(int id) {
+        timers.cancel(id);
+    }
+
+    void run() {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) == -1
+                && errno != EAGAIN) {
+            perror("read timerfd");
+        }
+        armedDeadline = UINT64_MAX;
+        isRunning = true;
+        timers.runExpired(getMonotonicNanos());
+        isRunning = false;
+        arm();
+    }
+
+private:
+    int fd;
+    TimerQueue timers;
+    uint64_t armedDeadline;
+    // Set while expired timers run, they are rearmed once afterwards
+    bool isRunning;
+
+    // An absolute time already past fires at once. A zero time would
+    // disarm the timerfd.
+    void arm() {
+        uint64_t deadline = timers.nextDeadline();
+        if (deadline == armedDeadline) {
+            return;
+        }
+        itimerspec spec = {{0, 0}, {0, 0}};
+        if (deadline != UINT64_MAX) {
+            uint64_t at = deadline ? deadline : 1;
+            spec.it_value.tv_sec = at / 1000000000;
+            spec.it_value.tv_nsec = at % 1000000000;
+        }
+        dieif(timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1,
+                "timerfd_settime");
+        armedDeadline = deadline;
+    }
+};
+#endif
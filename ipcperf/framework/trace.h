@@ -0,0 +1,375 @@
+#pragma once
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <vector>
+#include "cputime.h"
+#include "histogram.h"
+
+//
+// Per message event tracing for a look inside one round trip. Every thread
+// records into its own ring of TraceCapacity events, one cycle counter
+// read and a 16 byte store each, no lock and no system call. A full ring
+// overwrites its oldest events, so a trace holds the end of a run. The
+// loops record when they wake up and what they read, the framework when a
+// handler starts and finishes and around every send.
+//
+// Tracing is off until traceEnable(); TRACE_EVENT then costs a predictable
+// branch. traceDump() writes the rings of the process as Chrome trace JSON
+// (chrome://tracing, ui.perfetto.dev) to <path>-<pid>.json. A process
+// dumps when its run ends, on SIGTERM or SIGINT, and at exit. The dump
+// formats and writes with write() only, so the signal handler can run it
+// where stdio may hold a lock of the interrupted code. The events
+// are in CLOCK_MONOTONIC microseconds, so the traces of a client and its
+// server line up when loaded together.
+//
+
+enum TraceEventType {
+    // Loop returned from waiting, arg is the number of ready events
+    TraceWakeup = 1,
+    // Bytes read from a socket or message taken from a ring, arg is the size
+    TraceRecv,
+    // Handler called with data and returned from it, arg is the size
+    TraceDispatch,
+    TraceHandlerDone,
+    // Handler send entered and returned, arg is the size
+    TraceSend,
+    TraceSendDone
+};
+
+const int TraceCapacity = 1 << 16;
+
+struct TraceEvent {
+    uint64_t ticks;
+    uint32_t arg;
+    uint32_t type;
+};
+
+struct TraceRing {
+    uint64_t numRecorded;
+    int tid;
+    TraceEvent events[TraceCapacity];
+};
+
+struct TraceState {
+    bool isEnabled;
+    char path[256];
+    pthread_mutex_t lock;
+    std::vector<TraceRing*> rings;
+};
+
+inline TraceState &traceState()
+{
+    static TraceState state = {false, "", PTHREAD_MUTEX_INITIALIZER,
+            std::vector<TraceRing*>()};
+    return state;
+}
+
+inline TraceRing *&traceRingOfThread()
+{
+    static __thread TraceRing *pRing = NULL;
+    return pRing;
+}
+
+// Cycle counter where there is one, the monotonic clock elsewhere
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+inline uint64_t traceTicks()
+{
+    return readCycleCounter();
+}
+
+inline double traceTicksPerNano()
+{
+    return getCyclesPerNano();
+}
+#else
+inline uint64_t traceTicks()
+{
+    return getMonotonicNanos();
+}
+
+inline double traceTicksPerNano()
+{
+    return 1;
+}
+#endif
+
+inline int traceThreadId()
+{
+#ifdef __linux__
+    return (int) syscall(SYS_gettid);
+#else
+    return (int) getpid();
+#endif
+}
+
+// First event of a thread, registers its ring
+inline TraceRing *traceNewRing()
+{
+    TraceRing *pRing = (TraceRing*) calloc(1, sizeof(TraceRing));
+    if (!pRing) {
+        perror("calloc");
+        exit(1);
+    }
+    pRing->tid = traceThreadId();
+    TraceState &state = traceState();
+    pthread_mutex_lock(&state.lock);
+    state.rings.push_back(pRing);
+    pthread_mutex_unlock(&state.lock);
+    traceRingOfThread() = pRing;
+    return pRing;
+}
+
+inline void traceRecord(TraceEventType type, uint32_t arg)
+{
+    TraceRing *pRing = traceRingOfThread();
+    if (!pRing) {
+        pRing = traceNewRing();
+    }
+    TraceEvent &event = pRing->events[pRing->numRecorded & (TraceCapacity - 1)];
+    event.ticks = traceTicks();
+    event.arg = arg;
+    event.type = type;
+    pRing->numRecorded++;
+}
+
+// A statement of its own, safe in an unbraced if/else
+#define TRACE_EVENT(type, arg) do {\
+if (traceState().isEnabled) {\
+traceRecord((type), (uint32_t) (arg));\
+}\
+} while (0)
+
+inline void traceDump();
+
+inline void traceSignal(int sig)
+{
+    traceDump();
+    _exit(0);
+}
+
+inline void traceAtExit()
+{
+    traceDump();
+}
+
+// Starts tracing into <path>-<pid>.json. Events recorded before, like
+// those a forked child inherits, are dropped.
+inline void traceEnable(const char *path)
+{
+    TraceState &state = traceState();
+    static bool isHooked = false;
+    pthread_mutex_lock(&state.lock);
+    snprintf(state.path, sizeof(state.path), "%s", path);
+    for (size_t i = 0; i < state.rings.size(); i++) {
+        state.rings[i]->numRecorded = 0;
+    }
+    state.isEnabled = true;
+    pthread_mutex_unlock(&state.lock);
+    // Calibrated now, the dump may run in a signal handler
+    traceTicksPerNano();
+    // A thread that was forked keeps the ring but not its id
+    if (traceRingOfThread()) {
+        traceRingOfThread()->tid = traceThreadId();
+    }
+    if (!isHooked) {
+        isHooked = true;
+        atexit(traceAtExit);
+    }
+    signal(SIGTERM, traceSignal);
+    signal(SIGINT, traceSignal);
+}
+
+// Chrome trace phase and name of an event type
+inline void traceDescribe(uint32_t type, char *pPhase, const char **pName,
+        const char **pArgName)
+{
+    *pPhase = 'i';
+    *pArgName = "bytes";
+    switch (type) {
+    case TraceWakeup: *pName = "wakeup"; *pArgName = "events"; break;
+    case TraceRecv: *pName = "recv"; break;
+    case TraceDispatch: *pPhase = 'B'; *pName = "dispatch"; break;
+    case TraceHandlerDone: *pPhase = 'E'; *pName = "dispatch"; break;
+    case TraceSend: *pPhase = 'B'; *pName = "send"; break;
+    case TraceSendDone: *pPhase = 'E'; *pName = "send"; break;
+    default: *pName = "unknown";
+    }
+}
+
+// Output of traceDump(), buffered and written with write() alone
+class TraceWriter {
+public:
+    explicit TraceWriter(int fd) : fd(fd), len(0) {
+    }
+
+    ~TraceWriter() {
+        flush();
+    }
+
+    void put(const char *text) {
+        while (*text) {
+            put(*text++);
+        }
+    }
+
+    void put(char c) {
+        if (len == sizeof(buf)) {
+            flush();
+        }
+        buf[len++] = c;
+    }
+
+    void putNumber(uint64_t n) {
+        char digits[20];
+        int numDigits = 0;
+        do {
+            digits[numDigits++] = (char) ('0' + n % 10);
+            n /= 10;
+        } while (n);
+        while (numDigits) {
+            put(digits[--numDigits]);
+        }
+    }
+
+    // Nanoseconds as microseconds with three decimals
+    void putMicros(uint64_t nanos) {
+        putNumber(nanos / 1000);
+        put('.');
+        put((char) ('0' + nanos / 100 % 10));
+        put((char) ('0' + nanos / 10 % 10));
+        put((char) ('0' + nanos % 10));
+    }
+
+    void flush() {
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = write(fd, buf + done, len - done);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        len = 0;
+    }
+
+private:
+    int fd;
+    size_t len;
+    char buf[4096];
+};
+
+// Writes the rings of this process and stops tracing. Called once per
+// process, later calls find tracing off.
+inline void traceDump()
+{
+    TraceState &state = traceState();
+    if (!state.isEnabled) {
+        return;
+    }
+    state.isEnabled = false;
+    int pid = (int) getpid();
+    // <path>-<pid>.json
+    char fileName[sizeof(state.path) + 32];
+    size_t pathLen = strlen(state.path);
+    memcpy(fileName, state.path, pathLen);
+    char *p = fileName + pathLen;
+    *p++ = '-';
+    char digits[16];
+    int numDigits = 0;
+    for (int n = pid; numDigits == 0 || n; n /= 10) {
+        digits[numDigits++] = (char) ('0' + n % 10);
+    }
+    while (numDigits) {
+        *p++ = digits[--numDigits];
+    }
+    memcpy(p, ".json", sizeof(".json"));
+    int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        TraceWriter err(2);
+        err.put(fileName);
+        err.put(": cannot open the trace file\n");
+        return;
+    }
+    // Ticks to monotonic nanoseconds through one pair of readings
+    double ticksPerNano = traceTicksPerNano();
+    uint64_t baseTicks = traceTicks();
+    uint64_t baseNanos = getMonotonicNanos();
+    uint64_t numEvents = 0;
+    {
+        TraceWriter out(fd);
+        out.put("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n"
+                "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": ");
+        out.putNumber(pid);
+        out.put(", \"args\": {\"name\": \"ipcperf ");
+        out.putNumber(pid);
+        out.put("\"}}");
+        for (size_t r = 0; r < state.rings.size(); r++) {
+            TraceRing *pRing = state.rings[r];
+            uint64_t end = pRing->numRecorded;
+            uint64_t begin = end > (uint64_t) TraceCapacity
+                    ? end - TraceCapacity : 0;
+            // A ring that wrapped may start inside a dispatch or send, drop
+            // the ends whose begin was overwritten
+            int depth = 0;
+            for (uint64_t i = begin; i < end; i++) {
+                const TraceEvent &event = pRing->events[i & (TraceCapacity - 1)];
+                char phase;
+                const char *name;
+                const char *argName;
+                traceDescribe(event.type, &phase, &name, &argName);
+                if (phase == 'B') {
+                    depth++;
+                } else if (phase == 'E' && depth-- == 0) {
+                    depth = 0;
+                    continue;
+                }
+                uint64_t nanos = baseNanos
+                        - (uint64_t) ((baseTicks - event.ticks) / ticksPerNano);
+                out.put(",\n{\"name\": \"");
+                out.put(name);
+                out.put("\", \"ph\": \"");
+                out.put(phase);
+                out.put("\", \"ts\": ");
+                out.putMicros(nanos);
+                out.put(", \"pid\": ");
+                out.putNumber(pid);
+                out.put(", \"tid\": ");
+                out.putNumber(pRing->tid);
+                if (phase == 'i') {
+                    out.put(", \"s\": \"t\"");
+                }
+                if (phase != 'E') {
+                    out.put(", \"args\": {\"");
+                    out.put(argName);
+                    out.put("\": ");
+                    out.putNumber(event.arg);
+                    out.put('}');
+                }
+                out.put('}');
+                numEvents++;
+            }
+        }
+        out.put("\n]}\n");
+    }
+    close(fd);
+    TraceWriter err(2);
+    err.put("Trace of ");
+    err.putNumber(numEvents);
+    err.put(" events written to ");
+    err.put(fileName);
+    err.put("\n");
+}
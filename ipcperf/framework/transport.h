@@ -0,0 +1,53 @@
+#pragma once
+#include <string.h>
+#include <vector>
+#include "framework.h"
+
+//
+// Registry of the EventMain implementations linked into a binary, so one
+// driver can pick a transport by name at runtime. Each backend registers
+// itself with REGISTER_TRANSPORT next to its BUILDTEST global.
+//
+
+typedef EventMain *(*TransportFactory)();
+
+// The transport only works with client and server in one process
+const int TransportSameProcessOnly = 1;
+// The event loop implements addTimer()
+const int TransportTimers = 2;
+
+struct TransportInfo {
+    const char *name;
+    const char *description;
+    TransportFactory factory;
+    int flags;
+};
+
+inline std::vector<TransportInfo> &transportRegistry()
+{
+    static std::vector<TransportInfo> registry;
+    return registry;
+}
+
+inline const TransportInfo *findTransport(const char *name)
+{
+    std::vector<TransportInfo> &registry = transportRegistry();
+    for (size_t i = 0; i < registry.size(); i++) {
+        if (strcmp(registry[i].name, name) == 0) {
+            return &registry[i];
+        }
+    }
+    return NULL;
+}
+
+struct TransportRegistrar {
+    TransportRegistrar(const char *name, const char *description,
+            TransportFactory factory, int flags) {
+        TransportInfo info = {name, description, factory, flags};
+        transportRegistry().push_back(info);
+    }
+};
+
+#define REGISTER_TRANSPORT(name, cls, description, flags) \
+    static EventMain *create##cls() { return new cls(); } \
+    static TransportRegistrar registrar##cls(name, description, create##cls, flags);
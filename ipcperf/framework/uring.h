@@ -0,0 +1,270 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "framework.h"
+
+//
+// A minimal io_uring on the raw system calls, enough for the io_uring
+// loop: submission entries are filled in place and go to the kernel
+// together with the next wait, completions are read straight off the
+// mapped completion ring. Entries are taken with getSqe(), which submits
+// what is queued only when the submission ring is full. submitAndWait()
+// hands everything queued to the kernel and waits for a completion in the
+// same call. peekCqe() and seenCqe() walk the completions.
+//
+
+inline int ioUringSetup(unsigned entries, io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+inline int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+        unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+            flags, NULL, 0);
+}
+
+inline int ioUringRegister(int fd, unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+class IoUring {
+public:
+    IoUring() : fd(-1), sqRing(NULL), cqRing(NULL), sqes(NULL), sqRingSize(0),
+            cqRingSize(0), sqTail(0), submittedTail(0) {
+    }
+
+    ~IoUring() {
+        teardown();
+    }
+
+    // Dies when the kernel has no io_uring
+    void setup(unsigned entries, unsigned cqEntries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = cqEntries;
+        fd = ioUringSetup(entries, &params);
+        if (fd == -1 && errno == EINVAL) {
+            // Kernels before 5.19 have no cooperative task running
+            memset(&params, 0, sizeof(params));
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = cqEntries;
+            fd = ioUringSetup(entries, &params);
+        }
+        dieif(fd == -1, "io_uring_setup");
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            if (cqRingSize > sqRingSize) {
+                sqRingSize = cqRingSize;
+            }
+            cqRingSize = sqRingSize;
+        }
+        sqRing = mapRing(sqRingSize, IORING_OFF_SQ_RING);
+        cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? sqRing
+                : mapRing(cqRingSize, IORING_OFF_CQ_RING);
+        sqes = (io_uring_sqe*) mapRing(params.sq_entries * sizeof(io_uring_sqe),
+                IORING_OFF_SQES);
+        sqHead = (unsigned*) (sqRing + params.sq_off.head);
+        sqTailPtr = (unsigned*) (sqRing + params.sq_off.tail);
+        sqMask = *(unsigned*) (sqRing + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        cqHead = (unsigned*) (cqRing + params.cq_off.head);
+        cqTail = (unsigned*) (cqRing + params.cq_off.tail);
+        cqMask = *(unsigned*) (cqRing + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*) (cqRing + params.cq_off.cqes);
+        // Entry i always sits in slot i, the index array never changes
+        unsigned *array = (unsigned*) (sqRing + params.sq_off.array);
+        for (unsigned i = 0; i < sqEntries; i++) {
+            array[i] = i;
+        }
+        sqTail = submittedTail = *sqTailPtr;
+    }
+
+    void teardown() {
+        if (sqes) {
+            munmap(sqes, sqEntries * sizeof(io_uring_sqe));
+            sqes = NULL;
+        }
+        if (cqRing && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing) {
+            munmap(sqRing, sqRingSize);
+        }
+        sqRing = cqRing = NULL;
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    int getFd() {
+        return fd;
+    }
+
+    // A zeroed entry, queued until the next submit. A full submission ring
+    // is submitted until the kernel has taken an entry; an entry it has not
+    // consumed is never overwritten.
+    io_uring_sqe *getSqe() {
+        while (sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+            if (submit(0) == 0 && errno != EINTR) {
+                // The kernel refuses entries only while completions it
+                // could not post are pending, the loop reaps before it
+                // submits so that is a leak of completions
+                diep("io_uring full submission ring");
+            }
+        }
+        io_uring_sqe *sqe = &sqes[sqTail & sqMask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqTail++;
+        return sqe;
+    }
+
+    // Submits the queued entries and waits for minComplete completions.
+    // Returns how many entries the kernel took, 0 with errno set when it
+    // was interrupted or refused them for now (EAGAIN, EBUSY); what it did
+    // not take goes with the next submit.
+    unsigned submit(unsigned minComplete) {
+        __atomic_store_n(sqTailPtr, sqTail, __ATOMIC_RELEASE);
+        unsigned toSubmit = sqTail - submittedTail;
+        if (!toSubmit && !minComplete) {
+            return 0;
+        }
+        errno = 0;
+        int n = ioUringEnter(fd, toSubmit, minComplete,
+                minComplete ? IORING_ENTER_GETEVENTS : 0);
+        if (n == -1) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                diep("io_uring_enter");
+            }
+            return 0;
+        }
+        submittedTail += n;
+        return n;
+    }
+
+    void submitAndWait() {
+        submit(1);
+    }
+
+    // Next completion, NULL when there is none
+    io_uring_cqe *peekCqe() {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        return &cqes[head & cqMask];
+    }
+
+    // Hands the slot of the completion peekCqe() returned back
+    void seenCqe() {
+        __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+    }
+
+private:
+    int fd;
+    char *sqRing;
+    char *cqRing;
+    io_uring_sqe *sqes;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    unsigned *sqHead;
+    unsigned *sqTailPtr;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    io_uring_cqe *cqes;
+    // Entries filled so far and handed to the kernel so far
+    unsigned sqTail;
+    unsigned submittedTail;
+
+    char *mapRing(size_t size, off_t offset) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, offset);
+        dieif(p == MAP_FAILED, "mmap io_uring");
+        return (char*) p;
+    }
+};
+
+//
+// Receive buffers the kernel picks from (a provided buffer ring, Linux
+// 5.19). A receive with IOSQE_BUFFER_SELECT takes the next free buffer
+// when data arrives, so a connection waiting for data holds no buffer;
+// the completion names the buffer and put() returns it to the ring.
+//
+class BufferRing {
+public:
+    BufferRing() : ring(NULL), memory(NULL), numBuffers(0), tail(0) {
+    }
+
+    ~BufferRing() {
+        if (ring) {
+            munmap(ring, numBuffers * sizeof(io_uring_buf));
+        }
+        free(memory);
+    }
+
+    // numBuffers is a power of two
+    void setup(IoUring *pRing, uint16_t group, int numBuffers, int bufferSize) {
+        this->numBuffers = numBuffers;
+        this->bufferSize = bufferSize;
+        size_t ringSize = numBuffers * sizeof(io_uring_buf);
+        void *p = mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        dieif(p == MAP_FAILED, "mmap buffer ring");
+        ring = (io_uring_buf_ring*) p;
+        memory = allocBuffers((size_t) numBuffers * bufferSize);
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t) (uintptr_t) ring;
+        reg.ring_entries = numBuffers;
+        reg.bgid = group;
+        dieif(ioUringRegister(pRing->getFd(), IORING_REGISTER_PBUF_RING, &reg,
+                1) == -1, "register buffer ring");
+        for (int i = 0; i < numBuffers; i++) {
+            put(i);
+        }
+    }
+
+    char *buffer(int id) {
+        return memory + (size_t) id * bufferSize;
+    }
+
+    void put(int id) {
+        // Under C++ the header's flexible bufs array starts past the empty
+        // struct before it, the entries are indexed from the ring itself
+        io_uring_buf *buf = (io_uring_buf*) ring + (tail & (numBuffers - 1));
+        buf->addr = (uint64_t) (uintptr_t) buffer(id);
+        buf->len = bufferSize;
+        buf->bid = id;
+        tail++;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+private:
+    io_uring_buf_ring *ring;
+    char *memory;
+    int numBuffers;
+    int bufferSize;
+    uint16_t tail;
+
+    static char *allocBuffers(size_t size) {
+        void *p = NULL;
+        if (posix_memalign(&p, 4096, size) != 0) {
+            ERROR_OUT("Cannot allocate %lu receive buffer bytes\n",
+                    (unsigned long) size);
+            ::exit(1);
+        }
+        return (char*) p;
+    }
+};
@@ -0,0 +1,547 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include "framework.h"
+#include "transport.h"
+#include "outqueue.h"
+#include "conntable.h"
+#include "timers.h"
+#include "uring.h"
+
+//
+// Completion based peer of the epoll loop. Instead of waiting for a socket
+// to become readable and then reading it, every connection keeps a receive
+// posted on the ring, and the kernel completes it with the data already in
+// one of the ring's provided buffers. Sends are queued per connection while
+// the loop dispatches and go out as one send operation per connection; all
+// operations of a turn are submitted with the wait for the next
+// completions, in one io_uring_enter().
+//
+// A completion carries the operation, the fd and the generation of the
+// connection in its user data. A connection that closes bumps its
+// generation, so the completions of its operations that are still under
+// way are recognized and dropped even when a new connection got the fd.
+// Sockets stay blocking: io_uring tries them without blocking and arms a
+// poll of its own when they are not ready.
+//
+class IoUringMain: public EventMain {
+protected:
+
+    enum Op {
+        OpAccept = 1,
+        OpConnect = 2,
+        OpRecv = 3,
+        OpSend = 4,
+        OpTimer = 5
+    };
+
+    // Buffer group of the receive buffers. The kernel takes them round
+    // robin, a few keep the ones in use warm in the cache.
+    enum {RecvGroup = 0};
+    static const int NumRecvBuffers = 32;
+    static const unsigned RingEntries = 256;
+    static const unsigned CompletionEntries = 4096;
+
+    // Bytes of one connection waiting to be sent, or being sent
+    struct OutBuffer {
+        char *data;
+        int len;
+        int cap;
+    };
+
+    struct Connection {
+        EventHandler *pHandler;
+        uint32_t generation;
+        bool isConnecting;
+        // An operation of the fd is under way, of this or an earlier
+        // connection; a new one waits for its completion
+        bool isReceiving;
+        bool isSending;
+        bool isQueued;
+        // Receive buffer the handler holds plus 1, see holdReceive()
+        int heldBuffer;
+        sockaddr_storage *pConnectAddress;
+        OutBuffer pending;
+        OutBuffer inflight;
+        int inflightSent;
+        // Bytes of inflight the socket did not take, in the backlog figures
+        int backlog;
+    };
+
+    IoUring ring;
+    BufferRing recvBuffers;
+    int listener;
+    EventHandler *server;
+    bool loopEnd;
+    int acceptOptions;
+    // Multishot receives need Linux 6.0, single ones are posted otherwise
+    bool isMultishot;
+    ConnTable<Connection> connections;
+    // Connections with pending bytes and no send under way
+    std::vector<int> toSend;
+    // Buffer of the data process() is running on
+    int currentBuffer;
+    // Buffers the handlers hold, at most half of them, so receives go on
+    int numHeld;
+    OutputStats stats;
+    TimerFd timers;
+
+    static uint64_t userData(Op op, int fd, uint32_t generation) {
+        return ((uint64_t) op << 56) | ((uint64_t) (generation & 0xffffff) << 32)
+                | (uint32_t) fd;
+    }
+
+    static void grow(OutBuffer *b, int len) {
+        if (b->len + len <= b->cap) {
+            return;
+        }
+        int cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        b->data = (char*) realloc(b->data, cap);
+        dieif(!b->data, "realloc");
+        b->cap = cap;
+    }
+
+public:
+
+    IoUringMain() : listener(-1), server(NULL), loopEnd(false), acceptOptions(0),
+            isMultishot(true), currentBuffer(-1), numHeld(0) {
+    }
+
+    ~IoUringMain() {
+        for (int fd = 0; fd < connections.limit(); fd++) {
+            Connection *c = connections.find(fd);
+            if (c && c->pHandler) {
+                close(fd);
+            }
+        }
+        if (listener != -1) {
+            close(listener);
+        }
+        // Operations under way end with the ring, before their buffers go
+        ring.teardown();
+        for (int fd = 0; fd < connections.limit(); fd++) {
+            Connection *c = connections.find(fd);
+            if (c) {
+                free(c->pending.data);
+                free(c->inflight.data);
+                free(c->pConnectAddress);
+            }
+        }
+    }
+
+    void initialize() {
+        loopEnd = false;
+        if (ring.getFd() != -1) {
+            return;
+        }
+        ring.setup(RingEntries, CompletionEntries);
+        recvBuffers.setup(&ring, RecvGroup, NumRecvBuffers, RecvBufferSize);
+        timers.create();
+        pollTimers();
+    }
+
+    // The timerfd is polled, run() reads it
+    void pollTimers() {
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = timers.getFd();
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = userData(OpTimer, timers.getFd(), 0);
+    }
+
+    void postAccept() {
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listener;
+        sqe->accept_flags = (acceptOptions & AcceptNonBlock) ? SOCK_NONBLOCK : 0;
+        sqe->user_data = userData(OpAccept, listener, 0);
+    }
+
+    void postRecv(int fd, Connection *c) {
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RecvGroup;
+        sqe->ioprio = isMultishot ? IORING_RECV_MULTISHOT : 0;
+        sqe->user_data = userData(OpRecv, fd, c->generation);
+        c->isReceiving = true;
+    }
+
+    void postSend(int fd, Connection *c) {
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) (c->inflight.data + c->inflightSent);
+        sqe->len = c->inflight.len - c->inflightSent;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = userData(OpSend, fd, c->generation);
+        c->isSending = true;
+        stats.numSyscalls++;
+    }
+
+    // Moves the pending bytes of the queued connections to send operations
+    void flushSends() {
+        for (size_t i = 0; i < toSend.size(); i++) {
+            int fd = toSend[i];
+            Connection *c = connections.find(fd);
+            c->isQueued = false;
+            startSend(fd, c);
+        }
+        toSend.clear();
+    }
+
+    void startSend(int fd, Connection *c) {
+        if (!c->pHandler || c->isConnecting || c->isSending || !c->pending.len) {
+            return;
+        }
+        OutBuffer sent = c->inflight;
+        c->inflight = c->pending;
+        c->pending = sent;
+        c->pending.len = 0;
+        c->inflightSent = 0;
+        postSend(fd, c);
+    }
+
+    // Only what a full socket left over counts as backlog, not the sends
+    // queued for the turn
+    void setBacklog(Connection *c, int bytes) {
+        stats.backlogBytes += bytes - c->backlog;
+        c->backlog = bytes;
+        if (stats.backlogBytes > stats.peakBacklogBytes) {
+            stats.peakBacklogBytes = stats.backlogBytes;
+        }
+    }
+
+    void releaseBuffer(Connection *c) {
+        if (c->heldBuffer) {
+            recvBuffers.put(c->heldBuffer - 1);
+            c->heldBuffer = 0;
+            numHeld--;
+        }
+    }
+
+    // The fd is closed at once, its operations under way end with an error
+    // or end of file once the socket is shut down
+    void closeConnection(int fd, Connection *c) {
+        releaseBuffer(c);
+        setBacklog(c, 0);
+        c->pending.len = 0;
+        EventHandler *pHandler = c->pHandler;
+        c->pHandler = NULL;
+        c->isConnecting = false;
+        c->generation++;
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+        notifyClosed(pHandler, (Context*) (long) fd);
+    }
+
+    void addConnection(int fd, EventHandler *pHandler) {
+        Connection *c = connections.get(fd);
+        c->pHandler = pHandler;
+        c->isConnecting = false;
+        c->heldBuffer = 0;
+        c->inflightSent = 0;
+        c->backlog = 0;
+        c->pending.len = 0;
+    }
+
+    void onAccept(int res) {
+        if (res < 0) {
+            errno = -res;
+            perror("accept");
+        } else {
+            setNoDelay(res);
+            addConnection(res, server);
+            Connection *c = connections.find(res);
+            if (!c->isReceiving) {
+                postRecv(res, c);
+            }
+        }
+        postAccept();
+    }
+
+    void onConnect(int fd, Connection *c, int res) {
+        if (res < 0) {
+            errno = -res;
+            perror("connect");
+            exit(1);
+        }
+        c->isConnecting = false;
+        setNoDelay(fd);
+        if (!c->isReceiving) {
+            postRecv(fd, c);
+        }
+        c->pHandler->setContext((Context*) (long) fd);
+        c->pHandler->enable();
+        startSend(fd, c);
+    }
+
+    void onRecv(int fd, Connection *c, bool isCurrent, int res, uint32_t flags) {
+        bool isMore = flags & IORING_CQE_F_MORE;
+        if (!isMore) {
+            c->isReceiving = false;
+        }
+        if (!isCurrent) {
+            if (flags & IORING_CQE_F_BUFFER) {
+                recvBuffers.put(flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            // A new connection on the fd waited for this one's receive
+            if (!c->isReceiving && c->pHandler && !c->isConnecting) {
+                postRecv(fd, c);
+            }
+            return;
+        }
+        if (res == -EINVAL && isMultishot) {
+            isMultishot = false;
+            postRecv(fd, c);
+            return;
+        }
+        // Every buffer is held or not handed back yet
+        if (res == -ENOBUFS) {
+            if (!isMore) {
+                postRecv(fd, c);
+            }
+            return;
+        }
+        if (res <= 0) {
+            if (res < 0) {
+                errno = -res;
+                perror("recv");
+            }
+            closeConnection(fd, c);
+            return;
+        }
+        currentBuffer = flags >> IORING_CQE_BUFFER_SHIFT;
+        TRACE_EVENT(TraceRecv, res);
+        c->pHandler->setContext((Context*) (long) fd);
+        c->pHandler->process(recvBuffers.buffer(currentBuffer), res, true);
+        // holdReceive() takes it over
+        if (currentBuffer != -1) {
+            recvBuffers.put(currentBuffer);
+        }
+        currentBuffer = -1;
+        if (!isMore && !c->isReceiving && c->pHandler) {
+            postRecv(fd, c);
+        }
+    }
+
+    void onSend(int fd, Connection *c, bool isCurrent, int res) {
+        c->isSending = false;
+        if (isCurrent) {
+            if (res < 0) {
+                if (res != -EPIPE && res != -ECONNRESET) {
+                    errno = -res;
+                    perror("send");
+                }
+                closeConnection(fd, c);
+                return;
+            }
+            c->inflightSent += res;
+            // The socket took part of it, the rest goes behind the
+            // bytes it has
+            if (c->inflightSent < c->inflight.len) {
+                stats.numBlocked++;
+                setBacklog(c, c->inflight.len - c->inflightSent);
+                postSend(fd, c);
+                return;
+            }
+            setBacklog(c, 0);
+        }
+        startSend(fd, c);
+    }
+
+    void dispatch(uint64_t data, int res, uint32_t flags) {
+        Op op = (Op) (data >> 56);
+        int fd = (int) (uint32_t) data;
+        if (op == OpTimer) {
+            timers.run();
+            pollTimers();
+            return;
+        }
+        if (op == OpAccept) {
+            onAccept(res);
+            return;
+        }
+        Connection *c = connections.find(fd);
+        bool isCurrent = c->pHandler
+                && (c->generation & 0xffffff) == ((data >> 32) & 0xffffff);
+        switch (op) {
+        case OpConnect:
+            free(c->pConnectAddress);
+            c->pConnectAddress = NULL;
+            if (isCurrent) {
+                onConnect(fd, c, res);
+            }
+            break;
+        case OpRecv:
+            onRecv(fd, c, isCurrent, res, flags);
+            break;
+        case OpSend:
+            onSend(fd, c, isCurrent, res);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void process() {
+        while (!loopEnd) {
+            flushSends();
+            ring.submitAndWait();
+            int ncompletions = 0;
+            io_uring_cqe *cqe;
+            // The slot is handed back first, dispatching may submit more
+            while ((cqe = ring.peekCqe()) != NULL) {
+                uint64_t data = cqe->user_data;
+                int res = cqe->res;
+                uint32_t flags = cqe->flags;
+                ring.seenCqe();
+                dispatch(data, res, flags);
+                ncompletions++;
+            }
+            TRACE_EVENT(TraceWakeup, ncompletions);
+            LIVE_STAT(liveLoop(pLive, ncompletions));
+        }
+    }
+
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
+    }
+
+    void cancelLoop() {
+        loopEnd = true;
+    }
+
+    bool setAcceptOptions(int options) {
+        acceptOptions = options;
+        return true;
+    }
+
+    // Sends are always gathered for one turn of the loop
+    OutputStats *outputStats() {
+        return &stats;
+    }
+
+    bool holdReceive(EventHandler *p) {
+        Connection *c = connections.find((int) (long) p->getContext());
+        if (!c || c->heldBuffer || currentBuffer == -1
+                || numHeld >= NumRecvBuffers / 2) {
+            return false;
+        }
+        numHeld++;
+        c->heldBuffer = currentBuffer + 1;
+        currentBuffer = -1;
+        return true;
+    }
+
+    void releaseReceive(EventHandler *p) {
+        Connection *c = connections.find((int) (long) p->getContext());
+        if (c) {
+            releaseBuffer(c);
+        }
+    }
+
+    void bindServer(const char *port, EventHandler *pProcessor) {
+        sockaddr_storage ss;
+        socklen_t slen = makeAddress(NULL, port, &ss);
+
+        if (ss.ss_family == AF_UNIX) {
+            unlink(port);
+        }
+        listener = socket(ss.ss_family, SOCK_STREAM, 0);
+        this->server = pProcessor;
+        setParent(pProcessor);
+        int oneval = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &oneval, sizeof(oneval));
+        if ((acceptOptions & AcceptReusePort) && setsockopt(listener,
+                SOL_SOCKET, SO_REUSEPORT, &oneval, sizeof(oneval)) == -1) {
+            perror("SO_REUSEPORT");
+        }
+        if (bind(listener, (struct sockaddr*) &ss, slen) < 0) {
+            perror("bind");
+            return;
+        }
+        // Fan-in runs connect hundreds of clients before the loop accepts
+        if (listen(listener, SOMAXCONN) < 0) {
+            perror("listen");
+            return;
+        }
+        postAccept();
+        INFO_OUT("Listenning to port %s", port);
+    }
+
+    void send(EventHandler *p, const char *data, int len, bool isDataEnd) {
+        if (!p) {
+            INFO_OUT("Invalid context");
+            return;
+        }
+        int fd = (int) (long) p->getContext();
+        Connection *c = connections.find(fd);
+        if (!c || !c->pHandler) {
+            return;
+        }
+        grow(&c->pending, len);
+        memcpy(c->pending.data + c->pending.len, data, len);
+        c->pending.len += len;
+        stats.numMessages++;
+        if (!c->isQueued && !c->isSending) {
+            c->isQueued = true;
+            toSend.push_back(fd);
+        }
+    }
+
+    void disconnect(EventHandler *p) {
+        int fd = (int) (long) p->getContext();
+        Connection *c = connections.find(fd);
+        if (c && c->pHandler) {
+            closeConnection(fd, c);
+        }
+    }
+
+    // The connect completes in the loop, which then calls enable()
+    void connectToServer(const char *address, const char *port,
+            EventHandler *pProcessor) {
+        sockaddr_storage *pAddress = (sockaddr_storage*) malloc(sizeof(sockaddr_storage));
+        dieif(!pAddress, "malloc");
+        socklen_t slen = makeAddress(address, port, pAddress);
+
+        int dest = socket(pAddress->ss_family, SOCK_STREAM, 0);
+        dieif(dest == -1, "socket");
+        setParent(pProcessor);
+        pProcessor->setContext((Context*) (long) dest);
+        addConnection(dest, pProcessor);
+        Connection *c = connections.find(dest);
+        c->isConnecting = true;
+        c->pConnectAddress = pAddress;
+        io_uring_sqe *sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = dest;
+        sqe->addr = (uint64_t) (uintptr_t) pAddress;
+        sqe->off = slen;
+        sqe->user_data = userData(OpConnect, dest, c->generation);
+    }
+
+};
+
+
+REGISTER_TRANSPORT("io_uring", IoUringMain, "TCP with io_uring completions (Linux)",
+        TransportTimers)
+
+#ifdef BUILDTEST
+IoUringMain IoUringMain;
+EventMain *g_pmainProcessor = &IoUringMain;
+#endif
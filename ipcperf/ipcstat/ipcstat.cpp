@@ -0,0 +1,254 @@
+//
+// Samples the live stats pages of running ipcperf processes (-L, see
+// livestats.h) and prints their rates and round trip percentiles over each
+// interval. Without pids it follows every page in /dev/shm, picking up
+// processes as they start. The pages are mapped read only; a page whose
+// process is gone, like a server killed before it could clean up, is
+// removed.
+//
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <vector>
+#include "livestats.h"
+
+struct Snapshot {
+    uint64_t nanos;
+    uint64_t messagesSent;
+    uint64_t bytesSent;
+    uint64_t messagesReceived;
+    uint64_t bytesReceived;
+    uint64_t loopIterations;
+    uint64_t emptyPolls;
+    uint64_t latencyCount;
+    std::vector<uint64_t> latency;
+};
+
+struct Page {
+    LiveStatsPage *pPage;
+    Snapshot last;
+    // Opened in this pass, its first interval ends with the next one
+    bool isNew;
+};
+
+static void takeSnapshot(LiveStatsPage *pPage, Snapshot *pSnap)
+{
+    pSnap->nanos = getMonotonicNanos();
+    pSnap->messagesSent = pPage->messagesSent.load(std::memory_order_relaxed);
+    pSnap->bytesSent = pPage->bytesSent.load(std::memory_order_relaxed);
+    pSnap->messagesReceived = pPage->messagesReceived.load(
+            std::memory_order_relaxed);
+    pSnap->bytesReceived = pPage->bytesReceived.load(std::memory_order_relaxed);
+    pSnap->loopIterations = pPage->loopIterations.load(
+            std::memory_order_relaxed);
+    pSnap->emptyPolls = pPage->emptyPolls.load(std::memory_order_relaxed);
+    pSnap->latencyCount = pPage->latencyCount.load(std::memory_order_relaxed);
+    pSnap->latency.resize(LatencyHistogram::NumBuckets);
+    for (int i = 0; i < LatencyHistogram::NumBuckets; i++) {
+        pSnap->latency[i] = pPage->latency[i].load(std::memory_order_relaxed);
+    }
+}
+
+// Upper edge of the bucket holding the percentile of the round trips
+// between two snapshots, 0 when there were none
+static uint64_t percentileBetween(const Snapshot &from, const Snapshot &to,
+        double percentile)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < LatencyHistogram::NumBuckets; i++) {
+        total += to.latency[i] - from.latency[i];
+    }
+    if (!total) {
+        return 0;
+    }
+    uint64_t target = (uint64_t) (percentile / 100.0 * total + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LatencyHistogram::NumBuckets; i++) {
+        seen += to.latency[i] - from.latency[i];
+        if (seen >= target) {
+            return LatencyHistogram::highestValueAt(i);
+        }
+    }
+    return 0;
+}
+
+static bool isRunning(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// Maps the page of pid, NULL when there is none or it is of another build
+static LiveStatsPage *openPage(pid_t pid)
+{
+    char name[64];
+    liveStatsName(pid, name, sizeof(name));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size != (off_t) sizeof(LiveStatsPage)) {
+        close(fd);
+        return NULL;
+    }
+    void *p = mmap(NULL, sizeof(LiveStatsPage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    LiveStatsPage *pPage = (LiveStatsPage*) p;
+    if (pPage->magic != LiveStatsMagic || pPage->version != LiveStatsVersion) {
+        munmap(p, sizeof(LiveStatsPage));
+        return NULL;
+    }
+    return pPage;
+}
+
+// Pids of the pages in /dev/shm, where Linux keeps POSIX shared memory
+static void listPages(std::vector<pid_t> *pPids)
+{
+    DIR *dir = opendir("/dev/shm");
+    if (!dir) {
+        return;
+    }
+    while (dirent *entry = readdir(dir)) {
+        int pid;
+        char rest;
+        if (sscanf(entry->d_name, "ipcperf-%d%c", &pid, &rest) == 1) {
+            pPids->push_back(pid);
+        }
+    }
+    closedir(dir);
+}
+
+static void printHeader()
+{
+    printf("%8s %-13s %10s %10s %9s %9s %10s %6s %9s %9s %9s\n", "pid",
+            "role", "sent/s", "recv/s", "MB/s out", "MB/s in", "loops/s",
+            "empty", "p50 usec", "p99 usec", "p99.9");
+}
+
+static void printRates(LiveStatsPage *pPage, const Snapshot &from,
+        const Snapshot &to)
+{
+    double seconds = (to.nanos - from.nanos) / 1e9;
+    if (seconds <= 0) {
+        return;
+    }
+    uint64_t loops = to.loopIterations - from.loopIterations;
+    uint64_t empty = to.emptyPolls - from.emptyPolls;
+    printf("%8d %-13s %10.0f %10.0f %9.2f %9.2f %10.0f %5.1f%%", pPage->pid,
+            pPage->role, (to.messagesSent - from.messagesSent) / seconds,
+            (to.messagesReceived - from.messagesReceived) / seconds,
+            (to.bytesSent - from.bytesSent) / seconds / 1e6,
+            (to.bytesReceived - from.bytesReceived) / seconds / 1e6,
+            loops / seconds, loops ? 100.0 * empty / loops : 0.0);
+    if (to.latencyCount != from.latencyCount) {
+        printf(" %9.2f %9.2f %9.2f\n",
+                percentileBetween(from, to, 50) / 1000.0,
+                percentileBetween(from, to, 99) / 1000.0,
+                percentileBetween(from, to, 99.9) / 1000.0);
+    } else {
+        printf(" %9s %9s %9s\n", "-", "-", "-");
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "%s [-i msec] [-n samples] [pid...]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int intervalMsec = 1000;
+    int numSamples = 0;
+    int c;
+    while ((c = getopt(argc, argv, "i:n:")) != -1) {
+        switch (c) {
+        case 'i': intervalMsec = atoi(optarg); break;
+        case 'n': numSamples = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (intervalMsec <= 0) {
+        usage(argv[0]);
+    }
+    std::vector<pid_t> wanted;
+    for (int i = optind; i < argc; i++) {
+        wanted.push_back(atoi(argv[i]));
+    }
+    std::map<pid_t, Page> pages;
+    for (int sample = 0; !numSamples || sample <= numSamples; sample++) {
+        std::vector<pid_t> pids = wanted;
+        if (pids.empty()) {
+            listPages(&pids);
+        }
+        for (size_t i = 0; i < pids.size(); i++) {
+            if (pages.count(pids[i])) {
+                continue;
+            }
+            if (!isRunning(pids[i])) {
+                char name[64];
+                liveStatsName(pids[i], name, sizeof(name));
+                if (shm_unlink(name) == 0) {
+                    fprintf(stderr, "Removed the page of pid %d, which is gone\n",
+                            (int) pids[i]);
+                }
+                continue;
+            }
+            Page page;
+            page.pPage = openPage(pids[i]);
+            if (page.pPage) {
+                takeSnapshot(page.pPage, &page.last);
+                page.isNew = true;
+                pages[pids[i]] = page;
+            }
+        }
+        bool isHeaderDone = false;
+        std::map<pid_t, Page>::iterator it = pages.begin();
+        while (it != pages.end()) {
+            Page &page = it->second;
+            if (page.isNew) {
+                page.isNew = false;
+                ++it;
+                continue;
+            }
+            if (!isHeaderDone) {
+                isHeaderDone = true;
+                time_t now = time(NULL);
+                char stamp[32];
+                strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+                printf("%s\n", stamp);
+                printHeader();
+            }
+            Snapshot snap;
+            takeSnapshot(page.pPage, &snap);
+            printRates(page.pPage, page.last, snap);
+            page.last = snap;
+            // A process that ended unlinked its page, the last interval
+            // above was its final one
+            if (!isRunning(it->first)) {
+                munmap(page.pPage, sizeof(LiveStatsPage));
+                pages.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        fflush(stdout);
+        if (numSamples && sample == numSamples) {
+            break;
+        }
+        usleep(intervalMsec * 1000);
+    }
+    return 0;
+}
@@ -5,58 +5,96 @@
 #include <fcntl.h>
 #include <assert.h>
 #include "framework.h"
+#include "transport.h"
+#include "outqueue.h"
+#include "timers.h"
 
 
 // Main event loop
 class KQueueMain: public EventMain {
 protected:
 
+    int kqfd;
     int listener;
-    int dest;
     EventHandler *server;
-    EventHandler *client;
+    // Set when a client connects from this process
+    bool hasClient;
     bool loopEnd;
+    char *recvBuffer;
+    OutputBatcher batcher;
+    TimerQueue timers;
 
 public:
 
     void initialize() {
         loopEnd = false;
-        dest = listener = -1;
+        listener = -1;
+        server = NULL;
+        hasClient = false;
+        recvBuffer = new char[RecvBufferSize];
+        kqfd = kqueue();
+        dieif(kqfd == -1, "kqueue");
 
     }
 
-#define MAXEVENTS 64
-
-    void process() {
-        int kqfd;
-        struct kevent event = {0};
-        struct kevent events[MAXEVENTS];
-
-        kqfd = kqueue();
-        dieif(kqfd == -1, "kqueue");
+    ~KQueueMain() {
+        if (listener != -1) {
+            close(listener);
+        }
+        delete[] recvBuffer;
+    }
 
-        if (this->listener != -1) {
+#define MAXEVENTS 64
 
-            EV_SET(&event, this->listener, EVFILT_READ, EV_ADD, 0, 0, 0);
-            if(kevent(kqfd, &event, 1, NULL, 0, NULL) == -1) {
-                diep("kevent");
-            }
-            INFO_OUT("Added listenner");
+    // Sockets are registered as soon as they exist, so any number of
+    // clients and accepted connections share the queue.
+    void addFd(int fd, EventHandler *pHandler) {
+        struct kevent event;
+        EV_SET(&event, fd, EVFILT_READ, EV_ADD, 0, 0, pHandler);
+        if(kevent(kqfd, &event, 1, NULL, 0, NULL) == -1) {
+            diep("kevent");
         }
-        if (this->dest != -1) {
-            EV_SET(&event, this->dest, EVFILT_READ, EV_ADD, 0, 0, client);
-            if(kevent(kqfd, &event, 1, NULL, 0, NULL) == -1) {
-                diep("kevent");
+    }
+
+    void acceptClients() {
+        while (true) {
+            struct sockaddr_storage ss;
+            socklen_t slen = sizeof(ss);
+            int acceptfd = accept(listener,  (struct sockaddr*) &ss, &slen);
+            if (acceptfd == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("accept");
+                }
+                return;
             }
-            INFO_OUT("Added client");
+            fcntl(acceptfd, F_SETFL, O_NONBLOCK);
+            setNoDelay(acceptfd);
+            addFd(acceptfd, server);
+            INFO_OUT("Added accept event");
         }
+    }
+
+    void process() {
+        struct kevent events[MAXEVENTS];
 
         while (!loopEnd) {
-            int nevents = kevent(kqfd, NULL, 0, events, MAXEVENTS, NULL);
+            batcher.flushAll(canWait());
+            // Wait no longer than the next timer
+            int64_t nanos = timers.nanosToNext();
+            timespec timeout = {(time_t) (nanos / 1000000000),
+                    (long) (nanos % 1000000000)};
+            int nevents = kevent(kqfd, NULL, 0, events, MAXEVENTS,
+                    nanos < 0 ? NULL : &timeout);
             INFO_OUT("Got event");
             if (nevents < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
                 diep("kevent main");
             }
+            TRACE_EVENT(TraceWakeup, nevents);
+            LIVE_STAT(liveLoop(pLive, nevents));
+            timers.runDue();
             for (int i=0; i < nevents; i++) {
                 struct kevent *pev = &events[i];
                 
@@ -64,71 +102,89 @@ public:
                     fprintf(stderr, "EVERROR %s\n", strerror(pev->data));
                     exit(1);
                 }
-                if (listener == pev->ident) {
-                    struct sockaddr_storage ss;
-                    socklen_t slen = sizeof(ss);
-                    int acceptfd = accept(listener,  (struct sockaddr*) &ss, &slen);
-                    if (acceptfd == -1) {
-                        perror("accept");
-                        continue;
-                    }
-                    fcntl(acceptfd, F_SETFL, O_NONBLOCK);
-                    EV_SET(&event, acceptfd, EVFILT_READ, EV_ADD, 0, 0, server);
-                    if(kevent(kqfd, &event, 1, NULL, 0, NULL) == -1) {
-                        diep("kevent");
-                    }
-                    INFO_OUT("Added accept event");
+                if (listener == (int) pev->ident) {
+                    acceptClients();
                     continue;
                 }
                 INFO_OUT("Reading socket %d", i);
-                char buf[1024];
-                bool isDone = false;
-                ssize_t  result = recv(pev->ident, buf, sizeof(buf), 0);
+                ssize_t  result = recv(pev->ident, recvBuffer, RecvBufferSize, 0);
                 if (result < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        continue;
+                    }
                     perror("recv");
+                    batcher.forget(pev->ident);
                     close(pev->ident);
+                    notifyClosed((EventHandler*) pev->udata,
+                            (Context*) (long) pev->ident);
                     continue;
                 } else if (result == 0) {
+                    batcher.forget(pev->ident);
                     close(pev->ident);
-                    break;
+                    notifyClosed((EventHandler*) pev->udata,
+                            (Context*) (long) pev->ident);
+                    continue;
                 }
+                TRACE_EVENT(TraceRecv, result);
                 if (pev->udata) {
                     EventHandler *pHandler = (EventHandler*)pev->udata;
                     pHandler->setContext((Context*) (long) pev->ident);
-                    pHandler->process(buf, result, true);
+                    pHandler->process(recvBuffer, result, true);
                 }
 
             }
         }
-        close(listener);
+    }
+
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(getMonotonicNanos() + delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
     }
 
     void cancelLoop() {
         loopEnd = true;
     }
 
-    void bindServer(const char *port, EventHandler *pProcessor) {
-        struct sockaddr_in sin = { 0 };
+    // Only a peer process can drain a full socket buffer
+    bool canWait() {
+        return !(listener != -1 && hasClient);
+    }
 
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = 0;
-        sin.sin_port = htons(atoi(port));
+    void setBatching(int maxBytes, uint64_t maxDelayNanos) {
+        batcher.setPolicy(maxBytes, maxDelayNanos);
+    }
+
+    OutputStats *outputStats() {
+        return &batcher.stats;
+    }
 
-        listener = socket(AF_INET, SOCK_STREAM, 0);
+    void bindServer(const char *port, EventHandler *pProcessor) {
+        sockaddr_storage ss;
+        socklen_t slen = makeAddress(NULL, port, &ss);
+
+        if (ss.ss_family == AF_UNIX) {
+            unlink(port);
+        }
+        listener = socket(ss.ss_family, SOCK_STREAM, 0);
         this->server = pProcessor;
         setParent(pProcessor);
         fcntl(listener, F_SETFL, O_NONBLOCK);
         int oneval = 1;
         setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &oneval, sizeof(oneval));
-        if (bind(listener, (struct sockaddr*) &sin, sizeof(sin)) < 0) {
+        if (bind(listener, (struct sockaddr*) &ss, slen) < 0) {
             perror("bind");
             return;
         }
         INFO_OUT("Bound to port %s", port);
-        if (listen(listener, 16) < 0) {
+        // Fan-in runs connect hundreds of clients before the loop accepts
+        if (listen(listener, SOMAXCONN) < 0) {
             perror("listen");
             return;
         }
+        addFd(listener, NULL);
         INFO_OUT("Listenning to port %s", port);
     }
 
@@ -137,30 +193,38 @@ public:
             INFO_OUT("Invalid context");
             return;
         }
-        if (::send((int) (long) p->getContext(), data, len, 0) == -1) {
-            perror("send");
-        }
+        batcher.send((int) (long) p->getContext(), data, len, NULL, 0,
+                canWait());
         INFO_OUT("Done sending");
 
     }
 
+    // Closing the socket drops its kevent
+    void disconnect(EventHandler *p) {
+        int fd = (int) (long) p->getContext();
+        batcher.forget(fd);
+        close(fd);
+        notifyClosed(p, (Context*) (long) fd);
+    }
+
     void connectToServer(const char *address, const char *port,
             EventHandler *pProcessor) {
-        sockaddr_in sin = { 0 };
-
-        sin.sin_family = AF_INET;
-        sin.sin_port = htons(atoi(port));
-        inet_pton(AF_INET, address, &(sin.sin_addr));
-        dest = socket(AF_INET, SOCK_STREAM, 0);
-        this->client = pProcessor;
-        if (connect(dest, (sockaddr*) &sin, sizeof(sin)) < 0) {
+        sockaddr_storage ss;
+        socklen_t slen = makeAddress(address, port, &ss);
+
+        int dest = socket(ss.ss_family, SOCK_STREAM, 0);
+        if (connect(dest, (sockaddr*) &ss, slen) < 0) {
             perror("connect");
             exit(1);
             return;
         }
         setParent(pProcessor);
+        hasClient = true;
         pProcessor->setContext((Context*) (long) dest);
         fcntl(dest, F_SETFL, O_NONBLOCK);
+        setNoDelay(dest);
+        addFd(dest, pProcessor);
+        INFO_OUT("Added client");
         pProcessor->enable();
 
         // Investigate: should set reuse address ?
@@ -170,6 +234,8 @@ public:
 };
 
 
+REGISTER_TRANSPORT("kqueue", KQueueMain, "TCP with kqueue (Mac OSX)", TransportTimers)
+
 #ifdef BUILDTEST
 KQueueMain kqmain;
 EventMain *g_pmainProcessor = &kqmain;
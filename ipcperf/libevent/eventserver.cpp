@@ -6,9 +6,12 @@
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <iostream>
+#include <map>
+#include <set>
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include "framework.h"
+#include "transport.h"
 
 class LibEventMain;
 
@@ -18,12 +21,56 @@ class LibEventMain: public EventMain {
 protected:
     event_base *m_ebase;
 
+    // Every timer is an evtimer of its own
+    struct Timer {
+        LibEventMain *pMain;
+        int id;
+        TimerHandler *pTimer;
+        event *pEvent;
+    };
+    std::map<int, Timer*> timers;
+    int nextTimerId;
+    int acceptOptions;
+    event *listenerEvent;
+    // Open connections, freed with the loop
+    std::set<bufferevent*> connections;
+
 public:
 
+    LibEventMain() : m_ebase(NULL), nextTimerId(0), acceptOptions(0),
+            listenerEvent(NULL) {
+    }
+
+    ~LibEventMain() {
+        for (std::set<bufferevent*>::iterator it = connections.begin();
+                it != connections.end(); ++it) {
+            bufferevent_free(*it);
+        }
+        if (listenerEvent) {
+            close(event_get_fd(listenerEvent));
+            event_free(listenerEvent);
+        }
+        for (std::map<int, Timer*>::iterator it = timers.begin();
+                it != timers.end(); ++it) {
+            event_free(it->second->pEvent);
+            delete it->second;
+        }
+        if (m_ebase) {
+            event_base_free(m_ebase);
+        }
+    }
+
     void initialize() {
-        if ((m_ebase = event_base_new()) == NULL) {
+        event_config *cfg = event_config_new();
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+        // Timers to the microsecond instead of epoll's milliseconds, an open
+        // loop client sends on them
+        event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+#endif
+        if ((m_ebase = event_base_new_with_config(cfg)) == NULL) {
             perror("Cannot initialize libevent");
         }
+        event_config_free(cfg);
 
     }
     void process() {
@@ -36,6 +83,49 @@ public:
         }
     }
 
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        Timer *t = new Timer();
+        t->pMain = this;
+        t->id = nextTimerId++;
+        t->pTimer = pTimer;
+        t->pEvent = evtimer_new(m_ebase, timerfn, t);
+        uint64_t usec = (delayNanos + 999) / 1000;
+        timeval delay;
+        delay.tv_sec = usec / 1000000;
+        delay.tv_usec = usec % 1000000;
+        if (!t->pEvent || evtimer_add(t->pEvent, &delay)) {
+            ERROR_OUT("Cannot add a timer\n");
+            exit(1);
+        }
+        timers[t->id] = t;
+        return t->id;
+    }
+
+    void cancelTimer(int id) {
+        std::map<int, Timer*>::iterator it = timers.find(id);
+        if (it != timers.end()) {
+            event_free(it->second->pEvent);
+            delete it->second;
+            timers.erase(it);
+        }
+    }
+
+    bool setAcceptOptions(int options) {
+#ifndef SOCK_NONBLOCK
+        if (options & AcceptNonBlock) {
+            return false;
+        }
+#endif
+#ifndef SO_REUSEPORT
+        if (options & AcceptReusePort) {
+            return false;
+        }
+#endif
+        acceptOptions = options;
+        return true;
+    }
+
+    static void timerfn(int fd, short event, void *arg);
     static void acceptfn(int socket, short event, void *arg);
     static void readfn(bufferevent *bev, void *arg);
     static void errorfn(bufferevent *bev, short error, void *arg);
@@ -57,22 +147,30 @@ public:
             ERRNO_OUT("Error enabling socket reuse");
             exit(1);
         }
+#ifdef SO_REUSEPORT
+        if ((acceptOptions & AcceptReusePort) && setsockopt(listenerfd,
+                SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse))) {
+            ERRNO_OUT("Error enabling port reuse");
+            exit(1);
+        }
+#endif
         evutil_make_socket_nonblocking(listenerfd);
 
         if (bind(listenerfd, (sockaddr*) &sin, sizeof(sin)) < 0) {
             perror("bind");
         }
 
-        if (listen(listenerfd, 16) < 0) {
+        // Fan-in runs connect hundreds of clients before the loop accepts
+        if (listen(listenerfd, SOMAXCONN) < 0) {
             perror("listen");
             return;
         }
         setParent(pProcessor);
 
-        event *e = event_new(m_ebase, listenerfd, EV_READ | EV_PERSIST,
+        listenerEvent = event_new(m_ebase, listenerfd, EV_READ | EV_PERSIST,
                 acceptfn, (void*) pProcessor);
 
-        event_add(e, NULL);
+        event_add(listenerEvent, NULL);
 
         INFO_OUT("Bound to port:%s\n", port);
 
@@ -91,6 +189,16 @@ public:
 
     }
 
+    void disconnect(EventHandler *p) {
+        bufferevent *bev = (bufferevent *) p->getContext();
+        if (bev) {
+            connections.erase(bev);
+            bufferevent_free(bev);
+            notifyClosed(p, (Context*) bev);
+            p->setContext(NULL);
+        }
+    }
+
     void connectToServer(const char *address, const char *port,
             EventHandler *pProcessor) {
         sockaddr_in sin = { 0 };
@@ -105,6 +213,7 @@ public:
                 BEV_OPT_CLOSE_ON_FREE);
 
         bufferevent_setcb(bev, readfn, NULL, errorfn, (void*) pProcessor);
+        connections.insert(bev);
         pProcessor->setContext((Context*) bev);
         setParent(pProcessor);
         if (bufferevent_socket_connect(bev, (struct sockaddr *) &sin,
@@ -135,16 +244,23 @@ void LibEventMain::readfn(bufferevent *bev, void *arg) {
 //	char *data = evbuffer_readln(input, &n, EVBUFFER_EOL_LF);
 //	p->process(data, n, true);
 //	free(data);
-    if ((n = evbuffer_remove(input, buffer, sizeof(buffer))) > 0) {
+    // Drain everything that arrived, large payloads span several chunks
+    while ((n = evbuffer_remove(input, buffer, sizeof(buffer))) > 0) {
+        TRACE_EVENT(TraceRecv, n);
+        // The server handler is shared by every accepted connection
+        p->setContext((Context*) bev);
         p->process(buffer, n, !n);
+        // The handler disconnected, bev is gone
+        if (p->getContext() != (Context*) bev) {
+            return;
+        }
     }
-
-    // Todo: What happens to the remaining buffer that is less than max_buff
 }
 
 void LibEventMain::errorfn(bufferevent *bev, short int error, void *arg) {
     INFO_OUT("Errorfn: %x\n", error);
     if (error & BEV_EVENT_CONNECTED) {
+        setNoDelay(bufferevent_getfd(bev));
         bufferevent_setwatermark(bev, EV_READ, 0, max_buff);
         bufferevent_enable(bev, EV_READ | EV_WRITE);
         EventHandler *p = (EventHandler *) arg;
@@ -155,10 +271,24 @@ void LibEventMain::errorfn(bufferevent *bev, short int error, void *arg) {
     // if error & BEV_EVENT_EOF, BEV_EVENT_ERROR, BEV_EVENT_TIMEOUT
     if ((error & BEV_EVENT_ERROR) || (error & BEV_EVENT_EOF)
             || (error & BEV_EVENT_TIMEOUT)) {
+        EventHandler *p = (EventHandler *) arg;
+        LibEventMain *pMain = (LibEventMain*) p->getParent();
+        pMain->connections.erase(bev);
         bufferevent_free(bev);
+        pMain->notifyClosed(p, (Context*) bev);
     }
 }
 
+void LibEventMain::timerfn(int fd, short event, void *arg) {
+    Timer *t = (Timer*) arg;
+    TimerHandler *pTimer = t->pTimer;
+    int id = t->id;
+    t->pMain->timers.erase(id);
+    event_free(t->pEvent);
+    delete t;
+    pTimer->onTimer(id);
+}
+
 void LibEventMain::acceptfn(int listener, short event, void *arg) {
     EventHandler *processor = (EventHandler*) arg;
     LibEventMain *plevent = (LibEventMain*) processor->getParent();
@@ -166,7 +296,14 @@ void LibEventMain::acceptfn(int listener, short event, void *arg) {
     sockaddr_storage ss;
     socklen_t slen = sizeof(ss);
     // Investigate: Using a loop to accept connections makes it faster?
+#ifdef SOCK_NONBLOCK
+    bool isNonBlock = plevent->acceptOptions & AcceptNonBlock;
+    int fd = isNonBlock ? accept4(listener, (sockaddr*) &ss, &slen, SOCK_NONBLOCK)
+            : accept(listener, (sockaddr*) &ss, &slen);
+#else
+    bool isNonBlock = false;
     int fd = accept(listener, (sockaddr*) &ss, &slen);
+#endif
     if (fd < 0) {
         // Investigate: Should check EWOULDBLOCK and EAGAIN?
         perror("accept");
@@ -175,8 +312,12 @@ void LibEventMain::acceptfn(int listener, short event, void *arg) {
     INFO_OUT("Client connected on fd %d\n", fd);
 
     bufferevent *bev;
-    evutil_make_socket_nonblocking(fd);
+    if (!isNonBlock) {
+        evutil_make_socket_nonblocking(fd);
+    }
+    setNoDelay(fd);
     bev = bufferevent_socket_new(plevent->m_ebase, fd, BEV_OPT_CLOSE_ON_FREE);
+    plevent->connections.insert(bev);
     processor->setContext((Context*) bev);
     bufferevent_setcb(bev, readfn, NULL, errorfn, arg);
     bufferevent_setwatermark(bev, EV_READ, 0, max_buff);
@@ -184,6 +325,8 @@ void LibEventMain::acceptfn(int listener, short event, void *arg) {
 
 }
 
+REGISTER_TRANSPORT("libevent", LibEventMain, "TCP with libevent bufferevents", TransportTimers)
+
 #ifdef BUILDTEST
 LibEventMain libEventMain;
 EventMain *g_pmainProcessor = &libEventMain;
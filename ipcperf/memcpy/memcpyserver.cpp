@@ -6,52 +6,88 @@
 #include <sys/time.h>
 #include <assert.h>
 #include "framework.h"
+#include "transport.h"
+#include "shmring.h"
+#include "timers.h"
 //
 // Server and client in the same process communicating though copying
 // data using memcpy. It is to test overhead of class infrastructure. On
-// Intel i7 Mac OSX, there were 11M roundtrip messages/sec
+// Intel i7 Mac OSX, there were 11M roundtrip messages/sec. Each direction
+// is a message ring on the heap so several messages can be in flight.
+// StaticRingMain in staticmain.h is the same loop with static dispatch,
+// tests/dispatchbench compares the two.
 //
 
-const int max_buff = 32767;
-
 
 class MemcpyLoopMain: public EventMain {
 protected:
 
-    char *buffer;
-    int len;
+    MessageRing *toServer;
+    MessageRing *toClient;
     EventHandler *server;
     EventHandler *client;
     bool loopEnd;
-    EventHandler *dest;
+    // Polled every turn of the loop
+    TimerQueue timers;
 
 public:
 
+    MessageRing *createRing() {
+        MessageRing *ring = (MessageRing*) aligned_alloc(64,
+                MessageRing::totalSize(RingCapacity));
+        ring->init(RingCapacity);
+        return ring;
+    }
+
     void initialize() {
         loopEnd = false;
-        buffer = new char[max_buff];
-        len = 0;
-        server = client = dest = NULL;
+        toServer = createRing();
+        toClient = createRing();
+        server = client = NULL;
 
     }
+
+    // Returns whether there was a message
+    bool dispatch(MessageRing *ring, EventHandler *dest) {
+        char *data;
+        uint32_t len;
+        if (ring->isHeld() || !ring->peek(&data, &len)) {
+            return false;
+        }
+        EventHandler *context = (dest == client) ? server : client;
+        dest->setContext((Context*) (void*) context);
+        TRACE_EVENT(TraceRecv, len);
+        dest->process(data, len, true);
+        if (!ring->isHeld()) {
+            ring->release();
+        }
+        return true;
+    }
+
     void process() {
 
         while (!loopEnd) {
-            if (len == 0) {
-                continue;
+            timers.runDue();
+            int numDispatched = 0;
+            if (server) {
+                numDispatched += dispatch(toServer, server);
             }
-            if (dest) {
-                EventHandler *context = NULL;
-                context = (dest == client) ? server : client;
-                dest->setContext((Context*) (void*) context);
-                int tmplen = len;
-                len = 0;
-                dest->process(buffer, tmplen, true);
+            if (client) {
+                numDispatched += dispatch(toClient, client);
             }
+            LIVE_STAT(liveLoop(pLive, numDispatched));
         }
 
     }
 
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(getMonotonicNanos() + delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
+    }
+
     void cancelLoop() {
         loopEnd = true;
     }
@@ -66,14 +102,45 @@ public:
             INFO_OUT("Invalid context");
             return;
         }
-        memcpy(this->buffer, data, len);
-        this->dest = (EventHandler *) p->getContext();
-        this->len = len;
+        char *buf = acquireSend(p, len);
+        memcpy(buf, data, len);
+        commitSend(p, buf, len, isDataEnd);
+    }
+
+    MessageRing *sendRing(EventHandler *p) {
+        return ((EventHandler *) p->getContext() == server) ? toServer : toClient;
+    }
+
+    // The lease is the record reserved in the destination ring
+    char *acquireSend(EventHandler *p, int len) {
+        char *buf = sendRing(p)->reserve(len);
+        if (!buf) {
+            ERROR_OUT("Message ring full, too many bytes in flight\n");
+            exit(1);
+        }
+        return buf;
+    }
 
+    void commitSend(EventHandler *p, char *buf, int len, bool isDataEnd) {
+        sendRing(p)->commit(len);
+    }
+
+    bool holdReceive(EventHandler *p) {
+        (p == server ? toServer : toClient)->hold();
+        return true;
+    }
+
+    void releaseReceive(EventHandler *p) {
+        (p == server ? toServer : toClient)->release();
     }
 
     void connectToServer(const char *address, const char *port,
             EventHandler *pProcessor) {
+        // A ring pair connects the server to exactly one client
+        if (client) {
+            ERROR_OUT("Only one client per server, use -m 1\n");
+            exit(1);
+        }
         this->client = pProcessor;
         setParent(pProcessor);
         pProcessor->setContext((Context*) (void*) server);
@@ -82,6 +149,8 @@ public:
 };
 
 
+REGISTER_TRANSPORT("memcpy", MemcpyLoopMain, "Heap message rings, one process only", TransportSameProcessOnly | TransportTimers)
+
 #ifdef BUILDTEST
 MemcpyLoopMain memcpyloopMain;
 EventMain *g_pmainProcessor = &memcpyloopMain;
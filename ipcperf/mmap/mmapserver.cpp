@@ -9,79 +9,114 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include "framework.h"
+#include "transport.h"
+#include "shmring.h"
+#include "timers.h"
 //
 // Server and client in the same process communicating though copying
-// data using shared memory. 
+// data using shared memory. Each direction is a message ring in the
+// mapped file.
 //
 
-const int SharedMemorySize = 512;
+const size_t RingSize = MessageRing::totalSize(RingCapacity);
+const size_t SharedMemorySize = 2 * RingSize;
 
 const int ClientDest = 1;
 const int ServerDest = 2;
 
 
-struct membuff{
-    uint16_t destId;
-    uint16_t len;
-    char buffer[SharedMemorySize-2*sizeof(uint16_t)];
-} __attribute__((packed));
-
-
 class MMapLoopMain: public EventMain {
 protected:
 
-    membuff *pbuff;
+    char *pbuff;
+    // Indexed by destination id
+    MessageRing *rings[3];
     EventHandler *server;
     EventHandler *client;
     bool loopEnd;
+    // Polled every turn of the loop
+    TimerQueue timers;
     key_t key;
     int fd;
-    
+
 public:
 
     void initialize() {
         loopEnd = false;
         pbuff = NULL;
+        rings[0] = rings[ClientDest] = rings[ServerDest] = NULL;
         server = client = NULL;
 
     }
+
+    // Returns whether there was a message
+    bool dispatch(MessageRing *ring, EventHandler *dest) {
+        char *data;
+        uint32_t len;
+        if (ring->isHeld() || !ring->peek(&data, &len)) {
+            return false;
+        }
+        TRACE_EVENT(TraceRecv, len);
+        dest->process(data, len, true);
+        if (!ring->isHeld()) {
+            ring->release();
+        }
+        return true;
+    }
+
     void process() {
 
         while (!loopEnd) {
-            if (!pbuff || !pbuff->len) {
-                continue;
+            timers.runDue();
+            int numDispatched = 0;
+            if (server) {
+                numDispatched += dispatch(rings[ServerDest], server);
             }
-            EventHandler *dest = (pbuff->destId == ClientDest) ? client : server;
-            if (dest == NULL) {
-                continue;
+            if (client) {
+                numDispatched += dispatch(rings[ClientDest], client);
             }
-            dest->process(pbuff->buffer, pbuff->len, true);
+            LIVE_STAT(liveLoop(pLive, numDispatched));
         }
 
     }
 
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(getMonotonicNanos() + delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
+    }
+
     void cancelLoop() {
         loopEnd = true;
     }
 
     void createSharedMem(bool isServer) {
+        if (pbuff) {
+            return;
+        }
         fd = open("/tmp/mmapserver", O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
         if (fd <= 0) {
             diep("open");
         }
         if (isServer) {
-            char buff[SharedMemorySize];
-            memset(&buff, 0, sizeof(buff));
-            write(fd, buff, SharedMemorySize);
-        }
-        if (lseek(fd, SharedMemorySize-1, SEEK_SET ) == -1) {
-            diep("lseek");
+            // Size the file and zero the header of a previous run
+            if (ftruncate(fd, 0) == -1 || ftruncate(fd, SharedMemorySize) == -1) {
+                diep("ftruncate");
+            }
         }
-        this->pbuff = (membuff *)mmap(NULL, SharedMemorySize,
+        this->pbuff = (char *)mmap(NULL, SharedMemorySize,
                                 PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-        if (pbuff == (membuff*)MAP_FAILED) {
+        if (pbuff == (char*)MAP_FAILED) {
             diep("mmap");
         }
+        rings[ServerDest] = (MessageRing*) pbuff;
+        rings[ClientDest] = (MessageRing*) (pbuff + RingSize);
+        if (isServer) {
+            rings[ServerDest]->init(RingCapacity);
+            rings[ClientDest]->init(RingCapacity);
+        }
 
     }
     void bindServer(const char *port, EventHandler *pProcessor) {
@@ -96,15 +131,51 @@ public:
             INFO_OUT("Invalid context");
             return;
         }
-        this->pbuff->len  = len;
-        memcpy(this->pbuff->buffer, data, len);
-        this->pbuff->destId = (uint16_t)(long)(void*)p->getContext();
+        char *buf = acquireSend(p, len);
+        memcpy(buf, data, len);
+        commitSend(p, buf, len, isDataEnd);
+    }
+
+    // The lease is the record reserved in the destination ring
+    char *acquireSend(EventHandler *p, int len) {
+        MessageRing *ring = rings[(long)(void*)p->getContext()];
+        char *buf;
+        while (!(buf = ring->reserve(len))) {
+            // Only a peer process can drain the ring
+            if (server && client) {
+                ERROR_OUT("Message ring full, too many bytes in flight\n");
+                exit(1);
+            }
+        }
+        return buf;
+    }
+
+    void commitSend(EventHandler *p, char *buf, int len, bool isDataEnd) {
+        rings[(long)(void*)p->getContext()]->commit(len);
         // msync(this->pbuff, SharedMemorySize, MS_SYNC|MS_INVALIDATE);
+    }
+
+    // A handler receives from the ring of its own destination id
+    MessageRing *receiveRing(EventHandler *p) {
+        return rings[p == server ? ServerDest : ClientDest];
+    }
 
+    bool holdReceive(EventHandler *p) {
+        receiveRing(p)->hold();
+        return true;
+    }
+
+    void releaseReceive(EventHandler *p) {
+        receiveRing(p)->release();
     }
 
     void connectToServer(const char *address, const char *port,
             EventHandler *pProcessor) {
+        // A ring pair connects the server to exactly one client
+        if (client) {
+            ERROR_OUT("Only one client per server, use -m 1\n");
+            exit(1);
+        }
         this->client = pProcessor;
         setParent(pProcessor);
         createSharedMem(false);
@@ -115,6 +186,8 @@ public:
 };
 
 
+REGISTER_TRANSPORT("mmap", MMapLoopMain, "Memory mapped file rings, spinning", TransportTimers)
+
 #ifdef BUILDTEST
 MMapLoopMain mmaploopMain;
 EventMain *g_pmainProcessor = &mmaploopMain;
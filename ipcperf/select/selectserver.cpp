@@ -11,78 +11,120 @@
 #include <sys/select.h>
 #include <assert.h>
 #include "framework.h"
+#include "transport.h"
+#include "outqueue.h"
+#include "conntable.h"
+#include "timers.h"
+#include "sockstamps.h"
 
 const int max_buff = 32767;
 
 struct ClientState {
+    bool isOpen;
     EventHandler *handler;
+    // Receive buffer the handler holds, see holdReceive()
+    char *heldBuffer;
+    // Has a backlog of output, see WritableWatcher
+    bool isWatchingWrite;
 };
 
-class SelectMain: public EventMain {
+class SelectMain: public EventMain, public WritableWatcher {
 protected:
 
     int listener;
-    int dest;
     EventHandler *server;
-    EventHandler *client;
     bool loopEnd;
-    ClientState *pStates;
+    int acceptOptions;
+    OutputBatcher batcher;
+    // Connected and accepted sockets
+    ConnTable<ClientState> states;
+    RecvBuffers buffers;
+    TimerQueue timers;
+    SocketStamps stamps;
+    int fds[FD_SETSIZE];
+    int numfds;
 
 public:
 
+    SelectMain() : listener(-1), numfds(0) {
+    }
+
+    ~SelectMain() {
+        for (int i = 0; i < numfds; i++) {
+            close(fds[i]);
+        }
+        if (listener != -1) {
+            close(listener);
+        }
+    }
+
     void initialize() {
         loopEnd = false;
-        dest = listener = -1;
+        listener = -1;
+        server = NULL;
+        batcher.setWatcher(this);
+        numfds = 0;
+        acceptOptions = 0;
+
+    }
+
+    // select cannot watch a descriptor at or above FD_SETSIZE
+    bool addState(int fd, EventHandler *handler) {
+        if (fd >= FD_SETSIZE) {
+            ERROR_OUT("Socket %d is above FD_SETSIZE %d\n", fd, FD_SETSIZE);
+            return false;
+        }
+        ClientState *state = states.get(fd);
+        state->isOpen = true;
+        state->handler = handler;
+        state->isWatchingWrite = false;
+        fds[numfds++] = fd;
+        return true;
+    }
+    void watchWritable(int fd, bool isWatching) {
+        ClientState *state = states.find(fd);
+        if (state) {
+            state->isWatchingWrite = isWatching;
+        }
+    }
 
+    void closeSocket(int fd) {
+        INFO_OUT("Closing socket %d", fd);
+        batcher.forget(fd);
+        ClientState *state = states.find(fd);
+        EventHandler *pHandler = NULL;
+        if (state) {
+            buffers.release(&state->heldBuffer);
+            state->isOpen = false;
+            state->isWatchingWrite = false;
+            pHandler = state->handler;
+        }
+        close(fd);
+        buildfds();
+        notifyClosed(pHandler, (Context*) (long) fd);
     }
-    void buildfds(ClientState ** states, int *fds, int *pnumfds) {
-        int numfds = 0;
+
+    void buildfds() {
+        numfds = 0;
         for (int i = 0; i < FD_SETSIZE; i++) {
-            if (!states[i])
+            ClientState *state = states.find(i);
+            if (!state || !state->isOpen)
                 continue;
             fds[numfds++] = i;
         }
-        *pnumfds = numfds;
 
     }
 
     void process() {
-        int fds[FD_SETSIZE];
-        int numfds = 0;
-        struct ClientState *states[FD_SETSIZE];
         int maxfd;
         fd_set readset, writeset, exset;
-        for (int i = 0; i < FD_SETSIZE; ++i)
-            states[i] = NULL;
-
-        FD_ZERO(&readset);
-        FD_ZERO(&writeset);
-        FD_ZERO(&exset);
-        if (dest != -1) {
-            struct ClientState *state = (ClientState*) malloc(
-                    sizeof(struct ClientState));
-            assert(state);
-            state->handler = this->client;
-            states[dest] = state;
-        }
-        if (listener != -1) {
-            FD_SET(listener, &readset);
-        }
-        maxfd = listener;
-        for (int i = 0; i < FD_SETSIZE; i++) {
-            if (!states[i])
-                continue;
-            if (i > maxfd) {
-                maxfd = i;
-            }
-            FD_SET(i, &readset);
-        }
-        buildfds(states, fds, &numfds);
 
         INFO_OUT("Listening socket %d", listener);
-        INFO_OUT("Connected socket %d", dest);
 
         while (!loopEnd) {
+            // Full sockets get a backlog and a place in the write set
+            // instead of a wait
+            batcher.flushAll(false);
 
             FD_ZERO(&readset);
             FD_ZERO(&writeset);
@@ -97,31 +139,54 @@ public:
                     maxfd = fds[i];
                 }
                 FD_SET(fds[i], &readset);
+                if (states.find(fds[i])->isWatchingWrite) {
+                    FD_SET(fds[i], &writeset);
+                }
             }
             INFO_OUT("slecting %d sockets", numfds);
+            // The earliest timer bounds the wait, rounded up to whole usecs
+            timeval timeout;
+            timeval *pTimeout = NULL;
+            uint64_t deadline = timers.nextDeadline();
+            if (deadline != UINT64_MAX) {
+                uint64_t now = getMonotonicNanos();
+                uint64_t usec = deadline > now ? (deadline - now + 999) / 1000 : 0;
+                timeout.tv_sec = usec / 1000000;
+                timeout.tv_usec = usec % 1000000;
+                pTimeout = &timeout;
+            }
             int numResult;
-            if ((numResult = select(maxfd + 1, &readset, NULL, NULL, NULL))
+            if ((numResult = select(maxfd + 1, &readset, &writeset, NULL, pTimeout))
                     < 0) {
                 perror("select");
                 return;
             }
             INFO_OUT("selected %d sockets", numResult);
+            TRACE_EVENT(TraceWakeup, numResult);
+            LIVE_STAT(liveLoop(pLive, numResult));
+            if (pTimeout) {
+                timers.runExpired(getMonotonicNanos());
+            }
             if (listener != -1 && FD_ISSET(listener, &readset)) {
                 struct sockaddr_storage ss;
                 socklen_t slen = sizeof(ss);
+#ifdef SOCK_NONBLOCK
+                int fd = (acceptOptions & AcceptNonBlock)
+                        ? accept4(listener, (struct sockaddr*) &ss, &slen, SOCK_NONBLOCK)
+                        : accept(listener, (struct sockaddr*) &ss, &slen);
+#else
                 int fd = accept(listener, (struct sockaddr*) &ss, &slen);
+#endif
                 if (fd < 0) {
                     perror("accept");
-                } else if (fd > FD_SETSIZE) {
+                } else if (!addState(fd, server)) {
                     close(fd);
                 } else {
-                    fcntl(fd, F_SETFL, O_NONBLOCK);
-                    struct ClientState *state = (ClientState*) malloc(
-                            sizeof(struct ClientState));
-                    assert(state);
-                    state->handler = server;
-                    states[fd] = state;
-                    fds[numfds++] = fd;
+                    if (!(acceptOptions & AcceptNonBlock)) {
+                        fcntl(fd, F_SETFL, O_NONBLOCK);
+                    }
+                    setNoDelay(fd);
+                    stamps.addSocket(fd, false);
                     INFO_OUT("Accepted socket %d", fd);
 
                 }
@@ -134,66 +199,127 @@ public:
                     continue;
 
                 if (FD_ISSET(i, &readset)) {
-                    char buf[1024];
                     ssize_t result;
 
                     while (1) {
                         INFO_OUT("Reading socket %d", i);
-                        result = recv(i, buf, sizeof(buf), 0);
+                        result = stamps.recv(i, buffers.current, RecvBufferSize);
                         if (result < 0) {
-                            perror("recv");
+                            // Only send stamps were queued
+                            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                perror("recv");
+                            }
                             break;
                         } else if (result == 0) {
                             break;
                         }
-                        if (states[i] && states[i]->handler) {
-                            states[i]->handler->setContext((Context*) (long) i);
-                            states[i]->handler->process(buf, result, true);
+                        TRACE_EVENT(TraceRecv, result);
+                        ClientState *state = states.find(i);
+                        if (state && state->isOpen && state->handler) {
+                            state->handler->setContext((Context*) (long) i);
+                            state->handler->process(buffers.current, result, true);
+                            stamps.handled();
                         }
                         break;
 
                     }
-                    r = (result == 0) || (result < 0 && result != EAGAIN);
+                    r = (result == 0) || (result < 0 && errno != EAGAIN
+                            && errno != EWOULDBLOCK);
 
                 }
-                //if (r == 0 && FD_ISSET(i, &writeset)) {
-                //r = do_write(i, state[i]);
-                //}
+                if (r == 0 && FD_ISSET(i, &writeset)) {
+                    r = !batcher.drain(i);
+                }
                 if (r) {
-                    INFO_OUT("Closing socket %d", i);
-                    free(states[i]);
-                    states[i] = NULL;
-                    close(i);
-                    buildfds(states, fds, &numfds);
+                    closeSocket(i);
                 }
             }
 
         }
     }
 
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(getMonotonicNanos() + delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
+    }
+
     void cancelLoop() {
         loopEnd = true;
     }
 
-    void bindServer(const char *port, EventHandler *pProcessor) {
-        struct sockaddr_in sin = { 0 };
+    // accept4() and SO_REUSEPORT are not everywhere select() is
+    bool setAcceptOptions(int options) {
+#ifndef SOCK_NONBLOCK
+        if (options & AcceptNonBlock) {
+            return false;
+        }
+#endif
+#ifndef SO_REUSEPORT
+        if (options & AcceptReusePort) {
+            return false;
+        }
+#endif
+        acceptOptions = options;
+        return true;
+    }
+
+    void setBatching(int maxBytes, uint64_t maxDelayNanos) {
+        batcher.setPolicy(maxBytes, maxDelayNanos);
+    }
+
+    OutputStats *outputStats() {
+        return &batcher.stats;
+    }
+
+    bool setTimestamping(bool isEnabled) {
+        return stamps.setEnabled(isEnabled);
+    }
+
+    StampStats *stampStats() {
+        return stamps.enabled() ? &stamps.stats : NULL;
+    }
+
+    bool holdReceive(EventHandler *p) {
+        ClientState *state = states.find((int) (long) p->getContext());
+        return state && buffers.hold(&state->heldBuffer);
+    }
+
+    void releaseReceive(EventHandler *p) {
+        ClientState *state = states.find((int) (long) p->getContext());
+        if (state) {
+            buffers.release(&state->heldBuffer);
+        }
+    }
 
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = 0;
-        sin.sin_port = htons(atoi(port));
+    void bindServer(const char *port, EventHandler *pProcessor) {
+        sockaddr_storage ss;
+        socklen_t slen = makeAddress(NULL, port, &ss);
 
-        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (ss.ss_family == AF_UNIX) {
+            unlink(port);
+        }
+        listener = socket(ss.ss_family, SOCK_STREAM, 0);
         this->server = pProcessor;
         setParent(pProcessor);
         fcntl(listener, F_SETFL, O_NONBLOCK);
         int oneval = 1;
         setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &oneval, sizeof(oneval));
-        if (bind(listener, (struct sockaddr*) &sin, sizeof(sin)) < 0) {
+#ifdef SO_REUSEPORT
+        if ((acceptOptions & AcceptReusePort) && setsockopt(listener,
+                SOL_SOCKET, SO_REUSEPORT, &oneval, sizeof(oneval)) == -1) {
+            perror("SO_REUSEPORT");
+        }
+#endif
+        if (bind(listener, (struct sockaddr*) &ss, slen) < 0) {
             perror("bind");
             return;
         }
         INFO_OUT("Bound to port %s", port);
-        if (listen(listener, 16) < 0) {
+        // Fan-in runs connect hundreds of clients before the loop accepts
+        if (listen(listener, SOMAXCONN) < 0) {
             perror("listen");
             return;
         }
@@ -205,23 +331,29 @@ public:
             INFO_OUT("Invalid context");
             return;
         }
-        if (::send((int) (long) p->getContext(), data, len, 0) == -1) {
-            perror("send");
-        }
+        int fd = (int) (long) p->getContext();
+        stamps.beforeSend(fd);
+        batcher.send(fd, data, len, NULL, 0, false);
+        stamps.afterSend(fd);
         INFO_OUT("Done sending");
 
     }
 
+    void disconnect(EventHandler *p) {
+        int fd = (int) (long) p->getContext();
+        ClientState *state = states.find(fd);
+        if (state && state->isOpen) {
+            closeSocket(fd);
+        }
+    }
+
     void connectToServer(const char *address, const char *port,
             EventHandler *pProcessor) {
-        sockaddr_in sin = { 0 };
-
-        sin.sin_family = AF_INET;
-        sin.sin_port = htons(atoi(port));
-        inet_pton(AF_INET, address, &(sin.sin_addr));
-        dest = socket(AF_INET, SOCK_STREAM, 0);
-        this->client = pProcessor;
-        if (connect(dest, (sockaddr*) &sin, sizeof(sin)) < 0) {
+        sockaddr_storage ss;
+        socklen_t slen = makeAddress(address, port, &ss);
+
+        int dest = socket(ss.ss_family, SOCK_STREAM, 0);
+        if (connect(dest, (sockaddr*) &ss, slen) < 0) {
             perror("connect");
             exit(1);
             return;
@@ -229,6 +361,11 @@ public:
         setParent(pProcessor);
         pProcessor->setContext((Context*) (long) dest);
         fcntl(dest, F_SETFL, O_NONBLOCK);
+        setNoDelay(dest);
+        stamps.addSocket(dest, true);
+        if (!addState(dest, pProcessor)) {
+            exit(1);
+        }
         pProcessor->enable();
 
         // Investigate: should set reuse address ?
@@ -238,6 +375,8 @@ public:
 };
 
 
+REGISTER_TRANSPORT("select", SelectMain, "TCP with select", TransportTimers)
+
 #ifdef BUILDTEST
 SelectMain selectMain;
 EventMain *g_pmainProcessor = &selectMain;
@@ -9,35 +9,36 @@
 #include <sys/fcntl.h>
 #include <semaphore.h>
 #include "framework.h"
+#include "transport.h"
+#include "shmring.h"
+#include "timers.h"
 //
 // Server and client communicating though copying
-// data using shared memory and synchronizing using semaphore
+// data using shared memory and synchronizing using semaphore. Each
+// direction is a message ring and its semaphore counts the messages in it.
 //
 
-const int SharedMemorySize = 512;
+const size_t RingSize = MessageRing::totalSize(RingCapacity);
+const size_t SharedMemorySize = 2 * RingSize;
 
 const int ClientDest = 1;
 const int ServerDest = 2;
-const char *ClientSemName = "/semclient";
-const char *ServerSemName = "/semserver";
+const char * const ClientSemName = "/semclient";
+const char * const ServerSemName = "/semserver";
 
-struct membuff{
-    uint16_t destId;
-    uint16_t len;
-    char buffer[SharedMemorySize-2*sizeof(uint16_t)];
-} __attribute__((packed));
 
-
-class ShMemLoopMain: public EventMain {
+class ShMemSemLoopMain: public EventMain {
 protected:
 
-    membuff *pbuff;
+    char *pbuff;
+    // Indexed by destination id
+    MessageRing *rings[3];
     EventHandler *server;
     EventHandler *client;
     sem_t *semServer;
     sem_t *semClient;
-    sem_t *semNext;
     bool loopEnd;
+    TimerQueue timers;
     key_t key;
     int shmemid;
 
@@ -46,52 +47,125 @@ public:
     void initialize() {
         loopEnd = false;
         pbuff = NULL;
+        rings[0] = rings[ClientDest] = rings[ServerDest] = NULL;
         server = client = NULL;
-        semServer = semClient = semNext = NULL;
+        semServer = semClient = NULL;
 
     }
+
+    void dispatch(MessageRing *ring, EventHandler *dest) {
+        char *data;
+        uint32_t len;
+        if (!ring->peek(&data, &len)) {
+            ERROR_OUT("Invalid buffer");
+            exit(1);
+        }
+        TRACE_EVENT(TraceRecv, len);
+        dest->process(data, len, true);
+        ring->release();
+    }
+
     void process() {
 
         while (!loopEnd) {
-        	if (sem_wait(semNext) == -1) {
+            timers.runDue();
+            if (server && client) {
+                // Both ends are in this process. Blocking on one direction
+                // would deadlock while the other one holds the messages.
+                if (sem_trywait(semServer) == 0) {
+                    dispatch(rings[ServerDest], server);
+                }
+                if (sem_trywait(semClient) == 0) {
+                    dispatch(rings[ClientDest], client);
+                }
+                continue;
+            }
+            sem_t *semNext = server ? semServer : semClient;
+        	if (waitSem(semNext) == -1) {
+        	    if (errno == EINTR || errno == ETIMEDOUT || errno == EAGAIN) {
+        	        continue;
+        	    }
         		diep("sem_wait");
         	}
-            if (!pbuff || !pbuff->len) {
-                ERROR_OUT("Invalid buffer");
-                exit(1);
-            }
-            EventHandler *dest = (pbuff->destId == ClientDest) ? client : server;
+            TRACE_EVENT(TraceWakeup, 1);
+            LIVE_STAT(liveLoop(pLive, 1));
+            EventHandler *dest = server ? server : client;
             if (dest == NULL) {
             	ERROR_OUT("Invalid dest");
             	exit(1);
             }
-            dest->process(pbuff->buffer, pbuff->len, true);
+            dispatch(rings[server ? ServerDest : ClientDest], dest);
         }
 
     }
 
+    // Waits for a message, or until the next timer is due
+    int waitSem(sem_t *sem) {
+        int64_t nanos = timers.nanosToNext();
+        if (nanos < 0) {
+            return sem_wait(sem);
+        }
+#ifdef __APPLE__
+        // No sem_timedwait, poll while a timer is pending
+        return sem_trywait(sem);
+#else
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t at = deadline.tv_nsec + nanos;
+        deadline.tv_sec += at / 1000000000;
+        deadline.tv_nsec = at % 1000000000;
+        return sem_timedwait(sem, &deadline);
+#endif
+    }
+
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(getMonotonicNanos() + delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
+    }
+
     void cancelLoop() {
         loopEnd = true;
     }
 
-    void createSharedMem() {
+    void createSharedMem(bool isServer) {
+        if (pbuff) {
+            return;
+        }
         if ((key = ftok("/tmp", 'R')) == -1) {
             diep("ftok");
         }
-        if ((shmemid = shmget(key, SharedMemorySize, 0644 | IPC_CREAT)) == -1) {
+        shmemid = shmget(key, SharedMemorySize, 0644 | IPC_CREAT);
+        if (shmemid == -1 && errno == EINVAL) {
+            // Segment left over by a build with a smaller buffer, recreate it
+            int oldid = shmget(key, 0, 0644);
+            if (oldid != -1) {
+                shmctl(oldid, IPC_RMID, NULL);
+            }
+            shmemid = shmget(key, SharedMemorySize, 0644 | IPC_CREAT);
+        }
+        if (shmemid == -1) {
             diep("shmemget");
         }
-        pbuff = (membuff *)shmat(shmemid, (void*)0, 0);
-        if (pbuff == (membuff*)-1) {
+        pbuff = (char *)shmat(shmemid, (void*)0, 0);
+        if (pbuff == (char*)-1) {
             diep("shmat");
         }
+        rings[ServerDest] = (MessageRing*) pbuff;
+        rings[ClientDest] = (MessageRing*) (pbuff + RingSize);
+        if (isServer) {
+            rings[ServerDest]->init(RingCapacity);
+            rings[ClientDest]->init(RingCapacity);
+            // Drop counts left by an earlier run
+            sem_unlink(ServerSemName);
+            sem_unlink(ClientSemName);
+        }
         semServer = sem_open(ServerSemName, O_CREAT, 0644, 0);
         semClient = sem_open(ClientSemName, O_CREAT, 0644, 0);
-        if (this->server) {
-        	semNext = semServer;
-        }
-        else  {
-        	semNext = semClient;
+        if (semServer == SEM_FAILED || semClient == SEM_FAILED) {
+            diep("sem_open");
         }
 
     }
@@ -99,7 +173,7 @@ public:
         this->server = pProcessor;
         setParent(pProcessor);
         pProcessor->setContext((Context*) (void*) ClientDest);
-        createSharedMem();
+        createSharedMem(true);
     }
 
     void send(EventHandler *p, const char *data, int len, bool isDataEnd) {
@@ -107,36 +181,45 @@ public:
             INFO_OUT("Invalid context");
             return;
         }
-        this->pbuff->len  = len;
-        memcpy(this->pbuff->buffer, data, len);
-        this->pbuff->destId = (uint16_t)(long)(void*)p->getContext();
-        sem_t* semDest =  (p == this->server) ? semClient : semServer;
-        if (sem_post(semDest) == -1) {
-        	diep("sem_post");
-        }
-        if (semDest == semServer) {
-        	if (this->server) {
-        		semNext = semServer;
-        	}
-        	else {
-        		semNext = semClient;
-        	}
-        } else {
-        	if (this->client) {
-        		semNext = semClient;
-        	} else {
-        		semNext = semServer;
-        	}
+        char *buf = acquireSend(p, len);
+        memcpy(buf, data, len);
+        commitSend(p, buf, len, isDataEnd);
+    }
 
+    // The lease is the record reserved in the destination ring. Received
+    // messages are not held, the semaphore would count them twice.
+    char *acquireSend(EventHandler *p, int len) {
+        MessageRing *ring = rings[(long)(void*)p->getContext()];
+        char *buf;
+        while (!(buf = ring->reserve(len))) {
+            // Only a peer process can drain the ring
+            if (server && client) {
+                ERROR_OUT("Message ring full, too many bytes in flight\n");
+                exit(1);
+            }
         }
+        return buf;
+    }
 
+    void commitSend(EventHandler *p, char *buf, int len, bool isDataEnd) {
+        long destId = (long)(void*)p->getContext();
+        rings[destId]->commit(len);
+        sem_t* semDest = (destId == ClientDest) ? semClient : semServer;
+        if (sem_post(semDest) == -1) {
+        	diep("sem_post");
+        }
     }
 
     void connectToServer(const char *address, const char *port,
             EventHandler *pProcessor) {
+        // A ring pair connects the server to exactly one client
+        if (client) {
+            ERROR_OUT("Only one client per server, use -m 1\n");
+            exit(1);
+        }
         this->client = pProcessor;
         setParent(pProcessor);
-        createSharedMem();
+        createSharedMem(false);
         // Put destination  as context
         pProcessor->setContext((Context*) (void*) ServerDest);
         pProcessor->enable();
@@ -144,7 +227,9 @@ public:
 };
 
 
+REGISTER_TRANSPORT("shmem-sem", ShMemSemLoopMain, "SysV shared memory rings with POSIX semaphores", TransportTimers)
+
 #ifdef BUILDTEST
-ShMemLoopMain shMemloopMain;
-EventMain *g_pmainProcessor = &shMemloopMain;
+ShMemSemLoopMain shMemSemloopMain;
+EventMain *g_pmainProcessor = &shMemSemloopMain;
 #endif
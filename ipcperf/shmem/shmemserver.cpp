@@ -7,31 +7,33 @@
 #include <assert.h>
 #include <sys/shm.h>
 #include "framework.h"
+#include "transport.h"
+#include "shmring.h"
+#include "timers.h"
 //
 // Server and client communicating though copying
-// data using shared memory.
+// data using shared memory. Each direction is a message ring, so several
+// messages can be in flight.
 //
 
-const int SharedMemorySize = 512;
+const size_t RingSize = MessageRing::totalSize(RingCapacity);
+const size_t SharedMemorySize = 2 * RingSize;
 
 const int ClientDest = 1;
 const int ServerDest = 2;
 
 
-struct membuff{
-    uint16_t destId;
-    uint16_t len;
-    char buffer[SharedMemorySize-2*sizeof(uint16_t)];
-} __attribute__((packed));
-
-
 class ShMemLoopMain: public EventMain {
 protected:
 
-    membuff *pbuff;
+    char *pbuff;
+    // Indexed by destination id
+    MessageRing *rings[3];
     EventHandler *server;
     EventHandler *client;
     bool loopEnd;
+    // Polled every turn of the loop
+    TimerQueue timers;
     key_t key;
     int shmemid;
 
@@ -40,46 +42,90 @@ public:
     void initialize() {
         loopEnd = false;
         pbuff = NULL;
+        rings[0] = rings[ClientDest] = rings[ServerDest] = NULL;
         server = client = NULL;
 
     }
+
+    // Returns whether there was a message
+    bool dispatch(MessageRing *ring, EventHandler *dest) {
+        char *data;
+        uint32_t len;
+        if (ring->isHeld() || !ring->peek(&data, &len)) {
+            return false;
+        }
+        TRACE_EVENT(TraceRecv, len);
+        dest->process(data, len, true);
+        if (!ring->isHeld()) {
+            ring->release();
+        }
+        return true;
+    }
+
     void process() {
 
         while (!loopEnd) {
-            if (!pbuff || !pbuff->len) {
-                continue;
+            timers.runDue();
+            int numDispatched = 0;
+            if (server) {
+                numDispatched += dispatch(rings[ServerDest], server);
             }
-            EventHandler *dest = (pbuff->destId == ClientDest) ? client : server;
-            if (dest == NULL) {
-                continue;
+            if (client) {
+                numDispatched += dispatch(rings[ClientDest], client);
             }
-            dest->process(pbuff->buffer, pbuff->len, true);
+            LIVE_STAT(liveLoop(pLive, numDispatched));
         }
 
     }
 
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(getMonotonicNanos() + delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
+    }
+
     void cancelLoop() {
         loopEnd = true;
     }
 
-    void createSharedMem() {
+    void createSharedMem(bool isServer) {
+        if (pbuff) {
+            return;
+        }
         if ((key = ftok("/tmp", 'R')) == -1) {
             diep("ftok");
         }
-        if ((shmemid = shmget(key, SharedMemorySize, 0644 | IPC_CREAT)) == -1) {
+        shmemid = shmget(key, SharedMemorySize, 0644 | IPC_CREAT);
+        if (shmemid == -1 && errno == EINVAL) {
+            // Segment left over by a build with a smaller buffer, recreate it
+            int oldid = shmget(key, 0, 0644);
+            if (oldid != -1) {
+                shmctl(oldid, IPC_RMID, NULL);
+            }
+            shmemid = shmget(key, SharedMemorySize, 0644 | IPC_CREAT);
+        }
+        if (shmemid == -1) {
             diep("shmemget");
         }
-        pbuff = (membuff *)shmat(shmemid, (void*)0, 0);
-        if (pbuff == (membuff*)-1) {
+        pbuff = (char *)shmat(shmemid, (void*)0, 0);
+        if (pbuff == (char*)-1) {
             diep("shmat");
         }
+        rings[ServerDest] = (MessageRing*) pbuff;
+        rings[ClientDest] = (MessageRing*) (pbuff + RingSize);
+        if (isServer) {
+            rings[ServerDest]->init(RingCapacity);
+            rings[ClientDest]->init(RingCapacity);
+        }
 
     }
     void bindServer(const char *port, EventHandler *pProcessor) {
         this->server = pProcessor;
         setParent(pProcessor);
         pProcessor->setContext((Context*) (void*) ClientDest);
-        createSharedMem();
+        createSharedMem(true);
     }
 
     void send(EventHandler *p, const char *data, int len, bool isDataEnd) {
@@ -87,17 +133,53 @@ public:
             INFO_OUT("Invalid context");
             return;
         }
-        this->pbuff->len  = len;
-        memcpy(this->pbuff->buffer, data, len);
-        this->pbuff->destId = (uint16_t)(long)(void*)p->getContext();
+        char *buf = acquireSend(p, len);
+        memcpy(buf, data, len);
+        commitSend(p, buf, len, isDataEnd);
+    }
+
+    // The lease is the record reserved in the destination ring
+    char *acquireSend(EventHandler *p, int len) {
+        MessageRing *ring = rings[(long)(void*)p->getContext()];
+        char *buf;
+        while (!(buf = ring->reserve(len))) {
+            // Only a peer process can drain the ring
+            if (server && client) {
+                ERROR_OUT("Message ring full, too many bytes in flight\n");
+                exit(1);
+            }
+        }
+        return buf;
+    }
+
+    void commitSend(EventHandler *p, char *buf, int len, bool isDataEnd) {
+        rings[(long)(void*)p->getContext()]->commit(len);
+    }
+
+    // A handler receives from the ring of its own destination id
+    MessageRing *receiveRing(EventHandler *p) {
+        return rings[p == server ? ServerDest : ClientDest];
+    }
 
+    bool holdReceive(EventHandler *p) {
+        receiveRing(p)->hold();
+        return true;
+    }
+
+    void releaseReceive(EventHandler *p) {
+        receiveRing(p)->release();
     }
 
     void connectToServer(const char *address, const char *port,
             EventHandler *pProcessor) {
+        // A ring pair connects the server to exactly one client
+        if (client) {
+            ERROR_OUT("Only one client per server, use -m 1\n");
+            exit(1);
+        }
         this->client = pProcessor;
         setParent(pProcessor);
-        createSharedMem();
+        createSharedMem(false);
         // Put destination  as context
         pProcessor->setContext((Context*) (void*) ServerDest);
         pProcessor->enable();
@@ -105,6 +187,8 @@ public:
 };
 
 
+REGISTER_TRANSPORT("shmem", ShMemLoopMain, "SysV shared memory rings, spinning", TransportTimers)
+
 #ifdef BUILDTEST
 ShMemLoopMain shMemloopMain;
 EventMain *g_pmainProcessor = &shMemloopMain;
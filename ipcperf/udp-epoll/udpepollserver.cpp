@@ -11,23 +11,41 @@
 #include <sys/epoll.h>
 #include <assert.h>
 #include "framework.h"
+#include "transport.h"
+#include "outqueue.h"
+#include "conntable.h"
+#include "timers.h"
+#include "sockstamps.h"
 
 // Main event loop
 class UdpEpollMain: public EventMain {
 protected:
 
+    int efd;
     int listener;
-    int dest;
     EventHandler *server;
-    EventHandler *client;
     bool loopEnd;
+    OutputBatcher batcher;
 
 public:
 
     void initialize() {
         loopEnd = false;
-        dest = listener = -1;
+        listener = -1;
+        server = NULL;
+        efd = epoll_create1(0);
+        if (efd == -1) {
+            perror("epoll_create");
+            exit(1);
+        }
+        addFd(timers.create(), NULL);
+
+    }
 
+    ~UdpEpollMain() {
+        if (listener != -1) {
+            close(listener);
+        }
     }
 
     struct MyContext {
@@ -35,90 +53,159 @@ public:
         sockaddr_in dest;
     };
 
+    // Lives as long as the socket, so it is also the context the handler
+    // replies through: the peer of the last datagram read from it.
     struct MyEventData {
         int fd;
         EventHandler *pHandler;
+        MyContext context;
+        // Receive buffer the handler holds, see holdReceive()
+        char *heldBuffer;
     };
+    ConnTable<MyEventData> sockets;
+    RecvBuffers buffers;
+    TimerFd timers;
+    SocketStamps stamps;
 #define MAXEVENTS 64
 
-    void process() {
-        int efd;
+    MyEventData *addFd(int fd, EventHandler *pHandler) {
         epoll_event event = {0};
-        epoll_event events[MAXEVENTS];
-
-        efd = epoll_create1(0);
-
-        if (efd == -1) {
-            perror("epoll_create");
+        MyEventData *data = sockets.get(fd);
+        data->fd = fd;
+        data->pHandler = pHandler;
+        data->context.fd = fd;
+        event.data.ptr = data;
+        event.events = EPOLLIN;
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("epoll_ctl");
             exit(1);
         }
-        if (this->listener != -1) {
-            MyEventData data = {listener, server};
-            event.data.ptr = new MyEventData(data);
-            event.events = EPOLLIN;
-            if (epoll_ctl(efd, EPOLL_CTL_ADD, listener, &event) == -1) {
-                perror("epoll_ctl");
-                exit(1);
-            }
-        }
-        if (this->dest != -1) {
-            MyEventData data = {dest, client};
-            event.data.ptr = new MyEventData(data);
-            event.events = EPOLLIN;
-            if (epoll_ctl(efd, EPOLL_CTL_ADD, dest, &event) == -1) {
-                perror("epoll_ctl");
-                exit(1);
-            }
-        }
+        return data;
+    }
+
+    void closeFd(MyEventData *data) {
+        batcher.forget(data->fd);
+        buffers.release(&data->heldBuffer);
+        EventHandler *pHandler = data->pHandler;
+        data->pHandler = NULL;
+        close(data->fd);
+        notifyClosed(pHandler, (Context*) &data->context);
+    }
+
+    void process() {
+        epoll_event events[MAXEVENTS];
 
         while (!loopEnd) {
+            batcher.flushAll(false);
             int nevents = epoll_wait(efd, events, MAXEVENTS, -1);
+            if (nevents == -1 && errno != EINTR) {
+                perror("epoll_wait");
+                exit(1);
+            }
+            TRACE_EVENT(TraceWakeup, nevents > 0 ? nevents : 0);
+            LIVE_STAT(liveLoop(pLive, nevents > 0 ? nevents : 0));
             for (int i=0; i < nevents; i++) {
                 epoll_event *pev = &events[i];
                 MyEventData *data = (MyEventData*)pev->data.ptr;
-                if ((pev->events & EPOLLERR) ||
-                       (pev->events & EPOLLHUP) ||
-                       !(pev->events & EPOLLIN)) {
+                uint32_t flags = pev->events;
+                // Queued send stamps raise EPOLLERR too
+                if ((flags & EPOLLERR) && stamps.drainErrors(data->fd)) {
+                    flags &= ~EPOLLERR;
+                    if (!(flags & (EPOLLIN | EPOLLHUP))) {
+                        continue;
+                    }
+                }
+                if ((flags & EPOLLERR) ||
+                       (flags & EPOLLHUP) ||
+                       !(flags & EPOLLIN)) {
                     fprintf(stderr, "epoll error\n");
-                    close(data->fd);
-                    delete data;
+                    closeFd(data);
                     continue;
                 }
-                INFO_OUT("Reading socket %d", i);
-                char buf[1024];
-                struct sockaddr_in si_from;
-                unsigned int slen = sizeof(si_from);
-                ssize_t  result = recvfrom(data->fd, buf, sizeof(buf), 0,
-                                           (sockaddr*)&si_from, &slen );
-                INFO_OUT("Done reading socket");
-                if (result < 0) {
-                	INFO_OUT("Read error");
-                    perror("recv");
-                    close(data->fd);
-                    delete data;
+                if (timers.getFd() == data->fd) {
+                    timers.run();
                     continue;
-                } else if (result == 0) {
-                	INFO_OUT("Closing socket %d", i);
-                    close(data->fd);
-                    delete data;
-                    break;
                 }
-                if (data->pHandler) {
-                	INFO_OUT("Before process");
-                    MyContext fromcontext = {data->fd, si_from};
-                    data->pHandler->setContext((Context*) &fromcontext);
-                    data->pHandler->process(buf, result, true);
+                INFO_OUT("Reading socket %d", i);
+                // A batching loop reads on until the socket is empty, so the
+                // replies to a burst of datagrams go out in one flush
+                int maxReads = batcher.isBatching() ? MAXEVENTS : 1;
+                for (int n = 0; n < maxReads && !loopEnd; n++) {
+                    struct sockaddr_in si_from;
+                    socklen_t slen = sizeof(si_from);
+                    ssize_t  result = stamps.recv(data->fd, buffers.current,
+                            RecvBufferSize, (sockaddr*) &si_from, &slen);
+                    INFO_OUT("Done reading socket");
+                    if (result < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                            break;
+                        }
+                        INFO_OUT("Read error");
+                        perror("recv");
+                        closeFd(data);
+                        break;
+                    }
+                    TRACE_EVENT(TraceRecv, result);
+                    if (data->pHandler) {
+                        INFO_OUT("Before process");
+                        data->context.dest = si_from;
+                        data->pHandler->setContext((Context*) &data->context);
+                        data->pHandler->process(buffers.current, result, true);
+                        stamps.handled();
+                    }
                 }
 
             }
         }
-        close(listener);
+    }
+
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
     }
 
     void cancelLoop() {
         loopEnd = true;
     }
 
+    void setBatching(int maxBytes, uint64_t maxDelayNanos) {
+        batcher.setPolicy(maxBytes, maxDelayNanos);
+    }
+
+    OutputStats *outputStats() {
+        return &batcher.stats;
+    }
+
+    bool setTimestamping(bool isEnabled) {
+        return stamps.setEnabled(isEnabled);
+    }
+
+    StampStats *stampStats() {
+        return stamps.enabled() ? &stamps.stats : NULL;
+    }
+
+    bool holdReceive(EventHandler *p) {
+        MyContext *pContext = (MyContext*) p->getContext();
+        MyEventData *data = pContext ? sockets.find(pContext->fd) : NULL;
+        return data && buffers.hold(&data->heldBuffer);
+    }
+
+    void releaseReceive(EventHandler *p) {
+        MyContext *pContext = (MyContext*) p->getContext();
+        MyEventData *data = pContext ? sockets.find(pContext->fd) : NULL;
+        if (data) {
+            buffers.release(&data->heldBuffer);
+        }
+    }
+
+    // Largest UDP payload over IPv4
+    int maxMessageSize() {
+        return 65507;
+    }
+
     void bindServer(const char *port, EventHandler *pProcessor) {
         struct sockaddr_in sin = { 0 };
 
@@ -136,6 +223,8 @@ public:
             perror("bind");
             return;
         }
+        stamps.addSocket(listener, false);
+        addFd(listener, pProcessor);
         INFO_OUT("Bound to port %s", port);
     }
 
@@ -146,30 +235,30 @@ public:
             return;
         }
         INFO_OUT("Sending data to %d", pContext->fd);
-        if (::sendto(pContext->fd, data, len, 0, (sockaddr*)&pContext->dest,
-                      sizeof(pContext->dest)) == -1) {
-            perror("send");
-        }
+        stamps.beforeSend(pContext->fd);
+        batcher.send(pContext->fd, data, len, (sockaddr*) &pContext->dest,
+                sizeof(pContext->dest), false);
+        stamps.afterSend(pContext->fd);
         INFO_OUT("Done sending");
 
     }
 
+    // Every client has its own socket, so the server tells the clients
+    // apart by their source port.
     void connectToServer(const char *address, const char *port,
             EventHandler *pProcessor) {
         sockaddr_in sin = { 0 };
-        MyContext context;
 
         sin.sin_family = AF_INET;
         sin.sin_port = htons(atoi(port));
         inet_pton(AF_INET, address, &(sin.sin_addr));
         int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-        context.dest = sin;
-        context.fd = sockfd;
-        this->client = pProcessor;
-        this->dest = sockfd;
         setParent(pProcessor);
-        pProcessor->setContext((Context*) (void*) &context);
-        fcntl(dest, F_SETFL, O_NONBLOCK);
+        fcntl(sockfd, F_SETFL, O_NONBLOCK);
+        stamps.addSocket(sockfd, true);
+        MyEventData *data = addFd(sockfd, pProcessor);
+        data->context.dest = sin;
+        pProcessor->setContext((Context*) (void*) &data->context);
         pProcessor->enable();
 
     }
@@ -177,6 +266,8 @@ public:
 };
 
 
+REGISTER_TRANSPORT("udp-epoll", UdpEpollMain, "UDP with epoll (Linux)", TransportTimers)
+
 #ifdef BUILDTEST
 UdpEpollMain epollMain;
 EventMain *g_pmainProcessor = &epollMain;
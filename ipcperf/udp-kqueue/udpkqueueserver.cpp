@@ -5,62 +5,90 @@
 #include <sys/event.h>
 #include <assert.h>
 #include "framework.h"
+#include "transport.h"
+#include "outqueue.h"
+#include "timers.h"
 
 // Main event loop
 class UdpKQueueMain: public EventMain {
 protected:
 
+    int kqfd;
     int listener;
-    int dest;
     EventHandler *server;
-    EventHandler *client;
     bool loopEnd;
+    char *recvBuffer;
+    OutputBatcher batcher;
+    TimerQueue timers;
 
 public:
 
     void initialize() {
         loopEnd = false;
-        dest = listener = -1;
+        listener = -1;
+        server = NULL;
+        recvBuffer = new char[RecvBufferSize];
+        kqfd = kqueue();
+        if(kqfd == -1) {
+            diep("kqueue");
+        }
+
+    }
 
+    ~UdpKQueueMain() {
+        if (listener != -1) {
+            close(listener);
+        }
+        delete[] recvBuffer;
     }
 
     struct MyContext {
         int fd;
-        sockaddr_in *pdest;
+        sockaddr_in dest;
+    };
+
+    // Lives as long as the socket, so it is also the context the handler
+    // replies through: the peer of the last datagram read from it.
+    struct MyEventData {
+        EventHandler *pHandler;
+        MyContext context;
     };
 
 #define MAXEVENTS 64
 
+    MyEventData *addFd(int fd, EventHandler *pHandler) {
+        struct kevent event;
+        MyEventData *data = new MyEventData();
+        data->pHandler = pHandler;
+        data->context.fd = fd;
+        EV_SET(&event, fd, EVFILT_READ, EV_ADD, 0, 0, data);
+        if(kevent(kqfd, &event, 1, NULL, 0, NULL) == -1) {
+            diep("kevent");
+        }
+        return data;
+    }
+
     void process() {
-        int kqfd;
-        struct kevent event = {0};
         struct kevent events[MAXEVENTS];
 
-        kqfd = kqueue();
-        if(kqfd == -1) {
-            diep("kqueue");
-        }
-        
-        if (this->listener != -1) {
-            EV_SET(&event, this->listener, EVFILT_READ, EV_ADD, 0, 0, server);
-            if(kevent(kqfd, &event, 1, NULL, 0, NULL) == -1) {
-                diep("kevent");
-            }
-            INFO_OUT("Added listenner");
-        }
-        if (this->dest != -1) {
-            EV_SET(&event, this->dest, EVFILT_READ, EV_ADD, 0, 0, client);
-            if(kevent(kqfd, &event, 1, NULL, 0, NULL) == -1) {
-                diep("kevent");
-            }
-        }
-
         while (!loopEnd) {
-            int nevents = kevent(kqfd, NULL, 0, events, MAXEVENTS, NULL);
+            batcher.flushAll(false);
+            // Wait no longer than the next timer
+            int64_t nanos = timers.nanosToNext();
+            timespec timeout = {(time_t) (nanos / 1000000000),
+                    (long) (nanos % 1000000000)};
+            int nevents = kevent(kqfd, NULL, 0, events, MAXEVENTS,
+                    nanos < 0 ? NULL : &timeout);
             INFO_OUT("Got event");
             if (nevents < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
                 diep("kevent main");
             }
+            TRACE_EVENT(TraceWakeup, nevents);
+            LIVE_STAT(liveLoop(pLive, nevents));
+            timers.runDue();
             for (int i=0; i < nevents; i++) {
                 struct kevent *pev = &events[i];
                 
@@ -70,36 +98,59 @@ public:
                 }
 
                 INFO_OUT("Reading socket %d", i);
-                char buf[1024];
+                MyEventData *data = (MyEventData*)pev->udata;
                 struct sockaddr_in si_from;
                 unsigned int slen = sizeof(si_from);
-                ssize_t  result = recvfrom(pev->ident, buf, sizeof(buf), 0,
+                ssize_t  result = recvfrom(pev->ident, recvBuffer, RecvBufferSize, 0,
                                            (sockaddr*)&si_from, &slen );
                 if (result < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        continue;
+                    }
                     perror("recv");
+                    batcher.forget(pev->ident);
                     close(pev->ident);
+                    notifyClosed(data->pHandler, (Context*) &data->context);
+                    delete data;
                     continue;
-                } else if (result == 0) {
-                    close(pev->ident);
-                    break;
                 }
-                if (pev->udata) {
+                TRACE_EVENT(TraceRecv, result);
+                if (data->pHandler) {
                     INFO_OUT("Before process");
-                    MyContext fromcontext = {pev->ident, &si_from};
-                    EventHandler *pHandler = (EventHandler*)pev->udata;
-                    pHandler->setContext((Context*) &fromcontext);
-                    pHandler->process(buf, result, true);
+                    data->context.dest = si_from;
+                    data->pHandler->setContext((Context*) &data->context);
+                    data->pHandler->process(recvBuffer, result, true);
                 }
                 
             }
         }
-        close(listener);
+    }
+
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(getMonotonicNanos() + delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
     }
 
     void cancelLoop() {
         loopEnd = true;
     }
 
+    void setBatching(int maxBytes, uint64_t maxDelayNanos) {
+        batcher.setPolicy(maxBytes, maxDelayNanos);
+    }
+
+    OutputStats *outputStats() {
+        return &batcher.stats;
+    }
+
+    // Largest UDP payload over IPv4
+    int maxMessageSize() {
+        return 65507;
+    }
+
     void bindServer(const char *port, EventHandler *pProcessor) {
         struct sockaddr_in sin = { 0 };
 
@@ -117,6 +168,8 @@ public:
             perror("bind");
             return;
         }
+        addFd(listener, pProcessor);
+        INFO_OUT("Added listenner");
         INFO_OUT("Bound to port %s", port);
     }
 
@@ -127,30 +180,27 @@ public:
             return;
         }
         INFO_OUT("Sending data to %d", pContext->fd);
-        if (::sendto(pContext->fd, data, len, 0, (sockaddr*)pContext->pdest,
-                      sizeof(*pContext->pdest)) == -1) {
-            perror("send");
-        }
+        batcher.send(pContext->fd, data, len, (sockaddr*) &pContext->dest,
+                sizeof(pContext->dest), false);
         INFO_OUT("Done sending");
 
     }
 
+    // Every client has its own socket, so the server tells the clients
+    // apart by their source port.
     void connectToServer(const char *address, const char *port,
             EventHandler *pProcessor) {
         sockaddr_in sin = { 0 };
-        MyContext context;
 
         sin.sin_family = AF_INET;
         sin.sin_port = htons(atoi(port));
         inet_pton(AF_INET, address, &(sin.sin_addr));
         int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-        context.pdest = &sin;
-        context.fd = sockfd;
-        this->client = pProcessor;
-        this->dest = sockfd;
         setParent(pProcessor);
-        pProcessor->setContext((Context*) (void*) &context);
-        fcntl(dest, F_SETFL, O_NONBLOCK);
+        fcntl(sockfd, F_SETFL, O_NONBLOCK);
+        MyEventData *data = addFd(sockfd, pProcessor);
+        data->context.dest = sin;
+        pProcessor->setContext((Context*) (void*) &data->context);
         pProcessor->enable();
 
     }
@@ -158,6 +208,8 @@ public:
 };
 
 
+REGISTER_TRANSPORT("udp-kqueue", UdpKQueueMain, "UDP with kqueue (Mac OSX)", TransportTimers)
+
 #ifdef BUILDTEST
 UdpKQueueMain udpkqueueMain;
 EventMain *g_pmainProcessor = &udpkqueueMain;
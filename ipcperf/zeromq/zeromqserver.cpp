@@ -6,43 +6,56 @@
 #include <iostream>
 #include <sys/time.h>
 #include <assert.h>
+#include <vector>
 #include "framework.h"
+#include "transport.h"
+#include "timers.h"
 
 //
-// Server and client in the same process communicating though copying
-// data using shared memory.
+// Server and client communicating through a ZeroMQ ROUTER and DEALER
+// socket pair. Unlike REQ/REP they allow several requests in flight.
+// Every client has its own DEALER socket, the ROUTER tells them apart by
+// identity.
 //
 
-const int MaxSize = 512;
+// Identity of the peer the server handler is answering, ROUTER sockets
+// route replies by it.
+struct ZmqPeer {
+    char identity[256];
+    size_t size;
+};
 
 class ZeromqLoopMain: public EventMain {
 protected:
 
     EventHandler *server;
-    EventHandler *client;
+    std::vector<EventHandler*> clients;
     bool loopEnd;
     void* context;
+    void* serverSocket;
+    ZmqPeer peer;
+    TimerQueue timers;
 
 public:
 
     void initialize() {
         loopEnd = false;
-        server = client = NULL;
-        context = NULL;
+        server = NULL;
+        context = zmq_ctx_new();
+        serverSocket = NULL;
 
     }
     void process() {
-        char buffer[MaxSize];
-        zmq_pollitem_t items[2];
-        memset(items, 0, sizeof(items));
+        // One item per client socket, then the server socket
+        std::vector<zmq_pollitem_t> items(clients.size() + (server ? 1 : 0));
         int nitems = 0;
-        if (client) {
-        	items[nitems].socket = (void*)client->getContext();
+        for (size_t i = 0; i < clients.size(); i++) {
+        	items[nitems].socket = clients[i]->getContext();
         	items[nitems].events = ZMQ_POLLIN;
         	nitems++;
         }
         if (server) {
-        	items[nitems].socket = (void*)server->getContext();
+        	items[nitems].socket = serverSocket;
         	items[nitems].events = ZMQ_POLLIN;
         	nitems++;
         }
@@ -50,19 +63,45 @@ public:
         	for (int i=0; i < nitems; i++) {
         		items[i].revents = 0;
         	}
-        	int rc = zmq_poll(items, nitems, -1);
+        	// zmq_poll takes milliseconds, round up so a timer is not
+        	// polled for before it is due
+        	int64_t nanos = timers.nanosToNext();
+        	long timeout = nanos < 0 ? -1 : (long) ((nanos + 999999) / 1000000);
+        	int rc = zmq_poll(&items[0], nitems, timeout);
         	if (rc < 0) {
+        		if (errno == EINTR) {
+        			continue;
+        		}
         		diep("zmq_poll");
         	}
+        	TRACE_EVENT(TraceWakeup, rc);
+        	LIVE_STAT(liveLoop(pLive, rc));
+        	timers.runDue();
+        	// Serve every ready socket so no client starves the ones after it
         	for (int i=0; i < nitems; i++) {
         		if (items[i].revents & ZMQ_POLLIN) {
-        			int nbytes = zmq_recv(items[i].socket, buffer, sizeof(buffer), 0);
+        			// zmq_recv truncates to the buffer size, a message object
+        			// receives payloads of any size without a copy
+        			zmq_msg_t msg;
+        			zmq_msg_init(&msg);
+        			if (items[i].socket == serverSocket) {
+        				// ROUTER prefixes every message with the sender identity
+        				int idbytes = zmq_msg_recv(&msg, serverSocket, 0);
+        				if (idbytes < 0) {
+        					diep("zmq_recv");
+        				}
+        				peer.size = idbytes;
+        				memcpy(peer.identity, zmq_msg_data(&msg), idbytes);
+        				server->setContext((Context*)&peer);
+        			}
+        			int nbytes = zmq_msg_recv(&msg, items[i].socket, 0);
         			if (nbytes < 0) {
         				diep("zmq_recv");
         			}
-        			EventHandler *processor = (i==0 && client) ? client : server;
-        			processor->process(buffer, nbytes, true);
-        			break;
+        			TRACE_EVENT(TraceRecv, nbytes);
+        			EventHandler *processor = (i < (int) clients.size()) ? clients[i] : server;
+        			processor->process((char*)zmq_msg_data(&msg), nbytes, true);
+        			zmq_msg_close(&msg);
         		}
 
         	}
@@ -70,32 +109,43 @@ public:
 
     }
 
+    int addTimer(uint64_t delayNanos, TimerHandler *pTimer) {
+        return timers.add(getMonotonicNanos() + delayNanos, pTimer);
+    }
+
+    void cancelTimer(int id) {
+        timers.cancel(id);
+    }
+
     void cancelLoop() {
         loopEnd = true;
     }
 
     void createChannel(bool isServer, const char *port, EventHandler *pProcessor) {
         setParent(pProcessor);
-    	context = zmq_ctx_new();
     	char path[256];
-    	sprintf(path, "tcp://127.0.0.1:%s", port);
+    	// A port that is a path selects the ipc (unix socket) transport
+    	if (port[0] == '/') {
+    		snprintf(path, sizeof(path), "ipc://%s", port);
+    	} else {
+    		snprintf(path, sizeof(path), "tcp://127.0.0.1:%s", port);
+    	}
     	if (isServer) {
-    		void *responder = zmq_socket(context, ZMQ_REP);
-    		int rc = zmq_bind(responder, path);
+    		serverSocket = zmq_socket(context, ZMQ_ROUTER);
+    		int rc = zmq_bind(serverSocket, path);
     		if (rc != 0) {
     			diep("zmq_bind");
     		}
-    		pProcessor->setContext((Context*)responder);
             this->server = pProcessor;
     	}
     	else {
-    		void *requester = zmq_socket(context, ZMQ_REQ);
-    		int rc = zmq_connect(requester, path);
+    		void *clientSocket = zmq_socket(context, ZMQ_DEALER);
+    		int rc = zmq_connect(clientSocket, path);
     		if (rc != 0) {
     			diep("zmq_connect");
     		}
-    		pProcessor->setContext((Context*)requester);
-    		this->client = pProcessor;
+    		pProcessor->setContext((Context*)clientSocket);
+    		clients.push_back(pProcessor);
     	}
 
     }
@@ -108,7 +158,16 @@ public:
             INFO_OUT("Invalid context");
             return;
         }
-        int rc = zmq_send((void*)p->getContext(), data, len, 0);
+        int rc;
+        if (p == server) {
+            ZmqPeer *to = (ZmqPeer*)p->getContext();
+            if (zmq_send(serverSocket, to->identity, to->size, ZMQ_SNDMORE) == -1) {
+                diep("zmq_send");
+            }
+            rc = zmq_send(serverSocket, data, len, 0);
+        } else {
+            rc = zmq_send((void*)p->getContext(), data, len, 0);
+        }
         if (rc == -1) {
         	diep("zmq_send");
         }
@@ -123,6 +182,8 @@ public:
 };
 
 
+REGISTER_TRANSPORT("zeromq", ZeromqLoopMain, "ZeroMQ ROUTER/DEALER", TransportTimers)
+
 #ifdef BUILDTEST
 ZeromqLoopMain zmqloopMain;
 EventMain *g_pmainProcessor = &zmqloopMain;
@@ -0,0 +1,278 @@
+#include <malloc.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "ipcbenchcommon.hpp"
+#include "histogram.h"
+#include "cputime.h"
+
+// Idle connection scaling of epoll, io_uring, select and libevent. A
+// forked holder process opens state.range(0) connections to the server,
+// sends one byte on each and leaves them idle. Once the server has them all,
+// ActiveClients clients on the server's loop ping pong MessageSize bytes,
+// state.max_iterations round trips between them. The time per iteration
+// is the measured time per round trip.
+//
+// - cpu_us_per_rt: CPU time of the loop per round trip, the dispatch
+//   cost, which for select grows with every fd it scans
+// - heap_per_idle: bytes the loop allocated per idle connection, from
+//   malloc's count of bytes in use; kernel socket memory is not in it
+// - p50_us and p99_us: round trips of the active clients
+//
+// Counts that do not fit RLIMIT_NOFILE, or FD_SETSIZE for select, are
+// skipped.
+
+const int ActiveClients = 16;
+const int MessageSize = 64;
+// Connections per loopback destination address, below the ephemeral ports
+// of one
+const int IdlePerAddress = 20000;
+// How often the loop looks whether the holder died
+const uint64_t WatchNanos = 10000000;
+
+static PortSequence ports(20100);
+
+// Resident memory would not grow while the heap reuses what earlier runs
+// freed
+static uint64_t heapBytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+// Connects numIdle sockets and keeps them until stopFd is closed
+static void holdIdle(const char *port, int numIdle, int stopFd) {
+    std::vector<int> fds;
+    for (int i = 0; i < numIdle; i++) {
+        char address[32];
+        snprintf(address, sizeof(address), "127.0.0.%d", 1 + i / IdlePerAddress);
+        sockaddr_storage ss;
+        socklen_t slen = makeAddress(address, port, &ss);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1 || connect(fd, (sockaddr*) &ss, slen) == -1
+                || write(fd, "i", 1) != 1) {
+            perror("idle connection");
+            _exit(1);
+        }
+        fds.push_back(fd);
+    }
+    char c;
+    if (read(stopFd, &c, 1) < 0) {
+        perror("read");
+    }
+    _exit(0);
+}
+
+class ActiveGroup;
+
+class ActiveClient: public EventHandler {
+public:
+    ActiveGroup *pGroup;
+    uint64_t sendNanos;
+    int numGot;
+    char message[MessageSize];
+
+    void enable();
+    void process(char *data, int len, bool iseof);
+    void sendNext();
+};
+
+// Starts the active clients once the idle connections are in
+class ActiveGroup {
+public:
+    EventMain *pMain;
+    const char *port;
+    int numToSend;
+    int numRunning;
+    std::vector<ActiveClient> clients;
+    LatencyHistogram roundTrips;
+    uint64_t idleBytes;
+    uint64_t beginNanos;
+    uint64_t beginCpuNanos;
+
+    ActiveGroup() : clients(ActiveClients) {
+    }
+
+    void start() {
+        idleBytes = heapBytes();
+        numRunning = ActiveClients;
+        beginNanos = getMonotonicNanos();
+        beginCpuNanos = getProcessCpuNanos();
+        for (int i = 0; i < ActiveClients; i++) {
+            clients[i].pGroup = this;
+            memset(clients[i].message, 'x', MessageSize);
+            pMain->connectToServer("127.0.0.1", port, &clients[i]);
+        }
+    }
+
+    void clientDone() {
+        if (--numRunning == 0) {
+            pMain->cancelLoop();
+        }
+    }
+};
+
+void ActiveClient::enable() {
+    numGot = 0;
+    sendNext();
+}
+
+void ActiveClient::sendNext() {
+    if (pGroup->numToSend == 0) {
+        pGroup->clientDone();
+        return;
+    }
+    pGroup->numToSend--;
+    sendNanos = getMonotonicNanos();
+    send(message, MessageSize, true);
+}
+
+// A stream transport may split an echo, count bytes
+void ActiveClient::process(char *data, int len, bool iseof) {
+    numGot += len;
+    if (numGot < MessageSize) {
+        return;
+    }
+    numGot = 0;
+    pGroup->roundTrips.record(getMonotonicNanos() - sendNanos);
+    sendNext();
+}
+
+// Echoes the active clients and counts the idle connections in
+class C10kServer: public EventHandler {
+public:
+    ActiveGroup *pGroup;
+    int numIdle;
+    int numIn;
+
+    void process(char *data, int len, bool iseof) {
+        if (len == 1 && data[0] == 'i') {
+            if (++numIn == numIdle) {
+                pGroup->start();
+            }
+            return;
+        }
+        send(data, len, true);
+    }
+};
+
+// Ends the run when the holder could not open its connections
+class HolderWatch: public TimerHandler {
+public:
+    EventMain *pMain;
+    pid_t holder;
+    bool isDead;
+    int timerId;
+
+    void onTimer(int id) {
+        if (waitpid(holder, NULL, WNOHANG) == holder) {
+            isDead = true;
+            pMain->cancelLoop();
+            return;
+        }
+        timerId = pMain->addTimer(WatchNanos, this);
+    }
+};
+
+static void BM_idle(benchmark::State& state, const TransportInfo *info) {
+    int numIdle = (int) state.range(0);
+    // Both ends of the active connections, the listener and some spare
+    int numFds = numIdle + 2 * ActiveClients + 16;
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (numFds > (int) limit.rlim_cur) {
+        skipRun(state, "over RLIMIT_NOFILE");
+        return;
+    }
+    if (!strcmp(info->name, "select") && numFds > FD_SETSIZE) {
+        skipRun(state, "over FD_SETSIZE");
+        return;
+    }
+    char port[32];
+    ports.take(port, sizeof(port));
+    EventMain *pMain = info->factory();
+    ActiveGroup group;
+    group.pMain = pMain;
+    group.port = port;
+    group.numToSend = (int) state.max_iterations;
+    C10kServer *server = new C10kServer();
+    server->pGroup = &group;
+    server->numIdle = numIdle;
+    server->numIn = 0;
+
+    pMain->initialize();
+    pMain->bindServer(port, server);
+    uint64_t beforeBytes = heapBytes();
+    int stopPipe[2];
+    dieif(pipe(stopPipe) == -1, "pipe");
+    pid_t holder = fork();
+    dieif(holder == -1, "fork");
+    if (holder == 0) {
+        close(stopPipe[1]);
+        holdIdle(port, numIdle, stopPipe[0]);
+    }
+    close(stopPipe[0]);
+    HolderWatch watch;
+    watch.pMain = pMain;
+    watch.holder = holder;
+    watch.isDead = false;
+    watch.timerId = pMain->addTimer(WatchNanos, &watch);
+    if (numIdle == 0) {
+        group.start();
+    }
+    pMain->process();
+    uint64_t elapsedNanos = getMonotonicNanos() - group.beginNanos;
+    uint64_t cpuNanos = getProcessCpuNanos() - group.beginCpuNanos;
+    close(stopPipe[1]);
+    if (watch.isDead) {
+        skipRun(state, "idle connections failed");
+    } else {
+        pMain->cancelTimer(watch.timerId);
+        waitpid(holder, NULL, 0);
+        reportRoundTrips(state, elapsedNanos, state.max_iterations,
+            MessageSize);
+        state.counters["cpu_us_per_rt"] = cpuNanos / 1000.0 / state.max_iterations;
+        state.counters["heap_per_idle"] = numIdle
+                ? (double) (group.idleBytes - beforeBytes) / numIdle : 0;
+        state.counters["p50_us"] = group.roundTrips.valueAtPercentile(50) / 1000.0;
+        state.counters["p99_us"] = group.roundTrips.valueAtPercentile(99) / 1000.0;
+    }
+    delete pMain;
+    delete server;
+}
+
+int main(int argc, char** argv) {
+    // Idle connections need every fd the hard limit allows
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    const char *names[] = {"epoll", "io_uring", "select", "libevent"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const TransportInfo *info = findTransport(names[i]);
+        if (!info) {
+            continue;
+        }
+        std::string suffix = std::string("<") + info->name + ">";
+        benchmark::RegisterBenchmark(("BM_idle" + suffix).c_str(),
+            BM_idle, info)
+            ->UseManualTime()->Unit(benchmark::kMicrosecond)
+            ->Arg(0)->Arg(900)->Arg(1000)->Arg(5000)->Arg(10000)->Arg(50000);
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
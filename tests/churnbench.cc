@@ -0,0 +1,248 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "ipcbenchcommon.hpp"
+#include "histogram.h"
+
+// Connection churn on the TCP transports. A client opens a connection,
+// does state.range(0) echo exchanges of MessageSize bytes on it, closes it
+// and opens the next one, state.max_iterations connections a run. The time
+// per iteration is the measured time per connection, so items_per_second
+// is connections per second.
+//
+// - BM_churn: client and server on one loop, accepting with accept() and
+//   fcntl()
+// - BM_churn_accept4: the same with accept4() and SOCK_NONBLOCK
+// - BM_churn_reuseport: state.range(1) server loops in threads of their
+//   own, each binding the port with SO_REUSEPORT, and the client in a loop
+//   of its own; 1 is the baseline for the thread hand off
+//
+// The accept_p50_us and accept_p99_us counters run from the client's
+// connect() call until the server handler has the first request of the
+// connection, which takes in the accept. busiest_shard is the share of
+// the connections the busiest server loop took.
+
+const int MessageSize = 64;
+// How often a server loop in a thread looks whether the run is over
+const uint64_t StopPollNanos = 1000000;
+
+struct ChurnMessage {
+    uint64_t connectNanos;
+    uint32_t isFirst;
+    char pad[MessageSize - sizeof(uint64_t) - sizeof(uint32_t)];
+};
+
+static PortSequence ports(19900);
+
+class ChurnServer: public EventHandler {
+public:
+    LatencyHistogram accept;
+
+    void process(char *data, int len, bool iseof) {
+        ChurnMessage message;
+        if (len >= (int) sizeof(message)) {
+            memcpy(&message, data, sizeof(message));
+            if (message.isFirst) {
+                accept.record(getMonotonicNanos() - message.connectNanos);
+            }
+        }
+        send(data, len, true);
+    }
+};
+
+class ChurnClient: public EventHandler {
+public:
+    EventMain *pMain;
+    const char *port;
+    int numExchanges;
+    int numLeft;
+    int exchangesLeft;
+    int numGot;
+    ChurnMessage message;
+
+    void connect() {
+        memset(&message, 0, sizeof(message));
+        message.connectNanos = getMonotonicNanos();
+        message.isFirst = 1;
+        exchangesLeft = numExchanges;
+        pMain->connectToServer("127.0.0.1", port, this);
+    }
+
+    void enable() {
+        numGot = 0;
+        send((const char*) &message, sizeof(message), true);
+    }
+
+    // A stream transport may split an echo, count bytes
+    void process(char *data, int len, bool iseof) {
+        numGot += len;
+        if (numGot < (int) sizeof(message)) {
+            return;
+        }
+        numGot = 0;
+        message.isFirst = 0;
+        if (--exchangesLeft > 0) {
+            send((const char*) &message, sizeof(message), true);
+            return;
+        }
+        pMain->disconnect(this);
+        if (--numLeft == 0) {
+            pMain->cancelLoop();
+            return;
+        }
+        connect();
+    }
+};
+
+// Ends a loop of another thread once the run is over
+class StopPoll: public TimerHandler {
+public:
+    EventMain *pMain;
+    std::atomic<bool> *pStop;
+
+    void onTimer(int id) {
+        if (pStop->load()) {
+            pMain->cancelLoop();
+        } else {
+            pMain->addTimer(StopPollNanos, this);
+        }
+    }
+};
+
+static void reportConnections(benchmark::State& state, uint64_t elapsedNanos,
+    const LatencyHistogram &accept) {
+    double secsPerConnection = elapsedNanos / 1e9 / state.max_iterations;
+    for (auto _ : state) {
+        state.SetIterationTime(secsPerConnection);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["accept_p50_us"] = accept.valueAtPercentile(50) / 1000.0;
+    state.counters["accept_p99_us"] = accept.valueAtPercentile(99) / 1000.0;
+}
+
+static void BM_churn(benchmark::State& state, const TransportInfo *info,
+    int acceptOptions) {
+    char port[32];
+    ports.take(port, sizeof(port));
+    EventMain *pMain = info->factory();
+    pMain->initialize();
+    if (!pMain->setAcceptOptions(acceptOptions)) {
+        skipRun(state, "accept options not supported");
+        delete pMain;
+        return;
+    }
+    ChurnServer *server = new ChurnServer();
+    ChurnClient *client = new ChurnClient();
+    client->pMain = pMain;
+    client->port = port;
+    client->numExchanges = (int) state.range(0);
+    client->numLeft = (int) state.max_iterations;
+
+    pMain->bindServer(port, server);
+    uint64_t beginNanos = getMonotonicNanos();
+    client->connect();
+    pMain->process();
+    reportConnections(state, getMonotonicNanos() - beginNanos, server->accept);
+    delete client;
+    delete server;
+    delete pMain;
+}
+
+static void BM_churn_reuseport(benchmark::State& state,
+    const TransportInfo *info) {
+    char port[32];
+    ports.take(port, sizeof(port));
+    int numShards = (int) state.range(1);
+    std::vector<EventMain*> shards(numShards);
+    std::vector<ChurnServer*> servers(numShards);
+    std::vector<StopPoll> polls(numShards);
+    std::atomic<bool> stop(false);
+    std::atomic<int> numBound(0);
+    bool isSupported = true;
+    for (int i = 0; i < numShards; i++) {
+        shards[i] = info->factory();
+        shards[i]->initialize();
+        isSupported = shards[i]->setAcceptOptions(AcceptReusePort) && isSupported;
+        servers[i] = new ChurnServer();
+        polls[i].pMain = shards[i];
+        polls[i].pStop = &stop;
+    }
+    std::vector<std::thread> threads;
+    if (isSupported) {
+        for (int i = 0; i < numShards; i++) {
+            threads.push_back(std::thread([&, i]() {
+                shards[i]->bindServer(port, servers[i]);
+                shards[i]->addTimer(StopPollNanos, &polls[i]);
+                numBound++;
+                shards[i]->process();
+            }));
+        }
+        while (numBound.load() < numShards) {
+            std::this_thread::yield();
+        }
+        EventMain *pMain = info->factory();
+        ChurnClient *client = new ChurnClient();
+        client->pMain = pMain;
+        client->port = port;
+        client->numExchanges = (int) state.range(0);
+        client->numLeft = (int) state.max_iterations;
+        pMain->initialize();
+        uint64_t beginNanos = getMonotonicNanos();
+        client->connect();
+        pMain->process();
+        uint64_t elapsedNanos = getMonotonicNanos() - beginNanos;
+        stop = true;
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        LatencyHistogram accept;
+        uint64_t busiest = 0;
+        for (int i = 0; i < numShards; i++) {
+            accept.merge(servers[i]->accept);
+            if (servers[i]->accept.count() > busiest) {
+                busiest = servers[i]->accept.count();
+            }
+        }
+        reportConnections(state, elapsedNanos, accept);
+        state.counters["busiest_shard"] = accept.count()
+                ? busiest / (double) accept.count() : 0;
+        delete client;
+        delete pMain;
+    } else {
+        skipRun(state, "SO_REUSEPORT not supported");
+    }
+    for (int i = 0; i < numShards; i++) {
+        delete servers[i];
+        delete shards[i];
+    }
+}
+
+int main(int argc, char** argv) {
+    const char *names[] = {"epoll", "io_uring", "select", "libevent", "kqueue"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const TransportInfo *info = findTransport(names[i]);
+        if (!info) {
+            continue;
+        }
+        std::string suffix = std::string("<") + info->name + ">";
+        benchmark::RegisterBenchmark(("BM_churn" + suffix).c_str(),
+            BM_churn, info, 0)
+            ->UseManualTime()->Unit(benchmark::kMicrosecond)->Arg(1)->Arg(16);
+        benchmark::RegisterBenchmark(("BM_churn_accept4" + suffix).c_str(),
+            BM_churn, info, AcceptNonBlock)
+            ->UseManualTime()->Unit(benchmark::kMicrosecond)->Arg(1)->Arg(16);
+        benchmark::RegisterBenchmark(("BM_churn_reuseport" + suffix).c_str(),
+            BM_churn_reuseport, info)
+            ->UseManualTime()->Unit(benchmark::kMicrosecond)
+            ->Args({1, 1})->Args({1, 2})->Args({16, 1})->Args({16, 2});
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
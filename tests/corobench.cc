@@ -0,0 +1,95 @@
+#include <string>
+#include <benchmark/benchmark.h>
+#include "ipcbenchcommon.hpp"
+#include "coro.h"
+
+// Cost of writing handlers as coroutines (coro.h) instead of callbacks.
+// The same ping pong, a client that sends the next message once the whole
+// echo of the last one is back, runs with EventHandler callbacks and with
+// CoHandler coroutines for client and server, in one process on the same
+// loop. Like dispatchbench, a run sends state.max_iterations messages and
+// the time per iteration is the measured time per round trip.
+
+static PortSequence ports(19500);
+
+class CoPingServer: public CoHandler {
+public:
+    CoTask run(CoConnection &conn) {
+        while (true) {
+            CoMessage msg = co_await conn.recv();
+            co_await conn.send(msg.data, msg.len);
+        }
+    }
+};
+
+class CoPingClient: public CoHandler {
+public:
+    int numLeft;
+    int size;
+    char message[MaxMessageSize];
+
+    CoTask run(CoConnection &conn) {
+        while (numLeft > 0) {
+            co_await conn.send(message, size);
+            int numGot = 0;
+            while (numGot < size) {
+                CoMessage msg = co_await conn.recv();
+                numGot += msg.len;
+            }
+            numLeft--;
+        }
+        getParent()->cancelLoop();
+    }
+};
+
+template <class Server, class Client>
+static void BM_pingpong(benchmark::State& state, const TransportInfo *info) {
+    int size = (int) state.range(0);
+    EventMain *pMain = info->factory();
+    if (size > pMain->maxMessageSize()) {
+        skipRun(state, "payload over the transport limit");
+        delete pMain;
+        return;
+    }
+    char port[32];
+    ports.take(port, sizeof(port));
+    Server *server = new Server();
+    Client *client = new Client();
+    client->numLeft = (int) state.max_iterations;
+    client->size = size;
+    memset(client->message, 'x', size);
+
+    pMain->initialize();
+    pMain->bindServer(port, server);
+    uint64_t beginNanos = getMonotonicNanos();
+    pMain->connectToServer("127.0.0.1", port, client);
+    pMain->process();
+    reportRoundTrips(state, getMonotonicNanos() - beginNanos);
+    delete client;
+    delete server;
+    delete pMain;
+}
+
+int main(int argc, char** argv) {
+    const char *names[] = {"memcpy", "shmem", "epoll", "select"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const TransportInfo *info = findTransport(names[i]);
+        if (!info) {
+            continue;
+        }
+        std::string suffix = std::string("<") + info->name + ">";
+        benchmark::RegisterBenchmark(("BM_pingpong_callback" + suffix).c_str(),
+            BM_pingpong<PingServer, PingClient>, info)
+            ->UseManualTime()->RangeMultiplier(8)->Range(16, 4096);
+        benchmark::RegisterBenchmark(("BM_pingpong_coroutine" + suffix).c_str(),
+            BM_pingpong<CoPingServer, CoPingClient>, info)
+            ->UseManualTime()->RangeMultiplier(8)->Range(16, 4096);
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
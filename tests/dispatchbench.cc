@@ -0,0 +1,97 @@
+#include <string>
+#include <benchmark/benchmark.h>
+#include "ipcbenchcommon.hpp"
+#include "staticmain.h"
+#include "histogram.h"
+
+// Cost of the virtual framework on the ring loops. The same ping pong,
+// a client that sends the next message when the echo of the last one
+// arrives, runs once through EventMain/EventHandler with the registered
+// memcpy, shmem and mmap transports and once through StaticRingMain
+// (staticmain.h) with the same ring placement. Like ipcbench, a run sends
+// state.max_iterations messages and the time per iteration is the measured
+// time per round trip.
+
+template <class Main>
+class StaticPingServer: public StaticHandler<Main> {
+public:
+    void process(char *data, int len) {
+        this->send(data, len);
+    }
+};
+
+template <class Main>
+class StaticPingClient: public StaticHandler<Main> {
+public:
+    int numLeft;
+    int size;
+    char message[MaxMessageSize];
+
+    void enable() {
+        this->send(message, size);
+    }
+
+    void process(char *data, int len) {
+        if (--numLeft == 0) {
+            this->pMain->cancelLoop();
+            return;
+        }
+        this->send(message, size);
+    }
+};
+
+static void BM_pingpong_virtual(benchmark::State& state, const char *name) {
+    const TransportInfo *info = findTransport(name);
+    EventMain *pMain = info->factory();
+    PingServer *server = new PingServer();
+    PingClient *client = new PingClient();
+    client->numLeft = (int) state.max_iterations;
+    client->size = (int) state.range(0);
+    memset(client->message, 'x', client->size);
+
+    pMain->initialize();
+    pMain->bindServer("0", server);
+    uint64_t beginNanos = getMonotonicNanos();
+    pMain->connectToServer("127.0.0.1", "0", client);
+    pMain->process();
+    reportRoundTrips(state, getMonotonicNanos() - beginNanos);
+    delete client;
+    delete server;
+    delete pMain;
+}
+
+template <class Rings>
+static void BM_pingpong_static(benchmark::State& state) {
+    typedef StaticRingMain<Rings, StaticPingServer, StaticPingClient> Main;
+    Main *pMain = new Main();
+    typename Main::Server *server = new typename Main::Server();
+    typename Main::Client *client = new typename Main::Client();
+    client->numLeft = (int) state.max_iterations;
+    client->size = (int) state.range(0);
+    memset(client->message, 'x', client->size);
+
+    pMain->initialize();
+    pMain->bindServer(server);
+    uint64_t beginNanos = getMonotonicNanos();
+    pMain->connectToServer(client);
+    pMain->process();
+    reportRoundTrips(state, getMonotonicNanos() - beginNanos);
+    delete client;
+    delete server;
+    delete pMain;
+}
+
+BENCHMARK_CAPTURE(BM_pingpong_virtual, memcpy, "memcpy")
+->UseManualTime()->RangeMultiplier(8)->Range(16, 4096);
+BENCHMARK_TEMPLATE(BM_pingpong_static, HeapRings)
+->UseManualTime()->RangeMultiplier(8)->Range(16, 4096);
+BENCHMARK_CAPTURE(BM_pingpong_virtual, shmem, "shmem")
+->UseManualTime()->RangeMultiplier(8)->Range(16, 4096);
+BENCHMARK_TEMPLATE(BM_pingpong_static, ShmRings)
+->UseManualTime()->RangeMultiplier(8)->Range(16, 4096);
+BENCHMARK_CAPTURE(BM_pingpong_virtual, mmap, "mmap")
+->UseManualTime()->RangeMultiplier(8)->Range(16, 4096);
+BENCHMARK_TEMPLATE(BM_pingpong_static, MmapRings)
+->UseManualTime()->RangeMultiplier(8)->Range(16, 4096);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,260 @@
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "ipcbenchcommon.hpp"
+#include "histogram.h"
+
+// Zero copy receive with holdReceive(). The server holds every buffer it
+// is given instead of copying it, and echoes it from a timer of delay 0 on
+// a later turn of the loop, then releases it. Meanwhile the loop goes on
+// delivering: the other clients' data on the socket loops, and on a stream
+// the rest of a message, which the server copies as a connection holds one
+// buffer at a time. The copy variant copies everything for comparison.
+//
+// Every message of a client carries its own fill byte. The server hashes
+// what it holds when it gets it and again before the echo, the client
+// checks every echoed byte, and either exits on a mismatch, so a loop that
+// reused a held buffer fails the run. A run sends state.max_iterations
+// messages split over the clients, each client with Window of them in
+// flight; the time per iteration is the measured time per round trip.
+//
+// - held: the fraction of deliveries the server held
+// - p50_us and p99_us: round trips of all clients
+
+const int Window = 2;
+
+static PortSequence ports(20300);
+
+// FNV-1a over 8 byte words, enough to see a buffer change
+static uint64_t hashBytes(const char *data, int len) {
+    uint64_t hash = 14695981039346656037ULL;
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+class HoldServer: public EventHandler, public TimerHandler {
+public:
+    bool isHolding;
+    uint64_t numHeld;
+    uint64_t numCopied;
+
+    HoldServer() : isHolding(true), numHeld(0), numCopied(0), timerId(-1) {
+    }
+
+    void process(char *data, int len, bool iseof) {
+        if (len <= 0) {
+            return;
+        }
+        Delivery delivery;
+        delivery.pContext = getContext();
+        delivery.hash = hashBytes(data, len);
+        delivery.isHeld = isHolding && holdReceive();
+        delivery.len = len;
+        if (delivery.isHeld) {
+            delivery.data = data;
+            numHeld++;
+        } else {
+            delivery.data = NULL;
+            delivery.copy.assign(data, len);
+            numCopied++;
+        }
+        deliveries.push_back(delivery);
+        if (timerId == -1) {
+            timerId = getParent()->addTimer(0, this);
+        }
+    }
+
+    void onTimer(int id) {
+        timerId = -1;
+        std::vector<Delivery> due;
+        due.swap(deliveries);
+        for (size_t i = 0; i < due.size(); i++) {
+            Delivery &delivery = due[i];
+            const char *data = delivery.isHeld ? delivery.data
+                : delivery.copy.data();
+            if (hashBytes(data, delivery.len) != delivery.hash) {
+                ERROR_OUT("A held receive buffer changed before its release\n");
+                exit(1);
+            }
+            setContext(delivery.pContext);
+            send(data, delivery.len, true);
+            if (delivery.isHeld) {
+                releaseReceive();
+            }
+        }
+    }
+
+private:
+    struct Delivery {
+        Context *pContext;
+        // The held buffer, NULL for a copy
+        char *data;
+        int len;
+        uint64_t hash;
+        bool isHeld;
+        std::string copy;
+    };
+
+    std::vector<Delivery> deliveries;
+    int timerId;
+};
+
+class HoldClient: public EventHandler {
+public:
+    int *pNumActive;
+    int numLeft;
+    int size;
+    LatencyHistogram *pRoundTrips;
+
+    void enable() {
+        numSent = numGot = numEchoed = 0;
+        for (int i = 0; i < Window && numSent < numLeft; i++) {
+            sendNext();
+        }
+    }
+
+    // A stream transport may split and join echoes, check byte by byte
+    void process(char *data, int len, bool iseof) {
+        while (len > 0) {
+            int n = len < size - numGot ? len : size - numGot;
+            char fill = fillOf(numEchoed);
+            for (int i = 0; i < n; i++) {
+                if (data[i] != fill) {
+                    ERROR_OUT("Echo %d has a corrupt byte\n", numEchoed);
+                    exit(1);
+                }
+            }
+            data += n;
+            len -= n;
+            numGot += n;
+            if (numGot == size) {
+                numGot = 0;
+                endMessage();
+            }
+        }
+    }
+
+private:
+    int numSent;
+    int numGot;
+    int numEchoed;
+    uint64_t sendNanos[Window];
+    char message[MaxMessageSize];
+
+    static char fillOf(int seq) {
+        return (char) ('a' + seq % 26);
+    }
+
+    void sendNext() {
+        memset(message, fillOf(numSent), size);
+        sendNanos[numSent % Window] = getMonotonicNanos();
+        numSent++;
+        send(message, size, true);
+    }
+
+    void endMessage() {
+        pRoundTrips->record(getMonotonicNanos() - sendNanos[numEchoed % Window]);
+        numEchoed++;
+        if (numEchoed == numLeft) {
+            if (--*pNumActive == 0) {
+                getParent()->cancelLoop();
+            }
+            return;
+        }
+        if (numSent < numLeft) {
+            sendNext();
+        }
+    }
+};
+
+static void BM_hold(benchmark::State& state, const TransportInfo *info,
+    bool isHolding) {
+    int size = (int) state.range(0);
+    int numClients = (int) state.range(1);
+    EventMain *pMain = info->factory();
+    if (size > pMain->maxMessageSize()) {
+        skipRun(state, "payload over the transport limit");
+        delete pMain;
+        return;
+    }
+    char port[32];
+    ports.take(port, sizeof(port));
+    HoldServer *server = new HoldServer();
+    server->isHolding = isHolding;
+    std::vector<HoldClient*> clients(numClients);
+    LatencyHistogram roundTrips;
+    int numActive = numClients;
+    for (int i = 0; i < numClients; i++) {
+        clients[i] = new HoldClient();
+        clients[i]->pNumActive = &numActive;
+        clients[i]->numLeft = (int) (state.max_iterations / numClients) + 1;
+        clients[i]->size = size;
+        clients[i]->pRoundTrips = &roundTrips;
+    }
+
+    pMain->initialize();
+    pMain->bindServer(port, server);
+    uint64_t beginNanos = getMonotonicNanos();
+    for (int i = 0; i < numClients; i++) {
+        pMain->connectToServer("127.0.0.1", port, clients[i]);
+    }
+    pMain->process();
+    uint64_t elapsedNanos = getMonotonicNanos() - beginNanos;
+    reportRoundTrips(state, elapsedNanos, roundTrips.count(), size);
+    uint64_t numDeliveries = server->numHeld + server->numCopied;
+    state.counters["held"] = numDeliveries
+        ? (double) server->numHeld / numDeliveries : 0;
+    state.counters["p50_us"] = roundTrips.valueAtPercentile(50) / 1000.0;
+    state.counters["p99_us"] = roundTrips.valueAtPercentile(99) / 1000.0;
+    for (int i = 0; i < numClients; i++) {
+        delete clients[i];
+    }
+    delete server;
+    delete pMain;
+}
+
+int main(int argc, char** argv) {
+    // The ring transports connect one client, the socket loops several so
+    // other connections are read while one buffer is held
+    const char *rings[] = {"memcpy", "shmem", "mmap"};
+    const char *sockets[] = {"epoll", "io_uring", "select"};
+    std::vector<std::pair<const char*, int> > runs;
+    for (size_t i = 0; i < sizeof(rings) / sizeof(rings[0]); i++) {
+        runs.push_back(std::make_pair(rings[i], 1));
+    }
+    for (size_t i = 0; i < sizeof(sockets) / sizeof(sockets[0]); i++) {
+        runs.push_back(std::make_pair(sockets[i], 8));
+    }
+    for (size_t i = 0; i < runs.size(); i++) {
+        const TransportInfo *info = findTransport(runs[i].first);
+        if (!info) {
+            continue;
+        }
+        std::string suffix = std::string("<") + info->name + ">";
+        std::vector<int64_t> clientCounts(1, 1);
+        if (runs[i].second > 1) {
+            clientCounts.push_back(runs[i].second);
+        }
+        benchmark::RegisterBenchmark(("BM_hold" + suffix).c_str(),
+            BM_hold, info, true)
+            ->UseManualTime()->ArgsProduct({{64, 4096, 32768}, clientCounts});
+        benchmark::RegisterBenchmark(("BM_copy" + suffix).c_str(),
+            BM_hold, info, false)
+            ->UseManualTime()->ArgsProduct({{64, 4096, 32768}, clientCounts});
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "cellrunner.h"
+#include "ipcbenchcommon.hpp"
+
+// Echo round trips through every ipcperf transport linked into this binary.
+// Each run forks a child that sends state.max_iterations messages of the
+// given payload size, the same way the ipcperf driver runs a matrix cell.
+// The time per iteration is the child's measured time per round trip, so
+// --benchmark_repetitions and the JSON reporter work as for the other
+// benchmarks. In the separate variant the child forks the server as a peer
+// process.
+
+static PortSequence ports(19000);
+
+static void BM_ipc_roundtrip(benchmark::State& state, const TransportInfo *info,
+    bool isSeparate) {
+    char port[32];
+    ports.take(port, sizeof(port));
+    ArgParser args;
+    args.pPort = port;
+    args.numMessages = (int) state.max_iterations;
+    PayloadSize size = {(int) state.range(0), (int) state.range(0)};
+    args.payloadSizes.push_back(size);
+
+    std::vector<ResultRow> rows;
+    CellStatus status = forkCell(info, isSeparate, args, false, 120, rows);
+    if (status != CellDone || rows.empty()) {
+        skipRun(state, status == CellTimedOut ? "timed out"
+            : rows.empty() ? "payload over the transport limit" : "failed");
+        return;
+    }
+    const ResultRow &row = rows[0];
+    double secsPerRoundTrip = row.elapsedNanos / 1e9 / row.numMessages;
+    for (auto _ : state) {
+        state.SetIterationTime(secsPerRoundTrip);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(0) * 2);
+    state.counters["p50_us"] = row.p50Usec;
+    state.counters["p99_us"] = row.p99Usec;
+    state.counters["cpu_ns"] = (double) row.cpuNanos / row.numMessages;
+}
+
+int main(int argc, char** argv) {
+    std::vector<TransportInfo> &registry = transportRegistry();
+    for (size_t i = 0; i < registry.size(); i++) {
+        const TransportInfo *info = &registry[i];
+        for (int separate = 0; separate < 2; separate++) {
+            if (separate && (info->flags & TransportSameProcessOnly)) {
+                continue;
+            }
+            std::string name = std::string("BM_ipc_roundtrip<") + info->name
+                + (separate ? ">/separate" : ">/same");
+            benchmark::RegisterBenchmark(name.c_str(), BM_ipc_roundtrip, info,
+                separate != 0)
+                ->Unit(benchmark::kMicrosecond)
+                ->UseManualTime()
+                ->RangeMultiplier(8)->Range(64, 64 << 10);
+        }
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
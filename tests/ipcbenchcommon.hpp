@@ -0,0 +1,82 @@
+#pragma once
+#include <stdio.h>
+#include <benchmark/benchmark.h>
+#include "transport.h"
+
+// Helpers of the benchmarks that run the ipcperf loops in process: the
+// ping pong handlers, round trip reporting and the ports of the runs.
+
+// Ports of the runs of one benchmark binary. A fresh port per run avoids
+// sockets in TIME_WAIT, and every binary starts from its own first port so
+// benchmarks run one after the other do not meet either.
+class PortSequence {
+public:
+    explicit PortSequence(int first) : next(first) {
+    }
+
+    void take(char *port, size_t size) {
+        snprintf(port, size, "%d", next++);
+    }
+
+private:
+    int next;
+};
+
+class PingServer: public EventHandler {
+public:
+    void process(char *data, int len, bool iseof) {
+        send(data, len, true);
+    }
+};
+
+// Sends the next message once the whole echo of the last one is back
+class PingClient: public EventHandler {
+public:
+    int numLeft;
+    int size;
+    int numGot;
+    char message[MaxMessageSize];
+
+    void enable() {
+        numGot = 0;
+        send(message, size, true);
+    }
+
+    // A stream transport may split an echo, count bytes
+    void process(char *data, int len, bool iseof) {
+        numGot += len;
+        if (numGot < size) {
+            return;
+        }
+        numGot = 0;
+        if (--numLeft == 0) {
+            getParent()->cancelLoop();
+            return;
+        }
+        send(message, size, true);
+    }
+};
+
+// A run of numRoundTrips echoes of size bytes, the time per iteration is
+// the measured time per round trip
+inline void reportRoundTrips(benchmark::State& state, uint64_t elapsedNanos,
+    uint64_t numRoundTrips, int size) {
+    double secsPerRoundTrip = elapsedNanos / 1e9 / numRoundTrips;
+    for (auto _ : state) {
+        state.SetIterationTime(secsPerRoundTrip);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * size * 2);
+}
+
+// A run that sends state.max_iterations messages of state.range(0) bytes
+inline void reportRoundTrips(benchmark::State& state, uint64_t elapsedNanos) {
+    reportRoundTrips(state, elapsedNanos, state.max_iterations,
+        (int) state.range(0));
+}
+
+inline void skipRun(benchmark::State& state, const char *reason) {
+    state.SkipWithError(reason);
+    for (auto _ : state) {
+    }
+}
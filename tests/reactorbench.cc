@@ -0,0 +1,85 @@
+#include <string>
+#include <vector>
+#include "benchcommon.hpp"
+#include "transport.h"
+
+// The cache calc pattern of the other benchmarks on a bare ipcperf event
+// loop: every task calculates, waits on a timer of the loop and calculates
+// again, all in the loop's thread. It is the hand-rolled counterpart of
+// BM_cachecalc_boost_coroutine_io_context and shows what the frameworks add
+// on top of the system's readiness API. A loop is created per iteration
+// outside the timed region.
+
+struct ReactorTask: public TimerHandler {
+    EventMain *pMain;
+    cachetype *pCache;
+    unsigned *pCompleted;
+    uint64_t sleepNanos;
+    bool isWaiting;
+
+    // Started by a timer of delay 0, like a task posted to the loop
+    void onTimer(int id) {
+        calc(*pCache);
+        if (!isWaiting) {
+            isWaiting = true;
+            pMain->addTimer(sleepNanos, this);
+            return;
+        }
+        if (++*pCompleted == max_iter) {
+            pMain->cancelLoop();
+        }
+    }
+};
+
+static void BM_cachecalc_reactor(benchmark::State& state,
+    const TransportInfo *info) {
+    uint64_t sleepNanos = state.range(0) * 1000;
+    std::vector<ReactorTask> tasks(max_iter);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        EventMain *pMain = info->factory();
+        pMain->initialize();
+        cachetype cache;
+        unsigned completed = 0;
+        state.ResumeTiming();
+
+        for (unsigned i = 0; i < max_iter; i++) {
+            ReactorTask &task = tasks[i];
+            task.pMain = pMain;
+            task.pCache = &cache;
+            task.pCompleted = &completed;
+            task.sleepNanos = sleepNanos;
+            task.isWaiting = false;
+            pMain->addTimer(0, &task);
+        }
+        pMain->process();
+
+        state.PauseTiming();
+        checkWork(state, cache);
+        delete pMain;
+        state.ResumeTiming();
+    }
+}
+
+int main(int argc, char** argv) {
+    std::vector<TransportInfo> &registry = transportRegistry();
+    for (size_t i = 0; i < registry.size(); i++) {
+        const TransportInfo *info = &registry[i];
+        if (!(info->flags & TransportTimers)) {
+            continue;
+        }
+        std::string name = std::string("BM_cachecalc_reactor<") + info->name
+            + ">";
+        benchmark::RegisterBenchmark(name.c_str(), BM_cachecalc_reactor, info)
+            ->Unit(benchmark::kMillisecond)
+            ->Range(8, 64);
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,262 @@
+#include <deque>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "ipcbenchcommon.hpp"
+#include "histogram.h"
+#include "rpc.h"
+
+// Per call cost of the RPC layer (rpc.h) and what a slow handler does to
+// the calls around it. A client keeps state.range(0) calls outstanding on
+// one connection to a server in the same loop and sends state.max_iterations
+// of them; the time per iteration is the measured time per call.
+//
+// - BM_echo_frames: bare frames echoed with their sequence number, the
+//   raw echo path the RPC layer is built on
+// - BM_rpc_fast: every call goes to a method that replies at once
+// - BM_rpc_deferred: every 16th call goes to a method that replies from a
+//   loop timer SlowMicros later, the fast calls pass it and complete out of
+//   order
+// - BM_rpc_inline: the slow method spins SlowMicros in the loop before it
+//   replies, so the calls behind it wait: head-of-line blocking
+//
+// The fast_p50_us and fast_p99_us counters are the round trips of the fast
+// calls, slow_p50_us that of the slow ones.
+
+const int SlowEvery = 16;
+const uint64_t SlowMicros = 50;
+const int BodySize = 64;
+
+enum BenchMethod {
+    MethodFast = 1,
+    MethodDeferred = 2,
+    MethodInline = 3
+};
+
+struct CallBody {
+    uint64_t sendNanos;
+    char pad[BodySize - sizeof(uint64_t)];
+};
+
+static PortSequence ports(19700);
+
+class FastMethod: public RpcTypedMethod<CallBody> {
+public:
+    void handle(RpcCall &call, const CallBody &body) {
+        call.reply(body);
+    }
+};
+
+// Replies SlowMicros later from a timer. All calls wait the same time, so
+// the timers fire in the order the calls came.
+class DeferredMethod: public RpcTypedMethod<CallBody>, public TimerHandler {
+public:
+    EventMain *pMain;
+    std::deque<std::pair<RpcCall, CallBody> > waiting;
+
+    void handle(RpcCall &call, const CallBody &body) {
+        waiting.push_back(std::make_pair(call, body));
+        pMain->addTimer(SlowMicros * 1000, this);
+    }
+
+    void onTimer(int id) {
+        std::pair<RpcCall, CallBody> &front = waiting.front();
+        front.first.reply(front.second);
+        waiting.pop_front();
+    }
+};
+
+class InlineMethod: public RpcTypedMethod<CallBody> {
+public:
+    void handle(RpcCall &call, const CallBody &body) {
+        uint64_t until = getMonotonicNanos() + SlowMicros * 1000;
+        while (getMonotonicNanos() < until) {
+        }
+        call.reply(body);
+    }
+};
+
+class BenchClient: public RpcClient, public RpcCallback {
+public:
+    int window;
+    int numToSend;
+    int numLeft;
+    // 0 for fast calls only, else the method of every SlowEvery'th call
+    uint32_t slowMethod;
+    int numSent;
+    LatencyHistogram fast;
+    LatencyHistogram slow;
+
+    void connected() {
+        for (int i = 0; i < window && numSent < numToSend; i++) {
+            sendNext();
+        }
+    }
+
+    void sendNext() {
+        CallBody body;
+        memset(&body, 0, sizeof(body));
+        body.sendNanos = getMonotonicNanos();
+        bool isSlow = slowMethod && numSent % SlowEvery == SlowEvery - 1;
+        call(isSlow ? slowMethod : (uint32_t) MethodFast, body, this);
+        numSent++;
+    }
+
+    void onResponse(uint64_t callId, int status, const char *data,
+            uint32_t len) {
+        CallBody body;
+        if (status != RpcOk || len != sizeof(body)) {
+            ERROR_OUT("Call %llu failed with status %d\n",
+                    (unsigned long long) callId, status);
+            exit(1);
+        }
+        memcpy(&body, data, sizeof(body));
+        uint64_t nanos = getMonotonicNanos() - body.sendNanos;
+        // Call ids start at 1 and follow the order of sending
+        bool isSlow = slowMethod && (callId - 1) % SlowEvery == SlowEvery - 1;
+        (isSlow ? slow : fast).record(nanos);
+        if (--numLeft == 0) {
+            getParent()->cancelLoop();
+            return;
+        }
+        if (numSent < numToSend) {
+            sendNext();
+        }
+    }
+};
+
+// Echoes frames as they come, the frame type is not looked at
+class FrameEchoServer: public FrameHandler {
+public:
+    void processFrame(const FrameHeader &header, char *frame) {
+        send(frame, FrameHeaderSize + header.length, true);
+    }
+};
+
+class FrameEchoClient: public FrameHandler {
+public:
+    int window;
+    int numToSend;
+    int numLeft;
+    int numSent;
+    LatencyHistogram fast;
+
+    void enable() {
+        for (int i = 0; i < window && numSent < numToSend; i++) {
+            sendNext();
+        }
+    }
+
+    void sendNext() {
+        CallBody body;
+        memset(&body, 0, sizeof(body));
+        body.sendNanos = getMonotonicNanos();
+        sendFrame(1, 0, numSent++, (const char*) &body, sizeof(body));
+    }
+
+    void processFrame(const FrameHeader &header, char *frame) {
+        CallBody body;
+        memcpy(&body, frame + FrameHeaderSize, sizeof(body));
+        fast.record(getMonotonicNanos() - body.sendNanos);
+        if (--numLeft == 0) {
+            getParent()->cancelLoop();
+            return;
+        }
+        if (numSent < numToSend) {
+            sendNext();
+        }
+    }
+};
+
+static void reportCalls(benchmark::State& state, uint64_t elapsedNanos,
+    const LatencyHistogram &fast, const LatencyHistogram *pSlow) {
+    double secsPerCall = elapsedNanos / 1e9 / state.max_iterations;
+    for (auto _ : state) {
+        state.SetIterationTime(secsPerCall);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["fast_p50_us"] = fast.valueAtPercentile(50) / 1000.0;
+    state.counters["fast_p99_us"] = fast.valueAtPercentile(99) / 1000.0;
+    if (pSlow) {
+        state.counters["slow_p50_us"] = pSlow->valueAtPercentile(50) / 1000.0;
+    }
+}
+
+static void BM_echo_frames(benchmark::State& state, const TransportInfo *info) {
+    char port[32];
+    ports.take(port, sizeof(port));
+    EventMain *pMain = info->factory();
+    FrameEchoServer *server = new FrameEchoServer();
+    FrameEchoClient *client = new FrameEchoClient();
+    client->window = (int) state.range(0);
+    client->numToSend = client->numLeft = (int) state.max_iterations;
+    client->numSent = 0;
+
+    pMain->initialize();
+    pMain->bindServer(port, server);
+    uint64_t beginNanos = getMonotonicNanos();
+    pMain->connectToServer("127.0.0.1", port, client);
+    pMain->process();
+    reportCalls(state, getMonotonicNanos() - beginNanos, client->fast, NULL);
+    delete client;
+    delete server;
+    delete pMain;
+}
+
+static void BM_rpc(benchmark::State& state, const TransportInfo *info,
+    uint32_t slowMethod) {
+    char port[32];
+    ports.take(port, sizeof(port));
+    EventMain *pMain = info->factory();
+    FastMethod fastMethod;
+    DeferredMethod deferredMethod;
+    deferredMethod.pMain = pMain;
+    InlineMethod inlineMethod;
+    RpcServer *server = new RpcServer();
+    server->registerMethod(MethodFast, &fastMethod);
+    server->registerMethod(MethodDeferred, &deferredMethod);
+    server->registerMethod(MethodInline, &inlineMethod);
+    BenchClient *client = new BenchClient();
+    client->window = (int) state.range(0);
+    client->numToSend = client->numLeft = (int) state.max_iterations;
+    client->numSent = 0;
+    client->slowMethod = slowMethod;
+
+    pMain->initialize();
+    pMain->bindServer(port, server);
+    uint64_t beginNanos = getMonotonicNanos();
+    pMain->connectToServer("127.0.0.1", port, client);
+    pMain->process();
+    reportCalls(state, getMonotonicNanos() - beginNanos, client->fast,
+        slowMethod ? &client->slow : NULL);
+    delete client;
+    delete server;
+    delete pMain;
+}
+
+int main(int argc, char** argv) {
+    std::vector<TransportInfo> &registry = transportRegistry();
+    for (size_t i = 0; i < registry.size(); i++) {
+        const TransportInfo *info = &registry[i];
+        std::string suffix = std::string("<") + info->name + ">";
+        benchmark::RegisterBenchmark(("BM_echo_frames" + suffix).c_str(),
+            BM_echo_frames, info)
+            ->UseManualTime()->Unit(benchmark::kMicrosecond)->Arg(1)->Arg(16);
+        benchmark::RegisterBenchmark(("BM_rpc_fast" + suffix).c_str(),
+            BM_rpc, info, 0)
+            ->UseManualTime()->Unit(benchmark::kMicrosecond)->Arg(1)->Arg(16);
+        benchmark::RegisterBenchmark(("BM_rpc_deferred" + suffix).c_str(),
+            BM_rpc, info, (uint32_t) MethodDeferred)
+            ->UseManualTime()->Unit(benchmark::kMicrosecond)->Arg(1)->Arg(16);
+        benchmark::RegisterBenchmark(("BM_rpc_inline" + suffix).c_str(),
+            BM_rpc, info, (uint32_t) MethodInline)
+            ->UseManualTime()->Unit(benchmark::kMicrosecond)->Arg(1)->Arg(16);
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}